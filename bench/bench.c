@@ -0,0 +1,331 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/*  File:       bench.c                                                     */
+/*                                                                          */
+/*  Purpose:    Microbenchmarks of the codec kernels. The codec is included */
+/*              as a single translation unit, so that the kernels are       */
+/*              measured exactly as they are compiled into the program.     */
+/*              Every kernel is run on a synthetic image and on the         */
+/*              bundled test images, with warmup runs and a number of       */
+/*              timed repetitions; median and 95th percentile of the run    */
+/*              time are reported together with the throughput.             */
+/*                                                                          */
+/*              usage: ic19_jpeg_light_bench [repetitions [image ...]]      */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include <unistd.h>
+
+#define JPEG_LIGHT_NO_MAIN
+#include "../src/ic19_jpeg_light.c"
+
+#define BENCH_WARMUP 2          /* untimed runs before measuring */
+#define BENCH_REPETITIONS 15    /* default number of timed runs */
+#define BENCH_MAXREPETITIONS 1000
+#define SYNTHETIC_SIZE 1024     /* size of synthetic test image */
+
+/* data shared by all kernels of one image */
+typedef struct {
+  const char *name;       /* image name */
+  long nx, ny;            /* image size */
+  long maxval;            /* maximum sample value of the image file */
+  long nx_ext, ny_ext;    /* size extended to multiples of the block size */
+  long N;                 /* block size of the block kernels */
+  const QuantTable *qt;   /* default matrix for blocks of size N */
+  long ***rgb;            /* RGB image */
+  long ***ycbcr;          /* YCbCr image */
+  long **y;               /* luma, not changed by the colour kernels */
+  long **luma;            /* extended luma channel */
+  double **dct;           /* DCT coefficients of luma */
+  long **quant;           /* quantised DCT coefficients of luma */
+  long **tmp;             /* temporary channel */
+  double **rec;           /* reconstruction of luma */
+  BITWRITER streams[WNC_STREAMS]; /* coded luma */
+  long *symbols;          /* AC symbols of luma */
+  long n;                 /* number of AC symbols */
+  BITWRITER lossless[WNC_STREAMS]; /* losslessly coded luma */
+  char file[1000];        /* temporary file */
+} BenchData;
+
+/* kernel under test */
+typedef void (*BenchKernel)(BenchData *d);
+
+static long repetitions = BENCH_REPETITIONS;
+
+/*--------------------------------------------------------------------------*/
+static void bench(BenchData *d,          /* data */
+                  const char *kernel,    /* name of kernel */
+                  BenchKernel run,       /* kernel */
+                  double bytes,          /* bytes processed per run */
+                  double units,          /* blocks or symbols per run */
+                  const char *unit) {    /* name of units, 0 if none */
+  /* runs a kernel with warmup and prints median and 95th percentile of the
+     run time and the throughput at the median */
+  double times[BENCH_MAXREPETITIONS];
+  double start, median, p95;
+  long i;
+
+  for (i=0;i<BENCH_WARMUP;i++) run(d);
+  for (i=0;i<repetitions;i++) {
+    start = get_wall_time();
+    run(d);
+    times[i] = get_wall_time()-start;
+  }
+  qsort(times,repetitions,sizeof(double),compare_double);
+  median = times[repetitions/2];
+  p95 = times[(long)ceil(0.95*repetitions)-1];
+
+  printf("%-12s %-22s %10.3f %10.3f %10.1f",d->name,kernel,median*1000.0,
+         p95*1000.0,bytes/median/1000000.0);
+  if (unit != 0) printf(" %12.0f %s/s",units/median,unit);
+  printf("\n");
+}
+
+/*--------------------------------------------------------------------------*/
+/* kernels */
+
+static void run_dct(BenchData *d) {
+  block_DCT(d->luma,d->nx_ext,d->ny_ext,d->N,d->qt->flat_range,d->dct);
+}
+
+static void run_quantise(BenchData *d) {
+  block_quantise(d->dct,d->nx_ext,d->ny_ext,d->qt,0,d->quant);
+}
+
+static void run_idct(BenchData *d) {
+  block_IDCT(d->quant,d->nx_ext,d->ny_ext,d->N,d->rec);
+}
+
+static void run_block_encode(BenchData *d) {
+  long i;
+  for (i=0;i<WNC_STREAMS;i++) d->streams[i].pos=0;
+  block_encode(d->quant,d->nx_ext,d->ny_ext,d->N,0,d->ny_ext/d->N,
+               NDCSYMBOLS,0,d->streams);
+}
+
+static void run_encode_wnc(BenchData *d) {
+  BITWRITER out;
+  bw_init(&out);
+  encode_adaptive_wnc(d->symbols,d->n,NSYMBOLS,WNC_R,WNC_M,0,&out);
+  bw_free(&out);
+}
+
+static void run_decode_wnc(BenchData *d) {
+  BITREADER in;
+  br_init(&in,d->streams[STREAM_AC_SYMBOLS].data,
+          bw_bytes(&d->streams[STREAM_AC_SYMBOLS]));
+  decode_adaptive_wnc(&in,d->n,NSYMBOLS,WNC_R,WNC_M,0,d->symbols);
+}
+
+static void run_lossless_encode(BenchData *d) {
+  long i;
+  for (i=0;i<WNC_STREAMS;i++) d->lossless[i].pos=0;
+  lossless_encode(d->y,d->nx,d->ny,0,d->ny,NDCSYMBOLS,0,d->lossless);
+}
+
+static void run_lossless_decode(BenchData *d) {
+  BITREADER symbols, offsets;
+  br_init(&symbols,d->lossless[STREAM_DC_SYMBOLS].data,
+          bw_bytes(&d->lossless[STREAM_DC_SYMBOLS]));
+  br_init(&offsets,d->lossless[STREAM_DC_OFFSETS].data,
+          bw_bytes(&d->lossless[STREAM_DC_OFFSETS]));
+  lossless_decode(&symbols,&offsets,d->nx,d->ny,0,d->ny,NDCSYMBOLS,WNC_R,
+                  WNC_M,d->tmp);
+}
+
+static void run_bfputb(BenchData *d) {
+  BFILE *file = bfopen(d->file,"w");
+  long i;
+  for (i=0;i<d->nx*d->ny;i++) bfputb((int)(i*2654435761u>>31)&1,file);
+  bfclose(file);
+}
+
+static void run_bfgetb(BenchData *d) {
+  BFILE *file = bfopen(d->file,"r");
+  long i, sum=0;
+  for (i=0;i<d->nx*d->ny;i++) sum += bfgetb(file);
+  bfclose(file);
+  if (sum < 0) printf("unexpected\n");
+}
+
+static void run_rgb_to_ycbcr(BenchData *d) {
+  RGB_to_YCbCr(d->rgb,d->ycbcr,d->nx,d->ny);
+}
+
+static void run_ycbcr_to_rgb(BenchData *d) {
+  YCbCr_to_RGB(d->ycbcr,d->ycbcr,d->nx,d->ny);
+}
+
+static void run_subsample(BenchData *d) {
+  subsample(d->ycbcr[1],d->tmp,d->nx,d->ny,2,2);
+}
+
+static void run_upsample(BenchData *d) {
+  upsample(d->tmp,d->ycbcr[2],d->nx,d->ny,2,2);
+}
+
+static void run_write_ppm(BenchData *d) {
+  write_ppm(d->rgb,d->nx,d->ny,MAXGREYVALUE,d->file,0);
+}
+
+static void run_read_ppm(BenchData *d) {
+  read_ppm_and_allocate_memory(d->file,&d->nx,&d->ny,&d->maxval,&d->rgb);
+}
+
+/*--------------------------------------------------------------------------*/
+static void synthesise(long ***rgb, long nx, long ny) {
+  /* deterministic test image: smooth gradients, a few edges and noise */
+  long x,y,c;
+  unsigned long seed = 12345;
+  for (x=1;x<=nx;x++)
+    for (y=1;y<=ny;y++)
+      for (c=0;c<3;c++) {
+        seed = seed*6364136223846793005UL+1442695040888963407UL;
+        rgb[c][x][y] = (x*(c+1)+y*(3-c))*255/(nx+ny)/2
+                       + (((x/64+y/64) & 1) ? 64 : 0)
+                       + (long)(seed >> 60);
+        if (rgb[c][x][y] > 255) rgb[c][x][y] = 255;
+      }
+}
+
+/*--------------------------------------------------------------------------*/
+static void set_block_size(BenchData *d, long N) {
+  /* prepare luma, coefficients and quantised coefficients for the block
+     kernels with NxN blocks; the luma is extended from d->y, since
+     YCbCr_to_RGB converts d->ycbcr in place */
+  d->N = N;
+  d->qt = get_quant_table(default_weights,N);
+  d->nx_ext = (d->nx+N-1)/N*N;
+  d->ny_ext = (d->ny+N-1)/N*N;
+  extend_image(d->y,d->nx,d->ny,N,d->luma);
+  run_dct(d);
+  run_quantise(d);
+}
+
+/*--------------------------------------------------------------------------*/
+static void bench_image(const char *name, const char *file) {
+  /* run all kernels on one image, synthetic if file is 0 */
+  BenchData d;
+  BITREADER in;
+  double px, blocks;
+  long i, N, mx, my;
+  char kernel[64];
+
+  memset(&d,0,sizeof(d));
+  d.name = name;
+  if (file == 0) {
+    d.nx = d.ny = SYNTHETIC_SIZE;
+    alloc_long_cubix(&d.rgb,3,d.nx+2,d.ny+2);
+    synthesise(d.rgb,d.nx,d.ny);
+  } else {
+    read_ppm_and_allocate_memory(file,&d.nx,&d.ny,&d.maxval,&d.rgb);
+  }
+  /* channels are allocated for the largest block size */
+  mx = (d.nx+MAXBLOCKSIZE-1)/MAXBLOCKSIZE*MAXBLOCKSIZE;
+  my = (d.ny+MAXBLOCKSIZE-1)/MAXBLOCKSIZE*MAXBLOCKSIZE;
+  px = (double)d.nx*(double)d.ny;
+  sprintf(d.file,"/tmp/ic19_bench_%ld.tmp",(long)getpid());
+
+  alloc_long_cubix(&d.ycbcr,3,d.nx+2,d.ny+2);
+  alloc_long_matrix(&d.y,d.nx+2,d.ny+2);
+  alloc_long_matrix(&d.luma,mx+2,my+2);
+  alloc_long_matrix(&d.quant,mx+2,my+2);
+  alloc_long_matrix(&d.tmp,mx+2,my+2);
+  alloc_double_matrix(&d.dct,mx+2,my+2);
+  alloc_double_matrix(&d.rec,mx+2,my+2);
+  for (i=0;i<WNC_STREAMS;i++) {
+    bw_init(&d.streams[i]);
+    bw_init(&d.lossless[i]);
+  }
+
+  /* prepare inputs of all stages */
+  RGB_to_YCbCr(d.rgb,d.ycbcr,d.nx,d.ny);
+  copy_matrix_long(d.ycbcr[0],d.y,d.nx,d.ny);
+  set_block_size(&d,8);
+  blocks = (double)(d.nx_ext/8)*(double)(d.ny_ext/8);
+  d.n = block_encode(d.quant,d.nx_ext,d.ny_ext,8,0,d.ny_ext/8,NDCSYMBOLS,0,
+                     d.streams);
+  alloc_long_vector(&d.symbols,d.n+1);
+  br_init(&in,d.streams[STREAM_AC_SYMBOLS].data,
+          bw_bytes(&d.streams[STREAM_AC_SYMBOLS]));
+  decode_adaptive_wnc(&in,d.n,NSYMBOLS,WNC_R,WNC_M,0,d.symbols);
+  run_lossless_encode(&d);
+
+  printf("\n%-12s %-22s %10s %10s %10s %12s\n","image","kernel",
+         "median ms","p95 ms","MB/s","throughput");
+  printf("%s: %ld x %ld, %ld blocks, %ld AC symbols\n",name,d.nx,d.ny,
+         (long)blocks,d.n);
+  bench(&d,"block_DCT",run_dct,px*sizeof(long),blocks,"blocks");
+  bench(&d,"block_quantise",run_quantise,px*sizeof(double),blocks,
+        "blocks");
+  bench(&d,"block_IDCT",run_idct,px*sizeof(long),blocks,"blocks");
+  bench(&d,"block_encode",run_block_encode,px*sizeof(long),blocks,"blocks");
+  bench(&d,"encode_adaptive_wnc",run_encode_wnc,d.n*sizeof(long),d.n,
+        "symbols");
+  bench(&d,"decode_adaptive_wnc",run_decode_wnc,
+        bw_bytes(&d.streams[STREAM_AC_SYMBOLS]),d.n,"symbols");
+  bench(&d,"lossless_encode",run_lossless_encode,px*sizeof(long),px,
+        "samples");
+  bench(&d,"lossless_decode",run_lossless_decode,px*sizeof(long),px,
+        "samples");
+  bench(&d,"RGB_to_YCbCr",run_rgb_to_ycbcr,3*px*sizeof(long),0,0);
+  bench(&d,"YCbCr_to_RGB",run_ycbcr_to_rgb,3*px*sizeof(long),0,0);
+  bench(&d,"subsample 2x2",run_subsample,px*sizeof(long),0,0);
+  bench(&d,"upsample 2x2",run_upsample,px*sizeof(long),0,0);
+  bench(&d,"bfputb",run_bfputb,px/8.0,0,0);
+  bench(&d,"bfgetb",run_bfgetb,px/8.0,0,0);
+  bench(&d,"write_ppm",run_write_ppm,3*px,0,0);
+  bench(&d,"read_ppm",run_read_ppm,3*px,0,0);
+  remove(d.file);
+
+  /* block kernels with the other block sizes, throughput in pixels */
+  for (N=4;N<=16;N*=4) {
+    set_block_size(&d,N);
+    blocks = (double)(d.nx_ext/N)*(double)(d.ny_ext/N);
+    sprintf(kernel,"block_DCT %ldx%ld",N,N);
+    bench(&d,kernel,run_dct,px*sizeof(long),blocks,"blocks");
+    sprintf(kernel,"block_quantise %ldx%ld",N,N);
+    bench(&d,kernel,run_quantise,px*sizeof(double),blocks,"blocks");
+    sprintf(kernel,"block_IDCT %ldx%ld",N,N);
+    bench(&d,kernel,run_idct,px*sizeof(long),blocks,"blocks");
+    sprintf(kernel,"block_encode %ldx%ld",N,N);
+    bench(&d,kernel,run_block_encode,px*sizeof(long),blocks,"blocks");
+  }
+
+  /* free memory */
+  disalloc_long_vector(d.symbols,d.n+1);
+  for (i=0;i<WNC_STREAMS;i++) {
+    bw_free(&d.streams[i]);
+    bw_free(&d.lossless[i]);
+  }
+  disalloc_long_cubix(d.rgb,3,d.nx+2,d.ny+2);
+  disalloc_long_cubix(d.ycbcr,3,d.nx+2,d.ny+2);
+  disalloc_long_matrix(d.y,d.nx+2,d.ny+2);
+  disalloc_long_matrix(d.luma,mx+2,my+2);
+  disalloc_long_matrix(d.quant,mx+2,my+2);
+  disalloc_long_matrix(d.tmp,mx+2,my+2);
+  disalloc_double_matrix(d.dct,mx+2,my+2);
+  disalloc_double_matrix(d.rec,mx+2,my+2);
+}
+
+/*--------------------------------------------------------------------------*/
+int main(int argc, char **args) {
+  long i;
+
+  if (argc > 1) repetitions = atol(args[1]);
+  if (repetitions < 1) repetitions = 1;
+  if (repetitions > BENCH_MAXREPETITIONS) repetitions = BENCH_MAXREPETITIONS;
+
+  printf("ic19_jpeg_light kernel benchmarks, %ld repetitions after %d warmup "
+         "runs\n",repetitions,BENCH_WARMUP);
+
+  bench_image("synthetic",0);
+  if (argc > 2) {
+    for (i=2;i<argc;i++) bench_image(args[i],args[i]);
+  } else {
+    bench_image("kodim23",  "kodim23.ppm");
+    bench_image("lena_mini","lena_mini.ppm");
+  }
+
+  return 0;
+}
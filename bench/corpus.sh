@@ -0,0 +1,151 @@
+#!/bin/sh
+#----------------------------------------------------------------------------#
+#                                                                            #
+#  File:       corpus.sh                                                     #
+#                                                                            #
+#  Purpose:    End-to-end benchmark over a corpus of synthetic images.       #
+#              Every image is encoded and decoded at several quantisation    #
+#              and subsampling settings; encode and decode time (best of     #
+#              several runs), compressed size, bits per pixel, MSE and PSNR  #
+#              are written to a CSV file. If a baseline CSV is given, the    #
+#              throughput of every setting is compared against it and the    #
+#              script fails if any setting is slower by more than the        #
+#              threshold. A missing baseline is an error as well, unless     #
+#              -u is given to record it on this machine.                     #
+#                                                                            #
+#  usage:      bench/corpus.sh [-o results.csv] [-b baseline.csv]            #
+#                              [-t threshold_percent] [-r runs] [-u]         #
+#                                                                            #
+#              -u copies the results to the baseline file afterwards, and    #
+#              creates it on the first run.                                  #
+#              Run from the repository root after "make"; the corpus is      #
+#              synthesised into bench/corpus on first use.                   #
+#                                                                            #
+#----------------------------------------------------------------------------#
+
+set -e
+
+CODEC=./ic19_jpeg_light
+SYNTH=./ic19_jpeg_light_synth
+CORPUS=bench/corpus
+RESULTS=bench/corpus_results.csv
+BASELINE=
+THRESHOLD=10
+RUNS=3
+UPDATE=0
+
+# settings: quantisation parameter (0: default matrix) and subsampling
+QUANTISERS="0 4 16"
+SUBSAMPLINGS="1 2 4:2:2"
+
+# images: kind width height
+IMAGES="photo 256 256
+photo 640 480
+photo 1920 1080
+document 1240 1754
+noise 512 512
+grey 1024 768"
+
+while getopts "o:b:t:r:u" opt; do
+  case $opt in
+    o) RESULTS=$OPTARG ;;
+    b) BASELINE=$OPTARG ;;
+    t) THRESHOLD=$OPTARG ;;
+    r) RUNS=$OPTARG ;;
+    u) UPDATE=1 ;;
+    *) sed -n 16,22p "$0"; exit 2 ;;
+  esac
+done
+
+if [ ! -x $CODEC ] || [ ! -x $SYNTH ]; then
+  echo "ERROR: $CODEC or $SYNTH missing, run make first."
+  exit 2
+fi
+
+# throughput depends on the machine, so the baseline is recorded locally
+if [ -n "$BASELINE" ] && [ ! -f "$BASELINE" ] && [ $UPDATE -eq 0 ]; then
+  echo "ERROR: Baseline $BASELINE not found; record it with -u" \
+       "(make corpus-baseline) first."
+  exit 2
+fi
+
+# synthesise corpus
+mkdir -p $CORPUS
+echo "$IMAGES" | while read kind nx ny; do
+  ext=ppm; [ $kind = grey ] && ext=pgm
+  file=$CORPUS/${kind}_${nx}x${ny}.$ext
+  [ -f $file ] || $SYNTH $kind $nx $ny $file
+done
+
+WORK=$(mktemp -d)
+trap 'rm -rf $WORK' EXIT
+
+# best_time "pattern" command...: smallest time printed after pattern
+best_time() {
+  pattern=$1; shift
+  best=
+  i=0
+  while [ $i -lt $RUNS ]; do
+    t=$("$@" | awk -v p="$pattern" 'index($0,p)==1 {print $(NF-1)}')
+    best=$(awk -v a="$best" -v b="$t" 'BEGIN {print (a=="" || b<a) ? b : a}')
+    i=$((i+1))
+  done
+  echo $best
+}
+
+echo "image,width,height,q,s,encode_s,decode_s,bytes,bpp,mse,psnr,encode_mpps,decode_mpps" > $RESULTS
+
+for file in $CORPUS/*.p?m; do
+  name=$(basename $file)
+  size=$(awk 'NR==1 {next} /^#/ {next} {print $1 "x" $2; exit}' $file)
+  nx=${size%x*}; ny=${size#*x}
+  for q in $QUANTISERS; do
+    qarg=; [ $q -gt 0 ] && qarg="-q $q"
+    for s in $SUBSAMPLINGS; do
+      enc=$(best_time "Encoding time:" $CODEC -i $file -o $WORK/c $qarg -s $s)
+      mse=$($CODEC -i $file -o $WORK/c $qarg -s $s |
+            awk '/^Resulting MSE:/ {print $3}')
+      dec=$(best_time "Decoding time:" $CODEC -i $WORK/c.wnc -o $WORK/d)
+      bytes=$(wc -c < $WORK/c.wnc)
+      awk -v n=$name -v nx=$nx -v ny=$ny -v q=$q -v s=$s -v e=$enc -v d=$dec \
+          -v b=$bytes -v m=$mse 'BEGIN {
+        psnr = (m > 0) ? 10*log(255*255/m)/log(10) : 99.99;
+        printf "%s,%d,%d,%d,%s,%.6f,%.6f,%d,%.4f,%.4f,%.2f,%.3f,%.3f\n",
+               n, nx, ny, q, s, e, d, b, 8*b/(nx*ny), m, psnr,
+               nx*ny/e/1e6, nx*ny/d/1e6 }' >> $RESULTS
+    done
+  done
+done
+
+column -s, -t < $RESULTS 2>/dev/null || cat $RESULTS
+echo "Results written to $RESULTS"
+
+# compare throughput against baseline
+status=0
+if [ -n "$BASELINE" ] && [ -f "$BASELINE" ]; then
+  awk -F, -v t=$THRESHOLD '
+    NR == FNR { if (FNR > 1) { enc[$1","$4","$5]=$12; dec[$1","$4","$5]=$13 }
+                next }
+    FNR == 1 { next }
+    { key = $1","$4","$5
+      if (!(key in enc)) { printf "new      %s\n", key; next }
+      de = 100*($12-enc[key])/enc[key]; dd = 100*($13-dec[key])/dec[key]
+      flag = (de < -t || dd < -t) ? "REGRESS" : "ok"
+      if (flag == "REGRESS") fail = 1
+      printf "%-8s %-28s encode %+6.1f%%  decode %+6.1f%%\n", flag, key, de, dd }
+    END { exit fail }' "$BASELINE" $RESULTS || status=1
+  if [ $status -ne 0 ]; then
+    echo "FAILED: throughput regressed by more than $THRESHOLD% against $BASELINE"
+  else
+    echo "PASSED: no throughput regression above $THRESHOLD% against $BASELINE"
+  fi
+elif [ -n "$BASELINE" ]; then
+  echo "Baseline $BASELINE not found, recording it."
+fi
+
+if [ $UPDATE -eq 1 ] && [ -n "$BASELINE" ]; then
+  cp $RESULTS "$BASELINE"
+  echo "Baseline $BASELINE updated."
+fi
+
+exit $status
@@ -0,0 +1,92 @@
+#!/bin/sh
+#----------------------------------------------------------------------------#
+#                                                                            #
+#  File:       ladder.sh                                                     #
+#                                                                            #
+#  Purpose:    Wall time of a quality ladder: one invocation with --ladder   #
+#              against one separate program run per quality (-Q), for every  #
+#              image of the corpus of corpus.sh. Times are the best of       #
+#              several runs and include process start, loading and writing   #
+#              of all outputs.                                               #
+#                                                                            #
+#  usage:      bench/ladder.sh [-q "q1,q2,..."] [-r runs]                    #
+#                                                                            #
+#              Run from the repository root after "make"; the corpus is      #
+#              synthesised into bench/corpus on first use.                   #
+#                                                                            #
+#----------------------------------------------------------------------------#
+
+set -e
+
+CODEC=./ic19_jpeg_light
+SYNTH=./ic19_jpeg_light_synth
+CORPUS=bench/corpus
+LADDER=30,50,70,85,95
+RUNS=3
+
+# images: kind width height, as in corpus.sh
+IMAGES="photo 256 256
+photo 640 480
+photo 1920 1080
+document 1240 1754
+noise 512 512
+grey 1024 768"
+
+while getopts "q:r:" opt; do
+  case $opt in
+    q) LADDER=$OPTARG ;;
+    r) RUNS=$OPTARG ;;
+    *) sed -n 12,15p "$0"; exit 2 ;;
+  esac
+done
+
+if [ ! -x $CODEC ] || [ ! -x $SYNTH ]; then
+  echo "ERROR: $CODEC or $SYNTH missing, run make first."
+  exit 2
+fi
+
+# synthesise corpus
+mkdir -p $CORPUS
+echo "$IMAGES" | while read kind nx ny; do
+  ext=ppm; [ $kind = grey ] && ext=pgm
+  file=$CORPUS/${kind}_${nx}x${ny}.$ext
+  [ -f $file ] || $SYNTH $kind $nx $ny $file
+done
+
+WORK=$(mktemp -d)
+trap 'rm -rf $WORK' EXIT
+
+now() {
+  date +%s.%N
+}
+
+# best_time command...: smallest wall time of the command in seconds
+best_time() {
+  best=
+  i=0
+  while [ $i -lt $RUNS ]; do
+    start=$(now)
+    "$@" > /dev/null
+    t=$(awk -v a=$start -v b=$(now) 'BEGIN {print b-a}')
+    best=$(awk -v a="$best" -v b="$t" 'BEGIN {print (a=="" || b<a) ? b : a}')
+    i=$((i+1))
+  done
+  echo $best
+}
+
+# one program run per quality
+separate() {
+  for q in $(echo $LADDER | tr , ' '); do
+    $CODEC -i $1 -o $WORK/s -Q $q
+  done
+}
+
+levels=$(echo $LADDER | tr , '\n' | wc -l)
+echo "Quality ladder $LADDER ($levels levels), best of $RUNS runs"
+printf "%-26s %12s %12s %8s\n" image separate_s ladder_s speedup
+for file in $CORPUS/*.p?m; do
+  t_sep=$(best_time separate $file)
+  t_lad=$(best_time $CODEC -i $file -o $WORK/l --ladder $LADDER)
+  awk -v n=$(basename $file) -v s=$t_sep -v l=$t_lad \
+      'BEGIN { printf "%-26s %12.3f %12.3f %7.2fx\n", n, s, l, s/l }'
+done
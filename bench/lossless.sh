@@ -0,0 +1,91 @@
+#!/bin/sh
+#----------------------------------------------------------------------------#
+#                                                                            #
+#  File:       lossless.sh                                                   #
+#                                                                            #
+#  Purpose:    Lossless coding against the default lossy encode for every    #
+#              image of the corpus of corpus.sh: compression ratio, and      #
+#              encoding and decoding throughput in MB/s of the raw image,    #
+#              from the times the program reports (best of several runs,     #
+#              without loading and writing of files).                        #
+#                                                                            #
+#  usage:      bench/lossless.sh [-r runs] [-R restart]                      #
+#                                                                            #
+#              Run from the repository root after "make"; the corpus is      #
+#              synthesised into bench/corpus on first use.                   #
+#                                                                            #
+#----------------------------------------------------------------------------#
+
+set -e
+
+CODEC=./ic19_jpeg_light
+SYNTH=./ic19_jpeg_light_synth
+CORPUS=bench/corpus
+RUNS=3
+RESTART=0
+
+# images: kind width height, as in corpus.sh
+IMAGES="photo 256 256
+photo 640 480
+photo 1920 1080
+document 1240 1754
+noise 512 512
+grey 1024 768"
+
+while getopts "r:R:" opt; do
+  case $opt in
+    r) RUNS=$OPTARG ;;
+    R) RESTART=$OPTARG ;;
+    *) sed -n 12,15p "$0"; exit 2 ;;
+  esac
+done
+
+if [ ! -x $CODEC ] || [ ! -x $SYNTH ]; then
+  echo "ERROR: $CODEC or $SYNTH missing, run make first."
+  exit 2
+fi
+
+# synthesise corpus
+mkdir -p $CORPUS
+echo "$IMAGES" | while read kind nx ny; do
+  ext=ppm; [ $kind = grey ] && ext=pgm
+  file=$CORPUS/${kind}_${nx}x${ny}.$ext
+  [ -f $file ] || $SYNTH $kind $nx $ny $file
+done
+
+WORK=$(mktemp -d)
+trap 'rm -rf $WORK' EXIT
+
+# best_time pattern command...: smallest time in seconds that the command
+# reports on the line starting with pattern
+best_time() {
+  pattern=$1
+  shift
+  i=0
+  while [ $i -lt $RUNS ]; do
+    "$@" | awk -v p="$pattern" 'index($0, p) == 1 {print $3}'
+    i=$((i+1))
+  done | sort -g | head -1
+}
+
+# mode name options...: ratio and throughput of one coding mode
+mode() {
+  name=$1
+  shift
+  t_enc=$(best_time "Encoding time:" $CODEC -i $file -o $WORK/c "$@")
+  t_dec=$(best_time "Decoding time:" $CODEC -i $WORK/c.wnc -o $WORK/c)
+  awk -v n=$(basename $file) -v m=$name -v raw=$raw \
+      -v b=$(wc -c < $WORK/c.wnc) -v e=$t_enc -v d=$t_dec \
+      'BEGIN { printf "%-26s %-9s %10.3f %10.1f %10.1f\n", n, m, raw/b,
+               raw/e/1e6, raw/d/1e6 }'
+}
+
+echo "Lossless against lossy coding, restart $RESTART, best of $RUNS runs"
+printf "%-26s %-9s %10s %10s %10s\n" image mode ratio enc_MB/s dec_MB/s
+for file in $CORPUS/*.p?m; do
+  size=$(awk 'NR==1 {next} /^#/ {next} {print $1 "x" $2; exit}' $file)
+  ch=3; [ ${file##*.} = pgm ] && ch=1
+  raw=$(( ${size%x*} * ${size#*x} * ch ))
+  mode lossy -R $RESTART
+  mode lossless --lossless -R $RESTART
+done
@@ -0,0 +1,102 @@
+#!/bin/sh
+#----------------------------------------------------------------------------#
+#                                                                            #
+#  File:       quality.sh                                                    #
+#                                                                            #
+#  Purpose:    Rate-distortion curves over the quality setting -Q for the    #
+#              corpus of corpus.sh. Every image is encoded at each quality;  #
+#              compressed size, bits per pixel, MSE and PSNR are written to  #
+#              a CSV file, and the averages over the corpus are printed per  #
+#              quality to pick operating points. The default matrix without  #
+#              -Q is included as quality 0 for reference. With several       #
+#              block sizes (-b "4 8 16") the curves are compared per size.   #
+#                                                                            #
+#  usage:      bench/quality.sh [-o results.csv] [-q "qualities"]            #
+#                               [-s subsampling] [-b "block sizes"]          #
+#                                                                            #
+#              Run from the repository root after "make"; the corpus is      #
+#              synthesised into bench/corpus on first use.                   #
+#                                                                            #
+#----------------------------------------------------------------------------#
+
+set -e
+
+CODEC=./ic19_jpeg_light
+SYNTH=./ic19_jpeg_light_synth
+CORPUS=bench/corpus
+RESULTS=bench/quality_results.csv
+QUALITIES="0 5 10 20 30 40 50 60 70 75 80 85 90 95 100"
+SUBSAMPLING=2
+BLOCKSIZES=8
+
+# images: kind width height, as in corpus.sh
+IMAGES="photo 256 256
+photo 640 480
+photo 1920 1080
+document 1240 1754
+noise 512 512
+grey 1024 768"
+
+while getopts "o:q:s:b:" opt; do
+  case $opt in
+    o) RESULTS=$OPTARG ;;
+    q) QUALITIES=$OPTARG ;;
+    s) SUBSAMPLING=$OPTARG ;;
+    b) BLOCKSIZES=$OPTARG ;;
+    *) sed -n 14,19p "$0"; exit 2 ;;
+  esac
+done
+
+if [ ! -x $CODEC ] || [ ! -x $SYNTH ]; then
+  echo "ERROR: $CODEC or $SYNTH missing, run make first."
+  exit 2
+fi
+
+# synthesise corpus
+mkdir -p $CORPUS
+echo "$IMAGES" | while read kind nx ny; do
+  ext=ppm; [ $kind = grey ] && ext=pgm
+  file=$CORPUS/${kind}_${nx}x${ny}.$ext
+  [ -f $file ] || $SYNTH $kind $nx $ny $file
+done
+
+WORK=$(mktemp -d)
+trap 'rm -rf $WORK' EXIT
+
+echo "image,width,height,quality,s,b,bytes,bpp,mse,psnr" > $RESULTS
+
+for file in $CORPUS/*.p?m; do
+  name=$(basename $file)
+  size=$(awk 'NR==1 {next} /^#/ {next} {print $1 "x" $2; exit}' $file)
+  nx=${size%x*}; ny=${size#*x}
+  for block in $BLOCKSIZES; do
+    for quality in $QUALITIES; do
+      qarg=; [ $quality -gt 0 ] && qarg="-Q $quality"
+      mse=$($CODEC -i $file -o $WORK/c $qarg -s $SUBSAMPLING -b $block |
+            awk '/^Resulting MSE:/ {print $3}')
+      bytes=$(wc -c < $WORK/c.wnc)
+      awk -v n=$name -v nx=$nx -v ny=$ny -v q=$quality -v s=$SUBSAMPLING \
+          -v N=$block -v b=$bytes -v m=$mse 'BEGIN {
+        psnr = (m > 0) ? 10*log(255*255/m)/log(10) : 99.99;
+        printf "%s,%d,%d,%d,%s,%d,%d,%.4f,%.4f,%.2f\n",
+               n, nx, ny, q, s, N, b, 8*b/(nx*ny), m, psnr }' >> $RESULTS
+    done
+  done
+done
+
+column -s, -t < $RESULTS 2>/dev/null || cat $RESULTS
+echo "Results written to $RESULTS"
+
+# corpus averages per block size and quality, in the order of BLOCKSIZES
+# and QUALITIES
+echo
+echo "block  quality  mean bpp  mean MSE  mean PSNR"
+awk -F, 'FNR > 1 { key = $6 "," $4; n[key]++
+                   bpp[key] += $8; mse[key] += $9; psnr[key] += $10
+                   if (!(key in seen)) { seen[key] = 1; order[++k] = key } }
+         END { for (i = 1; i <= k; i++) { key = order[i]
+                 split(key, f, ",")
+                 printf "%2sx%-2s  %7s  %8.4f  %8.2f  %9.2f\n", f[1], f[1],
+                        f[2] ? f[2] : "default",
+                        bpp[key]/n[key], mse[key]/n[key], psnr[key]/n[key] } }' \
+    $RESULTS
@@ -0,0 +1,119 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/*  File:       synth.c                                                     */
+/*                                                                          */
+/*  Purpose:    Deterministic synthetic test images for the benchmark       */
+/*              corpus, so that benchmarks run without any downloads.       */
+/*                                                                          */
+/*              usage: ic19_jpeg_light_synth kind width height file         */
+/*                                           [maxval]                       */
+/*                                                                          */
+/*              kind: photo    smooth gradients, soft edges and noise       */
+/*                    document dark text-like strokes on white paper        */
+/*                    page     sparse text on nearly uniform paper (clean   */
+/*                             scan), most blocks are flat                  */
+/*                    noise    uniform random noise                         */
+/*                    grey     like photo, single channel (PGM)             */
+/*                                                                          */
+/*              maxval: maximum sample value, 255 by default; above 255 the */
+/*              8 bit content is scaled up and the additional low bits are  */
+/*              filled with noise, stored with 2 bytes per sample           */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+static unsigned long seed = 20190617;
+
+/*--------------------------------------------------------------------------*/
+static long rnd(long n) {
+  /* pseudo random number in 0,...,n-1 */
+  seed = seed*6364136223846793005UL+1442695040888963407UL;
+  return (long)((seed >> 33) % (unsigned long)n);
+}
+
+/*--------------------------------------------------------------------------*/
+static long clip(double v) {
+  if (v < 0) return 0;
+  if (v > 255) return 255;
+  return (long)(v+0.5);
+}
+
+/*--------------------------------------------------------------------------*/
+static void pixel(const char *kind, long x, long y, long nx, long ny,
+                  long c, long *v) {
+  /* value of channel c at pixel (x,y) */
+  double fx = (double)x/(double)nx, fy = (double)y/(double)ny;
+  double d;
+
+  if (!strcmp(kind,"noise")) {
+    *v = rnd(256);
+  } else if (!strcmp(kind,"document")) {
+    /* lines of "words": short dark runs on a white background */
+    long line = y % 24, word = (x/7 + (y/24)*13) % 11;
+    *v = (line >= 6 && line < 16 && word < 8 && ((x*7+y/24*5) % 9) < 5) ?
+         20+rnd(30) : 245+rnd(10);
+  } else if (!strcmp(kind,"page")) {
+    /* lines of "words" with wide spacing and margins; the paper varies by
+       one grey level only */
+    long line = y % 32, word = (x/7 + (y/32)*13) % 11;
+    *v = (x >= nx/10 && x < nx-nx/10 && line >= 10 && line < 20 &&
+          word < 6 && ((x*7+y/32*5) % 9) < 5) ? 20+rnd(30) : 254+rnd(2);
+  } else {
+    /* smooth colour gradients, a soft disc and mild noise */
+    d = sqrt((fx-0.6)*(fx-0.6)+(fy-0.4)*(fy-0.4));
+    *v = clip(128.0+90.0*sin(6.0*fx+2.0*c)*cos(4.0*fy-c)
+              +(d < 0.25 ? 60.0*(0.25-d)/0.25 : 0.0)-30.0*(c==2)*fy
+              +(double)(rnd(9)-4));
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+int main(int argc, char **args) {
+  FILE *file;
+  long nx, ny, nc, x, y, c, v, maxval = 255;
+  const char *kind;
+
+  if (argc != 5 && argc != 6) {
+    printf("usage: %s photo|document|page|noise|grey width height file "
+           "[maxval]\n",args[0]);
+    return 1;
+  }
+  kind = args[1];
+  nx = atol(args[2]);
+  ny = atol(args[3]);
+  if (argc == 6) maxval = atol(args[5]);
+  nc = strcmp(kind,"grey") ? 3 : 1;
+  if (nx < 1 || ny < 1) {
+    printf("invalid image size\n");
+    return 1;
+  }
+  if (maxval < 255 || maxval > 65535) {
+    printf("invalid maximum value, 255 to 65535\n");
+    return 1;
+  }
+
+  file = fopen(args[4],"wb");
+  if (file == NULL) {
+    printf("could not open file '%s' for writing, aborting.\n",args[4]);
+    return 1;
+  }
+  fprintf(file,"%s\n%ld %ld\n%ld\n",nc == 3 ? "P6" : "P5",nx,ny,maxval);
+  for (y=0;y<ny;y++)
+    for (x=0;x<nx;x++)
+      for (c=0;c<nc;c++) {
+        pixel(kind,x,y,nx,ny,c,&v);
+        if (maxval > 255) {
+          v = v*maxval/255+rnd((maxval+1)/256);
+          if (v > maxval) v = maxval;
+          fputc((int)(v >> 8),file);
+        }
+        fputc((int)(v & 255),file);
+      }
+  fclose(file);
+
+  return 0;
+}
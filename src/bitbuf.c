@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitbuf.h"
+
+/*--------------------------------------------------------------------------*/
+
+unsigned char *load_file
+(const char *file_name,  /* name of file, "-" for standard input */
+ long       *size)       /* size of file in bytes, output */
+
+/*
+  reads a complete file into a newly allocated byte buffer;
+  the caller frees the buffer with free(). The file is read in chunks
+  until its end without seeking, so pipes and standard input work as well
+*/
+
+{
+  FILE          *infile;    /* input file */
+  unsigned char *data;      /* file content */
+  long           capacity;  /* allocated size of data */
+  long           k;         /* bytes read by last call */
+
+  /* open file */
+  infile = strcmp (file_name, "-") ? fopen (file_name, "rb") : stdin;
+  if (NULL == infile)
+    {
+      printf ("could not open file '%s' for reading, aborting.\n", file_name);
+      exit (1);
+    }
+
+  /* read chunks into a buffer of doubling size until end of file */
+  capacity = 65536;
+  data = NULL;
+  *size = 0;
+  do
+    {
+      if (data == NULL || *size == capacity)
+        {
+          if (data != NULL)
+            capacity *= 2;
+          data = (unsigned char *) realloc (data, capacity);
+          if (data == NULL)
+            {
+              printf ("load_file: not enough memory available\n");
+              exit (1);
+            }
+        }
+      k = (long) fread (data + *size, 1, capacity - *size, infile);
+      *size += k;
+    }
+  while (k > 0);
+  if (ferror (infile))
+    {
+      printf ("could not read file '%s', aborting.\n", file_name);
+      exit (1);
+    }
+
+  /* close file */
+  if (infile != stdin)
+    fclose (infile);
+
+  return data;
+
+} /* load_file */
+
+/*--------------------------------------------------------------------------*/
+
+void bw_init
+(BITWRITER *bw)  /* bit writer */
+
+/*
+  initialises an empty bit writer
+*/
+
+{
+  bw->capacity = 1024;
+  bw->pos = 0;
+  bw->data = (unsigned char *) malloc (bw->capacity);
+  if (bw->data == NULL)
+    {
+      printf ("bw_init: not enough memory available\n");
+      exit (1);
+    }
+
+  return;
+
+} /* bw_init */
+
+/*--------------------------------------------------------------------------*/
+
+void bw_grow
+(BITWRITER *bw)  /* bit writer */
+
+/*
+  doubles the capacity of the byte buffer
+*/
+
+{
+  bw->capacity *= 2;
+  bw->data = (unsigned char *) realloc (bw->data, bw->capacity);
+  if (bw->data == NULL)
+    {
+      printf ("bw_grow: not enough memory available\n");
+      exit (1);
+    }
+
+  return;
+
+} /* bw_grow */
+
+/*--------------------------------------------------------------------------*/
+
+void bw_free
+(BITWRITER *bw)  /* bit writer */
+
+/*
+  frees the byte buffer of a bit writer
+*/
+
+{
+  free (bw->data);
+  bw->data = NULL;
+  bw->capacity = 0;
+  bw->pos = 0;
+
+  return;
+
+} /* bw_free */
@@ -0,0 +1,129 @@
+#ifndef BITBUF_H_
+#define BITBUF_H_
+
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/*  File:       bitbuf.h                                                    */
+/*                                                                          */
+/*  Purpose:    Fast bitwise reading from and writing to memory. A complete */
+/*              bitstream is kept in a byte buffer, single bits are read or */
+/*              written without any function call or file access. The bit   */
+/*              order within a byte (most significant bit first) is the     */
+/*              same as in bfio.                                            */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+/* definition of the datatype BITREADER for reading bits from memory */
+typedef struct {
+  const unsigned char *data;  /* byte buffer */
+  long size;                  /* size of byte buffer */
+  long pos;                   /* current bit position */
+} BITREADER;
+
+/*--------------------------------------------------------------------------*/
+
+static inline void br_init(BITREADER *br, const unsigned char *data,
+                           long size) {
+  /* attach reader to a byte buffer, start with the first bit */
+  br->data = data;
+  br->size = size;
+  br->pos = 0;
+}
+
+/*--------------------------------------------------------------------------*/
+
+static inline long br_getb(BITREADER *br) {
+  /* read next bit; bits beyond the end of the buffer are read as 0 */
+  long byte = br->pos >> 3;
+  long b = 0;
+  if (byte < br->size)
+    b = (br->data[byte] >> (7 - (br->pos & 7))) & 1;
+  br->pos++;
+  return b;
+}
+
+/*--------------------------------------------------------------------------*/
+
+static inline long br_getbits(BITREADER *br, long n) {
+  /* read n-bit number, least significant bit first (the order of
+     write_long_bitwise) */
+  long i, c = 0;
+  for (i=0;i<n;i++)
+    c |= br_getb(br) << i;
+  return c;
+}
+
+/* definition of the datatype BITWRITER for writing bits to memory */
+typedef struct {
+  unsigned char *data;        /* byte buffer, grows as needed */
+  long capacity;              /* allocated size of byte buffer */
+  long pos;                   /* current bit position = number of bits */
+} BITWRITER;
+
+/*--------------------------------------------------------------------------*/
+
+void bw_init
+(BITWRITER *bw);  /* bit writer */
+
+/*
+  initialises an empty bit writer
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void bw_grow
+(BITWRITER *bw);  /* bit writer */
+
+/*
+  doubles the capacity of the byte buffer
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void bw_free
+(BITWRITER *bw);  /* bit writer */
+
+/*
+  frees the byte buffer of a bit writer
+*/
+
+/*--------------------------------------------------------------------------*/
+
+static inline void bw_reset(BITWRITER *bw) {
+  /* empty the bitstream but keep the byte buffer for reuse */
+  bw->pos = 0;
+}
+
+/*--------------------------------------------------------------------------*/
+
+static inline void bw_putb(BITWRITER *bw, long b) {
+  /* append one bit */
+  long byte = bw->pos >> 3;
+  if (byte >= bw->capacity)
+    bw_grow(bw);
+  if ((bw->pos & 7) == 0)
+    bw->data[byte] = 0;
+  bw->data[byte] |= (unsigned char)((b & 1) << (7 - (bw->pos & 7)));
+  bw->pos++;
+}
+
+/*--------------------------------------------------------------------------*/
+
+static inline long bw_bytes(const BITWRITER *bw) {
+  /* number of bytes used, the last byte is filled up with zeros */
+  return (bw->pos + 7) >> 3;
+}
+
+/*--------------------------------------------------------------------------*/
+
+unsigned char *load_file
+(const char *file_name,  /* name of file, "-" for standard input */
+ long       *size);      /* size of file in bytes, output */
+
+/*
+  reads a complete file into a newly allocated byte buffer without seeking,
+  so that pipes and standard input can be read;
+  the caller frees the buffer with free()
+*/
+
+#endif /* BITBUF_H_ */
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "container.h"
+
+/* size of fixed header fields in bytes */
+#define WNC_FIXED_SIZE (4+1+1+1+1+1+1+2+4+4+2+2+4+2)
+/* size of one quantisation matrix in bytes */
+#define WNC_TABLE_SIZE (64*2)
+/* size of one slice index entry in bytes */
+#define WNC_SLICE_SIZE ((3+2*WNC_STREAMS)*4)
+
+/*--------------------------------------------------------------------------*/
+
+static void put_u8(unsigned char **p, long v) {
+  *(*p)++ = (unsigned char)(v & 0xff);
+}
+
+static void put_u16(unsigned char **p, long v) {
+  put_u8(p, v >> 8);
+  put_u8(p, v);
+}
+
+static void put_u32(unsigned char **p, long v) {
+  put_u16(p, v >> 16);
+  put_u16(p, v);
+}
+
+static long get_u8(const unsigned char **p) {
+  return *(*p)++;
+}
+
+static long get_u16(const unsigned char **p) {
+  long v = get_u8(p) << 8;
+  return v | get_u8(p);
+}
+
+static long get_u32(const unsigned char **p) {
+  long v = get_u16(p) << 16;
+  return v | get_u16(p);
+}
+
+/*--------------------------------------------------------------------------*/
+
+void init_wnc_header
+(WNCHeader *hdr)    /* header, output */
+
+/*
+  sets all fields to zero, the version to WNC_VERSION and the maximum
+  sample value to that of 8 bit images
+*/
+
+{
+  memset (hdr, 0, sizeof(WNCHeader));
+  hdr->version = WNC_VERSION;
+  hdr->maxval = 255;
+
+  return;
+
+} /* init_wnc_header */
+
+/*--------------------------------------------------------------------------*/
+
+void alloc_wnc_slices
+(WNCHeader *hdr,    /* header */
+ long       c,      /* channel */
+ long       n)      /* number of slices */
+
+/*
+  allocates the slice index of channel c
+*/
+
+{
+  free (hdr->slice[c]);
+  hdr->slice[c] = (SliceInfo *) calloc (n > 0 ? n : 1, sizeof(SliceInfo));
+  if (hdr->slice[c] == NULL)
+    {
+      printf ("alloc_wnc_slices: not enough memory available\n");
+      exit (1);
+    }
+  hdr->slices[c] = n;
+
+  return;
+
+} /* alloc_wnc_slices */
+
+/*--------------------------------------------------------------------------*/
+
+void free_wnc_header
+(WNCHeader *hdr)    /* header */
+
+/*
+  frees the slice index of all channels
+*/
+
+{
+  long c;
+
+  for (c = 0; c < WNC_MAXCHANNELS; c++)
+    {
+      free (hdr->slice[c]);
+      hdr->slice[c] = NULL;
+      hdr->slices[c] = 0;
+    }
+
+  return;
+
+} /* free_wnc_header */
+
+/*--------------------------------------------------------------------------*/
+
+long wnc_header_size
+(const WNCHeader *hdr)   /* header */
+
+/*
+  returns the size of header and slice index in bytes, i.e. the position of
+  the first payload byte
+*/
+
+{
+  long c, size = WNC_FIXED_SIZE + hdr->tables * WNC_TABLE_SIZE;
+
+  for (c = 0; c < hdr->nc; c++)
+    size += 2 + hdr->slices[c] * WNC_SLICE_SIZE;
+
+  return size;
+
+} /* wnc_header_size */
+
+/*--------------------------------------------------------------------------*/
+
+long store_wnc_header
+(const WNCHeader *hdr,   /* header with complete slice index */
+ unsigned char   *data)  /* output buffer of wnc_header_size(hdr) bytes */
+
+/*
+  stores header and slice index in memory; returns the number of bytes
+*/
+
+{
+  unsigned char *p = data;
+  long c, i, j;
+  const SliceInfo *s;
+
+  /* fixed fields */
+  memcpy (p, "JLWC", 4);
+  p += 4;
+  put_u8 (&p, hdr->version);
+  put_u8 (&p, hdr->nc);
+  put_u8 (&p, hdr->block_size);
+  put_u8 (&p, hdr->sx);
+  put_u8 (&p, hdr->sy);
+  put_u8 (&p, hdr->tables);
+  put_u16 (&p, hdr->maxval);
+  put_u32 (&p, hdr->nx);
+  put_u32 (&p, hdr->ny);
+  put_u16 (&p, hdr->dc_alphabet);
+  put_u16 (&p, hdr->ac_alphabet);
+  put_u32 (&p, hdr->M);
+  put_u16 (&p, (long)(hdr->r * 1000.0 + 0.5));
+  for (j = 0; j < hdr->tables; j++)
+    for (i = 0; i < 64; i++)
+      put_u16 (&p, hdr->quant[j][i]);
+
+  /* slice index */
+  for (c = 0; c < hdr->nc; c++)
+    {
+      put_u16 (&p, hdr->slices[c]);
+      for (i = 0; i < hdr->slices[c]; i++)
+        {
+          s = &hdr->slice[c][i];
+          put_u32 (&p, s->first_row);
+          put_u32 (&p, s->rows);
+          put_u32 (&p, s->symbols);
+          for (j = 0; j < WNC_STREAMS; j++)
+            {
+              put_u32 (&p, s->pos[j]);
+              put_u32 (&p, s->len[j]);
+            }
+        }
+    }
+
+  return p - data;
+
+} /* store_wnc_header */
+
+/*--------------------------------------------------------------------------*/
+
+void write_wnc_header
+(const WNCHeader *hdr,   /* header with complete slice index */
+ FILE            *file)  /* output file */
+
+/*
+  writes header and slice index
+*/
+
+{
+  unsigned char *data;
+
+  data = (unsigned char *) malloc (wnc_header_size (hdr));
+  if (data == NULL)
+    {
+      printf ("write_wnc_header: not enough memory available\n");
+      exit (1);
+    }
+  fwrite (data, 1, store_wnc_header (hdr, data), file);
+  free (data);
+
+  return;
+
+} /* write_wnc_header */
+
+/*--------------------------------------------------------------------------*/
+
+long read_wnc_header
+(const unsigned char *data,  /* complete container in memory */
+ long                 size,  /* size of container */
+ WNCHeader           *hdr)   /* header, output */
+
+/*
+  parses header and slice index and checks them for consistency;
+  returns 0 on success, otherwise 1 and prints an error message
+*/
+
+{
+  const unsigned char *p = data;
+  long c, i, j;
+  long N;             /* block size */
+  long bx, by;        /* blocks per row and block rows of a channel */
+  long row;           /* first block row of the next slice */
+  SliceInfo *s;
+
+  init_wnc_header (hdr);
+
+  /* fixed fields */
+  if (size < WNC_FIXED_SIZE || memcmp (data, "JLWC", 4) != 0)
+    {
+      printf ("ERROR: Not a JPEG light container.\n");
+      return 1;
+    }
+  p += 4;
+  hdr->version = get_u8 (&p);
+  if (hdr->version < 2 || hdr->version > WNC_VERSION)
+    {
+      printf ("ERROR: Unsupported container version %ld.\n", hdr->version);
+      return 1;
+    }
+  hdr->nc = get_u8 (&p);
+  hdr->block_size = get_u8 (&p);
+  hdr->sx = get_u8 (&p);
+  hdr->sy = get_u8 (&p);
+  hdr->tables = get_u8 (&p);
+  if (hdr->version == 2)
+    hdr->tables = 1;
+  if (hdr->version >= 4)
+    hdr->maxval = get_u16 (&p);
+  hdr->nx = get_u32 (&p);
+  hdr->ny = get_u32 (&p);
+  hdr->dc_alphabet = get_u16 (&p);
+  hdr->ac_alphabet = get_u16 (&p);
+  hdr->M = get_u32 (&p);
+  hdr->r = (double)get_u16 (&p) / 1000.0;
+  if (hdr->tables < 1 || hdr->tables > WNC_MAXTABLES)
+    {
+      printf ("ERROR: Invalid container header.\n");
+      return 1;
+    }
+  if (p + hdr->tables * WNC_TABLE_SIZE > data + size)
+    goto Truncated;
+  for (j = 0; j < hdr->tables; j++)
+    for (i = 0; i < 64; i++)
+      {
+        hdr->quant[j][i] = get_u16 (&p);
+        if (hdr->quant[j][i] == 0)
+          {
+            printf ("ERROR: Invalid container header.\n");
+            return 1;
+          }
+      }
+
+  if (hdr->nc < 1 || hdr->nc > WNC_MAXCHANNELS ||
+      (hdr->block_size != 1 && hdr->block_size != 4 &&
+       hdr->block_size != 8 && hdr->block_size != 16) ||
+      hdr->sx < 1 || hdr->sx > WNC_MAXSUBSAMPLING || hdr->sy < 1 ||
+      hdr->sy > WNC_MAXSUBSAMPLING ||
+      (hdr->block_size == 1 && (hdr->sx > 1 || hdr->sy > 1)) ||
+      hdr->nx < 1 || hdr->ny < 1 ||
+      hdr->maxval < 1 ||
+      hdr->dc_alphabet < 1 || hdr->dc_alphabet > WNC_MAXCATEGORIES ||
+      hdr->ac_alphabet != 16 * hdr->dc_alphabet + 2 || hdr->M < 4)
+    {
+      printf ("ERROR: Invalid container header.\n");
+      return 1;
+    }
+
+  /* slice index; the slices of every channel have to cover its block rows
+     in order, and hold at most N*N-1 AC symbols per block, since the
+     decoder sizes its buffers from them */
+  N = hdr->block_size;
+  for (c = 0; c < hdr->nc; c++)
+    {
+      if (p + 2 > data + size)
+        goto Truncated;
+      alloc_wnc_slices (hdr, c, get_u16 (&p));
+      if (p + hdr->slices[c] * WNC_SLICE_SIZE > data + size)
+        goto Truncated;
+      bx = ((c == 0) ? hdr->nx : (hdr->nx + hdr->sx - 1) / hdr->sx);
+      by = ((c == 0) ? hdr->ny : (hdr->ny + hdr->sy - 1) / hdr->sy);
+      bx = (bx + N - 1) / N;
+      by = (by + N - 1) / N;
+      row = 0;
+      for (i = 0; i < hdr->slices[c]; i++)
+        {
+          s = &hdr->slice[c][i];
+          s->first_row = get_u32 (&p);
+          s->rows = get_u32 (&p);
+          s->symbols = get_u32 (&p);
+          for (j = 0; j < WNC_STREAMS; j++)
+            {
+              s->pos[j] = get_u32 (&p);
+              s->len[j] = get_u32 (&p);
+              if (s->pos[j] + s->len[j] > size)
+                goto Truncated;
+            }
+          if (s->first_row != row || s->rows < 1 || s->rows > by - row ||
+              s->symbols > s->rows * bx * (N * N - 1))
+            goto Invalid;
+          row += s->rows;
+        }
+      if (row != by)
+        goto Invalid;
+    }
+
+  return 0;
+
+Invalid:
+  printf ("ERROR: Invalid slice index.\n");
+  free_wnc_header (hdr);
+  return 1;
+
+Truncated:
+  printf ("ERROR: Truncated container.\n");
+  free_wnc_header (hdr);
+  return 1;
+
+} /* read_wnc_header */
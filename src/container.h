@@ -0,0 +1,171 @@
+#ifndef CONTAINER_H_
+#define CONTAINER_H_
+
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/*  File:       container.h                                                 */
+/*                                                                          */
+/*  Purpose:    Self-describing container for compressed images (.wnc).     */
+/*              All fields are byte aligned and stored big endian:          */
+/*                                                                          */
+/*              magic "JLWC" (4), version (1), channels (1), block size     */
+/*              (1), subsampling x (1), subsampling y (1), quantisation     */
+/*              tables (1), maximum sample value (2), width (4), height     */
+/*              (4), DC alphabet size (2), AC alphabet size (2), WNC M (4), */
+/*              WNC r * 1000 (2), quantisation matrices (tables x 64 x 2),  */
+/*              then for every channel the number of slices (2) followed by */
+/*              one index entry per slice: first block row (4), block rows  */
+/*              (4), AC symbols (4) and position and length (4+4) of each   */
+/*              of the WNC_STREAMS bitstreams. Positions are absolute byte  */
+/*              offsets in the file, so that every slice can be located     */
+/*              without parsing any other part of the payload.              */
+/*                                                                          */
+/*              Channel 0 uses the first quantisation matrix, all other     */
+/*              channels the last one, i.e. with two tables luma and chroma */
+/*              are quantised separately. Version 2 containers have a       */
+/*              single table and a zero byte in place of the table count.   */
+/*              Containers before version 4 have no maximum sample value    */
+/*              and hold 8 bit images (255).                                */
+/*              Blocks are 4 x 4, 8 x 8 or 16 x 16; the matrices are always */
+/*              8 x 8 and resampled to the block size by the codec.         */
+/*                                                                          */
+/*              The slices of every channel cover its block rows in order   */
+/*              without gaps, and a slice holds at most N*N-1 AC symbols    */
+/*              per block of size N x N.                                    */
+/*                                                                          */
+/*              Block size 1 denotes lossless coding without subsampling:   */
+/*              block rows are rows of samples, and the DC streams hold the */
+/*              categories and category offsets of the prediction errors of */
+/*              all samples. The categories are coded with one adaptive     */
+/*              model per context of the predictor, the AC streams are      */
+/*              empty and the single matrix is unused.                      */
+/*                                                                          */
+/*              DC and AC data are kept in separate streams, so that a      */
+/*              DC-only decoder (thumbnails) never touches the AC data.     */
+/*              The DC alphabet consists of the coefficient categories, the */
+/*              AC alphabet of 16 run lengths per category, ZRL and EOB.    */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include <stdio.h>
+
+/* container version written by this implementation */
+#define WNC_VERSION 4
+/* maximum number of channels in a container */
+#define WNC_MAXCHANNELS 3
+/* maximum number of quantisation matrices in a container */
+#define WNC_MAXTABLES 2
+/* maximum chroma subsampling factor in each direction */
+#define WNC_MAXSUBSAMPLING 8
+/* maximum number of coefficient categories (size of the DC alphabet) */
+#define WNC_MAXCATEGORIES 32
+
+/* bitstreams of a slice, in file order */
+#define STREAM_DC_SYMBOLS 0  /* WNC coded DC categories, one per block */
+#define STREAM_DC_OFFSETS 1  /* category offsets of DC prediction errors */
+#define STREAM_AC_SYMBOLS 2  /* WNC coded AC run/category symbols */
+#define STREAM_AC_OFFSETS 3  /* category offsets of AC coefficients */
+#define WNC_STREAMS 4
+
+/* index entry of one slice, i.e. a range of block rows of one channel that
+   is coded independently */
+typedef struct {
+  long first_row;         /* first block row */
+  long rows;              /* number of block rows */
+  long symbols;           /* number of AC symbols; the number of DC
+                             symbols is rows times blocks per row */
+  long pos[WNC_STREAMS];  /* byte positions of the bitstreams */
+  long len[WNC_STREAMS];  /* byte lengths of the bitstreams */
+} SliceInfo;
+
+/* container header */
+typedef struct {
+  long version;           /* container version */
+  long nx, ny, nc;        /* image dimensions and channels */
+  long block_size;        /* size of quadratic DCT blocks */
+  long sx, sy;            /* chroma subsampling factors */
+  long maxval;            /* maximum sample value, 255 for 8 bit images */
+  long dc_alphabet;       /* size of DC symbol alphabet */
+  long ac_alphabet;       /* size of AC symbol alphabet */
+  long M;                 /* WNC discretisation parameter */
+  double r;               /* WNC rescaling parameter */
+  long tables;            /* number of quantisation matrices */
+  long quant[WNC_MAXTABLES][64]; /* quantisation matrices, w[u][v] at
+                                    quant[t][8*u+v] */
+  long slices[WNC_MAXCHANNELS];      /* number of slices per channel */
+  SliceInfo *slice[WNC_MAXCHANNELS]; /* slice index per channel */
+} WNCHeader;
+
+/*--------------------------------------------------------------------------*/
+
+void init_wnc_header
+(WNCHeader *hdr);   /* header, output */
+
+/*
+  sets all fields to zero, the version to WNC_VERSION and the maximum
+  sample value to that of 8 bit images
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void alloc_wnc_slices
+(WNCHeader *hdr,    /* header */
+ long       c,      /* channel */
+ long       n);     /* number of slices */
+
+/*
+  allocates the slice index of channel c
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void free_wnc_header
+(WNCHeader *hdr);   /* header */
+
+/*
+  frees the slice index of all channels
+*/
+
+/*--------------------------------------------------------------------------*/
+
+long wnc_header_size
+(const WNCHeader *hdr);  /* header */
+
+/*
+  returns the size of header and slice index in bytes, i.e. the position of
+  the first payload byte
+*/
+
+/*--------------------------------------------------------------------------*/
+
+long store_wnc_header
+(const WNCHeader *hdr,   /* header with complete slice index */
+ unsigned char   *data); /* output buffer of wnc_header_size(hdr) bytes */
+
+/*
+  stores header and slice index in memory; returns the number of bytes
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void write_wnc_header
+(const WNCHeader *hdr,   /* header with complete slice index */
+ FILE            *file); /* output file */
+
+/*
+  writes header and slice index
+*/
+
+/*--------------------------------------------------------------------------*/
+
+long read_wnc_header
+(const unsigned char *data,  /* complete container in memory */
+ long                 size,  /* size of container */
+ WNCHeader           *hdr);  /* header, output */
+
+/*
+  parses header and slice index and checks them for consistency;
+  returns 0 on success, otherwise 1 and prints an error message
+*/
+
+#endif /* CONTAINER_H_ */
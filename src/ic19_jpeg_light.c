@@ -17,12 +17,23 @@
 #include <omp.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /* local includes */
 #include "alloc.h"              /* memory allocation */
 #include "image_io.h"           /* reading and writing pgm and ppm images */
 #include "bfio.h"               /* writing and reading of bitfiles */
+#include "bitbuf.h"             /* fast bitstreams in memory */
+#include "symbuf.h"             /* packed symbol streams */
+#include "container.h"          /* container format of compressed files */
+#include "stats.h"              /* per-stage timing and counters */
+#include "trace.h"              /* timeline tracing */
 
 /* defines */
 /* version */
@@ -30,19 +41,44 @@
 /* supported input formats */
 #define FORMAT_PGM 0
 #define FORMAT_PPM 1
+#define FORMAT_WNC 2    /* compressed bitstream */
 /* auxiliary functions */
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 /* maximum number of channels */
 #define MAXCHANNELS 3
-/* define maximum grey value */
+/* maximum chroma subsampling factor in each direction */
+#define MAXSUBSAMPLING WNC_MAXSUBSAMPLING
+/* maximum number of quality levels of a ladder */
+#define MAXLEVELS 16
+/* maximum sample value of 8 bit images; pgm and ppm files with up to
+   MAXSAMPLEVALUE (16 bit samples) are read as well */
 #define MAXGREYVALUE 255
 /* console formatting */
 #define ONE_UP "\033[5D\033[1A"
 #define CLRLINE "\033[K"
-/* symbols */
-#define ZRL 192
-#define EOB 193
+/* symbols: with C categories, a coefficient of category cat after
+   runlength zeros is the AC symbol C*runlength+cat; ZRL and EOB follow the
+   16 run lengths, and the DC alphabet consists of the categories */
+#define ZRL(C) (16*(C))
+#define EOB(C) (16*(C)+1)
+#define AC_ALPHABET(C) (16*(C)+2)
+#define NDCSYMBOLS 12   /* fewest categories; all 8 bit images unless
+                           quantised with weights close to 1 */
+#define NSYMBOLS AC_ALPHABET(NDCSYMBOLS)
+/* parameters of the adaptive WNC coder */
+#define WNC_R 0.3       /* rescaling parameter */
+#define WNC_M 256       /* discretisation parameter (power of 2) */
+/* supported DCT block sizes; all kernels on blocks are instantiated for
+   the sizes 4, 8 and 16 with a constant block size, see block_DCT */
+#define MAXBLOCKSIZE 16
+#define MAXCOEFFICIENTS (MAXBLOCKSIZE*MAXBLOCKSIZE)
+#define VALID_BLOCKSIZE(N) ((N) == 4 || (N) == 8 || (N) == 16)
+/* block size of lossless coding: the samples are predicted instead of
+   transformed, and a block row is a row of samples, see lossless_encode */
+#define BLOCKSIZE_LOSSLESS 1
+/* number of contexts of the prediction errors in lossless coding */
+#define LL_CONTEXTS 8
 
 /* definition of compressed image datatype and struct */
 typedef struct ImageData ImageData;
@@ -51,6 +87,8 @@ struct ImageData {
   long*** orig_ycbcr;     /* original image (YCbCr) */
   long size_orig;         /* size of raw input image */
   long nx, ny, nc;        /* image dimensions and channels */
+  long maxval;            /* maximum sample value, MAXGREYVALUE for 8 bit
+                             images */
   long nx_ext[3], ny_ext[3]; /* extended image sizes */
   long block_size;        /* size of quadratic DCT blocks */
   long blocks_x,          /* number of blocks in each direction */
@@ -59,9 +97,43 @@ struct ImageData {
   long***   dct_quant;    /* quantised DCT coefficients */
   double*** rec;          /* reconstruction from DCT  */
   long***   rec_quant;    /* integer reconstruction  */
-  long      s;            /* subsampling factor */
+  long      sx, sy;       /* chroma subsampling factors in x and y */
 };
 
+/* quantisation table of an encode or decode with all derived forms; tables
+   are immutable once built and shared through a cache, see get_quant_table */
+typedef struct QuantTable QuantTable;
+struct QuantTable {
+  long   matrix[64];      /* 8 x 8 quantisation matrix of the container,
+                             w[u][v] at matrix[8*u+v] */
+  long   N;               /* block size the table is built for */
+  long   weights[MAXCOEFFICIENTS]; /* matrix resampled to N x N blocks,
+                             w[u][v] at weights[N*u+v] */
+  double reciprocal[MAXCOEFFICIENTS]; /* 1/w[u][v]; block_quantise
+                             divides, since a product with the reciprocal
+                             is not always truncated to the same integer */
+  long   zigzag[MAXCOEFFICIENTS]; /* weights in zig-zag order */
+  double scaled[MAXCOEFFICIENTS]; /* alpha[u]*alpha[v]/w[u][v], quantises
+                             DCT sums that leave out the normalisation of
+                             the orthonormal DCT, as fast DCTs do */
+  long   flat_range;      /* largest sample range (max-min) of a block
+                             whose AC coefficients all quantise to 0 */
+  QuantTable* next;       /* next table in cache */
+};
+
+/* transform and scan tables of one block size; built once for all block
+   sizes up to MAXBLOCKSIZE and shared read only, see get_block_tables.
+   The basis is aligned and stored in both orders, so that the innermost
+   loops of the transforms run over consecutive elements */
+typedef struct {
+  _Alignas(64)
+  double basis[MAXCOEFFICIENTS];  /* scaled cosine basis alpha[u]*
+                                     cos(pi/N*(x+0.5)*u) at [u*N+x] */
+  double basis_t[MAXCOEFFICIENTS];/* the same at [x*N+u] */
+  long   zigzag_x[MAXCOEFFICIENTS]; /* coordinates of the coefficients */
+  long   zigzag_y[MAXCOEFFICIENTS]; /* in zig-zag order */
+} BlockTables;
+
 long log2long(long x) {
   int logx = 0;
   while (x >>= 1) ++logx;
@@ -72,6 +144,7 @@ long log2long(long x) {
 void init_image (ImageData* img) {
   /* set image variables to default values */
   img->nx=img->ny=img->nc=0;
+  img->maxval=MAXGREYVALUE;
   /* img->nx_ext */
   /*   =img->ny_ext=0; */
   img->blocks_x=0;img->blocks_y=0;
@@ -83,13 +156,16 @@ void init_image (ImageData* img) {
   img->dct=0;
   img->dct_quant=0;
   img->block_size=8;
-  img->s=2;
+  img->sx=2;
+  img->sy=2;
 }
 
 /*--------------------------------------------------------------------------*/
-void alloc_image (ImageData* img,long nx,long ny) {
+void set_image_dimensions (ImageData* img) {
+  /* determine number of blocks and extended image sizes of all channels
+     from image size, block size and subsampling factors */
 
-  long blocks_x, blocks_y, nx_ext, ny_ext, N, nx_coarse, ny_coarse;
+  long blocks_x, blocks_y, nx_ext, ny_ext, N, nx_coarse, ny_coarse, nx, ny;
 
   /* set number of blocks and extended image size */
   N = img->block_size;
@@ -109,10 +185,10 @@ void alloc_image (ImageData* img,long nx,long ny) {
 
   
   /* determine coarse resolution */
-  nx_coarse = nx/img->s;
-  ny_coarse = ny/img->s;
-  if ((nx % img->s) > 0) nx_coarse++;
-  if ((ny % img->s) > 0) ny_coarse++;
+  nx_coarse = nx/img->sx;
+  ny_coarse = ny/img->sy;
+  if ((nx % img->sx) > 0) nx_coarse++;
+  if ((ny % img->sy) > 0) ny_coarse++;
 
   /* determine extended coarse resolution */
   blocks_x = nx_coarse/img->block_size;
@@ -123,6 +199,17 @@ void alloc_image (ImageData* img,long nx,long ny) {
   img->ny_ext[1] = blocks_y*img->block_size;
   img->nx_ext[2] = img->nx_ext[1];
   img->ny_ext[2] = img->ny_ext[1];
+}
+
+/*--------------------------------------------------------------------------*/
+void alloc_image (ImageData* img,long nx,long ny) {
+
+  long nx_ext, ny_ext;
+
+  /* set number of blocks and extended image size */
+  set_image_dimensions(img);
+  nx_ext = img->nx_ext[0];
+  ny_ext = img->ny_ext[0];
 
   /* printf("nx_ext %ld %ld %ld, ny_ext %ld %ld %ld\n", */
   /*        img->nx_ext[0],img->nx_ext[1],img->nx_ext[2],img->ny_ext[0], */
@@ -251,35 +338,21 @@ void convert_matrix_int(double **source, long **target,long nx, long ny) {
 }
 
 /*--------------------------------------------------------------------------*/
-long get_size_of_file(char* filename) {
-  /* compute and return size of file with arbitrary content */
-  FILE   *infile;             /* input file */
-  long i;
-  /* open file */
-  infile = fopen(filename,"r");
-  if (NULL == infile)
-    {
-      printf("Could not open file '%s' for reading, aborting (10)\n",filename);
-      exit(-1);
-    }
-  /* Find length of file */
-  fseek(infile,0,SEEK_END);
-  i = ftell(infile);
-  fclose(infile);
-  return i;
-}
-
-/*--------------------------------------------------------------------------*/
-double get_compression_ratio(char* original_file,
-                             char* compressed_file) {
-  /* computes compression ratio between two files on the hard disk (X:1) */
-  long original_size;
-  long compressed_size;
-  
-  original_size = get_size_of_file(original_file);
-  compressed_size = get_size_of_file(compressed_file);
-  
-  return (double)original_size/(double)compressed_size;
+double get_wall_time() {
+  /* return wall clock time in seconds */
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return (double)tv.tv_sec+1e-6*(double)tv.tv_usec;
+}
+
+/*--------------------------------------------------------------------------*/
+long sniff_format(const unsigned char* data, long size) {
+  /* identify the format of a file in memory by its magic bytes; returns
+     FORMAT_PGM, FORMAT_PPM, FORMAT_WNC or -1 if the format is unknown */
+  if (size >= 2 && data[0] == 'P' && data[1] == '5') return FORMAT_PGM;
+  if (size >= 2 && data[0] == 'P' && data[1] == '6') return FORMAT_PPM;
+  if (size >= 4 && memcmp(data,"JLWC",4) == 0) return FORMAT_WNC;
+  return -1;
 }
 
 /*--------------------------------------------------------------------------*/
@@ -337,7 +410,7 @@ void normalise_to_8bit(long** image,long nx, long ny, long** normalised) {
 
   for (i=1;i<=nx;i++)
     for (j=1;j<=ny;j++) {
-      normalised[i][j]=((image[i][j]-min)*255)/(max-min);
+      normalised[i][j]=(max>min) ? ((image[i][j]-min)*255)/(max-min) : 0;
     }
 }
 
@@ -345,67 +418,263 @@ void normalise_to_8bit(long** image,long nx, long ny, long** normalised) {
 void print_usage_message() {
   printf("./compress -i input_file -o output_prefix [optional parameters]\n");
   printf("list of mandatory paramters:\n");
-  printf("-i input_file   (string): uncompressed image, e.g. \"image.ppm\"\n");
-  printf("-o out_prefix   (string): prefix for output files, e.g. \"my_image\"\n");
+  printf("-i input_file   (string): uncompressed image, e.g. \"image.ppm\", with\n");
+  printf("                          8 or up to 16 bit samples (maximum value up to\n");
+  printf("                          65535), or compressed image for decoding, e.g.\n");
+  printf("                          \"image.wnc\"; the format is recognised by the\n");
+  printf("                          file content, \"-\" reads standard input\n");
+  printf("-o out_prefix   (string): prefix for output files, e.g. \"my_image\";\n");
+  printf("                          \"-\" writes only the compressed or decoded\n");
+  printf("                          image to standard output, messages go to\n");
+  printf("                          standard error\n");
   printf("list of optional paramters:\n");
-  printf("-s subsampling factor      (int): subsample each dimension by factor s\n");
-  printf("-q quantisation parameter  (int): use uniform quantisation matrix with entry q everywhere\n");
+  printf("-s subsampling factors  (string): chroma subsampling, either one factor\n");
+  printf("                                  for both dimensions (\"2\"), horizontal x\n");
+  printf("                                  vertical factors (\"2x1\") or J:a:b\n");
+  printf("                                  notation (\"4:2:2\", \"4:1:1\", \"4:4:0\")\n");
+  printf("-b block size              (int): DCT block size 4, 8 (default) or 16; the\n");
+  printf("                                  8x8 matrices are resampled to the block size\n");
+  printf("--lossless                      : lossless coding of the reversible colour\n");
+  printf("                                  transform with predicted samples; no -q,\n");
+  printf("                                  -Q, --tables, -b or chroma subsampling\n");
+  printf("-q quantisation parameter  (int): use uniform quantisation matrix with entry q everywhere;\n");
+  printf("                                  all weights are in sample units, so images\n");
+  printf("                                  with more than 8 bits need larger weights\n");
+  printf("                                  for the same relative distortion\n");
+  printf("-Q, --quality quality      (int): scale separate luma and chroma matrices\n");
+  printf("                                  like libjpeg, 1 (smallest) to 100 (best);\n");
+  printf("                                  50 keeps the matrices unchanged\n");
+  printf("--tables table_file     (string): custom quantisation matrices, 64 or 128\n");
+  printf("                                  (luma, then chroma) integers; '#' starts\n");
+  printf("                                  a comment; scaled with -Q if given\n");
+  printf("--scale factor          (string): decode at reduced size \"1/2\", \"1/4\" or\n");
+  printf("                                  \"1/8\" (DC only thumbnail with 8x8 blocks),\n");
+  printf("                                  default \"1\"\n");
+  printf("--crop x,y,w,h          (string): decode only the given region of interest\n");
+  printf("--stats[=json]                    : print time, bytes, blocks and symbols of\n");
+  printf("                                  all stages as table or JSON\n");
+  printf("--trace trace_file      (string): write timeline of all threads in Chrome\n");
+  printf("                                  trace format, e.g. \"trace.json\"\n");
+  printf("-R restart interval        (int): start a new independently decodable slice\n");
+  printf("                                  every R block rows (default: one slice per\n");
+  printf("                                  channel); enables fast region decoding\n");
+  printf("--ladder q1,q2,...      (string): encode the input at all qualities of -Q\n");
+  printf("                                  from one shared DCT, levels in parallel,\n");
+  printf("                                  into out_prefix_q<quality>.wnc\n");
+  printf("--batch manifest        (string): encode all images listed in the manifest\n");
+  printf("                                  (\"-\": stdin), one \"input [output]\" per\n");
+  printf("                                  line, with a pool of OMP_NUM_THREADS\n");
+  printf("                                  workers; -i and -o are not needed\n");
 }
 
 /*--------------------------------------------------------------------------*/
+long parse_scale(const char* arg) {
+  /* returns the reconstructed block size K for the decoding scale K/8 given
+     as "1", "1/2", "1/4" or "1/8", and 0 for invalid input */
+  if (!strcmp(arg,"1") || !strcmp(arg,"1/1")) return 8;
+  if (!strcmp(arg,"1/2")) return 4;
+  if (!strcmp(arg,"1/4")) return 2;
+  if (!strcmp(arg,"1/8")) return 1;
+  return 0;
+}
 
-/* apply WNC algorithm for adaptive arithmetic integer encoding */
-void encode_adaptive_wnc(
-  long* sourceword,   /* array containing n numbers from {0,...,s}
-                         where s is the end of file symbol */
-  long n,             /* length of sourceword */
-  long s,             /* size of source alphabet */
-  double r,           /* rescaling parameter */
-  long  M,            /* WNC discretisation parameter M */
-  FILE* debug_file,   /* 0 - no output, otherwise debug output to file */
-  BFILE* compressed)  {/* binary file for compressed bitstring */
+/*--------------------------------------------------------------------------*/
+long parse_ladder(const char* arg, long* qualities) {
+  /* parse a comma separated list of up to MAXLEVELS qualities 1..100;
+     returns the number of levels, 0 for invalid input */
+  long n = 0, used;
+
+  while (n < MAXLEVELS && sscanf(arg,"%ld%ln",&qualities[n],&used) == 1) {
+    if (qualities[n] < 1 || qualities[n] > 100) return 0;
+    n++;
+    arg += used;
+    if (*arg == 0) return n;
+    if (*arg++ != ',') return 0;
+  }
+  return 0;
+}
 
-  long i,j;      /* loop variables */
-  long L,H;      /* low and high interval endpoints of current interval */
-  long oldL;     /* temporary variable to preserve L for computing new interval*/
-  long C;        /* sum of all counters */
-  long k;        /* underflow counter */
-  long* counter; /* array of counters for adaptive probabilities */
-  long M12=M/2, M14=M/4, M34=3*M/4;  /* time savers */
-  long symbol;   /* index of current symbol in counter array */
-  long csum;     /* sum of counters 0,...,symbol-1 */
-                        
-  /* allocate memory */
-  alloc_long_vector(&counter,s);
-  
-  /* initialise counters and C */
-  for (i=0;i<s;i++) {
-    counter[i]=1;
+/*--------------------------------------------------------------------------*/
+long parse_crop(const char* arg, long* x, long* y, long* w, long* h) {
+  /* parse a region of interest given as "x,y,width,height" in pixels, with
+     the upper left image corner at 0,0; returns 1 on success, 0 otherwise */
+  if (sscanf(arg,"%ld,%ld,%ld,%ld",x,y,w,h) != 4) return 0;
+  return (*x >= 0 && *y >= 0 && *w > 0 && *h > 0);
+}
+
+/*--------------------------------------------------------------------------*/
+/* cumulative counters of the adaptive WNC model are kept in a binary
+   indexed (Fenwick) tree: tree[i] holds the sum of counter[i-lowbit(i)..i-1],
+   so that prefix sums, updates and the interval search during decoding
+   take O(log s) instead of O(s) operations per symbol */
+
+static void wnc_tree_build(long* tree, long* counter, long s) {
+  /* build tree from counter array in O(s) */
+  long i,j;
+  tree[0]=0;
+  for (i=1;i<=s;i++) tree[i]=counter[i-1];
+  for (i=1;i<=s;i++) {
+    j=i+(i & -i);
+    if (j<=s) tree[j]+=tree[i];
+  }
+}
+
+static inline void wnc_tree_increment(long* tree, long s, long symbol) {
+  /* increase counter of symbol by one */
+  long i;
+  for (i=symbol+1;i<=s;i+=(i & -i)) tree[i]++;
+}
+
+static inline long wnc_tree_prefix(long* tree, long symbol) {
+  /* sum of counters 0,...,symbol-1 */
+  long i,sum=0;
+  for (i=symbol;i>0;i-=(i & -i)) sum+=tree[i];
+  return sum;
+}
+
+static inline long wnc_tree_find(long* tree, long s, long top, long w,
+                                 long* csum) {
+  /* find symbol with csum <= w < csum+counter[symbol], where csum is the sum
+     of counters 0,...,symbol-1; top is the largest power of 2 <= s */
+  long pos=0,sum=0,step;
+  for (step=top;step>0;step>>=1) {
+    if (pos+step<=s && sum+tree[pos+step]<=w) {
+      pos+=step;
+      sum+=tree[pos];
+    }
   }
-  C = s;
+  if (pos>s-1) { /* w beyond total count: fall back to last symbol */
+    pos=s-1;
+    sum=wnc_tree_prefix(tree,pos);
+  }
+  *csum=sum;
+  return pos;
+}
+
+/*--------------------------------------------------------------------------*/
 
+long wnc_adjust_M(long M, long C, FILE* debug_file) {
+  /* enlarge M to a power of 2 that is large enough for C initial counters;
+     the decoder relies on M being a power of 2 */
+  long M_new;
+  if ((double)C<=(double)M/4.0+2.0) return M;
+  M_new=1;
+  while (M_new<8*C) M_new*=2;
   if (debug_file != 0) {
-    fprintf(debug_file,"n: %ld, s: %ld, r: %f, M: %ld\n",n,s,r,M);
+    fprintf(debug_file,
+            "M=%ld is too small (C=%ld), setting M to %ld\n",M,C,M_new);
   }
-  
-  if ((double)C>(double)M/4.0+2.0) {
-    if (debug_file != 0) {
-      fprintf(debug_file,
-              "M=%ld is too small (C=%ld), setting M to %ld\n",M,C,8*C);
-    }
-    M=8*C;
-    M12=M/2; M14=M/4; M34=3*M/4;
+  return M_new;
+}
+
+/*--------------------------------------------------------------------------*/
+
+/* adaptive counters of a WNC coder; every coder starts with a model of its
+   own, and can be switched between symbols to other models of the same
+   alphabet, e.g. to one model per context */
+typedef struct {
+  long C;              /* sum of all counters */
+  long* counter;       /* array of counters for adaptive probabilities */
+  long* tree;          /* cumulative counters */
+} WNCModel;
+
+void wnc_model_init(WNCModel* m, long s) {
+  /* uniform counters for an alphabet of size s */
+  long i;
+
+  alloc_long_vector(&m->counter,s);
+  alloc_long_vector(&m->tree,s+1);
+  for (i=0;i<s;i++) {
+    m->counter[i]=1;
   }
+  m->C = s;
+  wnc_tree_build(m->tree,m->counter,s);
+}
+
+void wnc_model_free(WNCModel* m, long s) {
+  disalloc_long_vector(m->counter,s);
+  disalloc_long_vector(m->tree,s+1);
+}
+
+/*--------------------------------------------------------------------------*/
+
+/* state of an adaptive WNC encoder, so that symbols can be encoded one at
+   a time while they are produced */
+typedef struct {
+  long s;              /* size of source alphabet */
+  double r;            /* rescaling parameter */
+  long M;              /* WNC discretisation parameter M */
+  long M12, M14, M34;  /* time savers */
+  long L,H;            /* low and high interval endpoints of current interval */
+  long k;              /* underflow counter */
+  WNCModel own;        /* model of the encoder */
+  WNCModel* model;     /* model of the next symbols, &own by default */
+  long n;              /* number of symbols encoded so far */
+  FILE* debug_file;    /* 0 - no output, otherwise debug output to file */
+  BITWRITER* compressed; /* bitstream for compressed bitstring */
+  double trace;        /* start of trace span */
+} WNCEncoder;
+
+/*--------------------------------------------------------------------------*/
+void wnc_encoder_init(WNCEncoder* e,     /* encoder, output */
+                      long s,            /* size of source alphabet */
+                      double r,          /* rescaling parameter */
+                      long M,            /* WNC discretisation parameter */
+                      FILE* debug_file,  /* 0 - no output, otherwise debug
+                                            output to file */
+                      BITWRITER* compressed) { /* output bitstream */
+  /* start encoding with uniform counters */
+  e->trace = trace_begin();
+
+  wnc_model_init(&e->own,s);
+  e->model = &e->own;
+
+  e->s = s;
+  e->r = r;
+  e->M = wnc_adjust_M(M,s,debug_file);
+  e->M12=e->M/2; e->M14=e->M/4; e->M34=3*e->M/4;
 
   /* initialise interval endpoints and underflow counter */
-  L=0;
-  H=M;
-  k=0;
+  e->L=0;
+  e->H=e->M;
+  e->k=0;
+  e->n=0;
+  e->debug_file = debug_file;
+  e->compressed = compressed;
+}
 
-  /* encode sourceword */
-  for (i=0;i<n;i++) {
-    if (debug_file != 0) {
-      fprintf(debug_file,"sourceword[%ld]=%ld\n",i,sourceword[i]);
+/*--------------------------------------------------------------------------*/
+static inline void wnc_encode_symbols(WNCEncoder* e,      /* encoder */
+                                      const long* symbols,/* n symbols,
+                                                             or 0 */
+                                      const unsigned short* packed,/* n
+                                                  symbols if symbols is 0 */
+                                      long n) {           /* number of
+                                                             symbols */
+  /* encode the next n symbols and adapt the counters. Every symbol is
+     preceded by the underflow expansions and rescalings of the interval,
+     which are also performed after the last one; they are idempotent, so
+     the symbols may be split into any number of runs. The state is kept in
+     local variables for the whole run */
+  long i,j;
+  long L=e->L,H=e->H; /* interval endpoints */
+  long C=e->model->C; /* sum of all counters */
+  long k=e->k;        /* underflow counter */
+  long M=e->M, M12=e->M12, M14=e->M14, M34=e->M34;
+  long s=e->s;
+  double r=e->r;
+  long oldL;     /* temporary variable to preserve L for computing new interval*/
+  long csum;          /* sum of counters 0,...,symbol-1 */
+  long symbol;        /* current symbol */
+  long* counter=e->model->counter;
+  long* tree=e->model->tree;
+  FILE* debug_file=e->debug_file;
+  BITWRITER* compressed=e->compressed;
+
+  for (i=0;i<=n;i++) {
+    if (debug_file != 0 && i<n) {
+      fprintf(debug_file,"sourceword[%ld]=%ld\n",e->n+i,
+              (symbols != 0) ? symbols[i] : packed[i]);
     }
     /* underflow expansions/rescaling */
     while (1) {
@@ -426,12 +695,12 @@ void encode_adaptive_wnc(
         }
         L=2*L; H=2*H;
         /* write 01^k to bitstream */
-        set_bit(compressed,0);
+        bw_putb(compressed,0);
         if (debug_file != 0) {
           fprintf(debug_file,"written bits: 0");
         }
         for (j=0;j<k;j++) {
-          set_bit(compressed,1);
+          bw_putb(compressed,1);
           if (debug_file != 0) {
             fprintf(debug_file,"1");
           }
@@ -450,12 +719,12 @@ void encode_adaptive_wnc(
         }
         L=2*L-M; H=2*H-M;
         /* write 10^k to bitstream */
-        set_bit(compressed,1);
+        bw_putb(compressed,1);
         if (debug_file != 0) {
           fprintf(debug_file,"written bits: 1");
         }
         for (j=0;j<k;j++) {
-          set_bit(compressed,0);
+          bw_putb(compressed,0);
           if (debug_file != 0) {
             fprintf(debug_file,"0");
           }
@@ -472,7 +741,8 @@ void encode_adaptive_wnc(
       }
       break;
     }
-    
+    if (i==n) break;
+
     /* readjustment */
     while ((double)C>(double)M/4.0+2.0) {
       if (debug_file != 0) {
@@ -484,123 +754,192 @@ void encode_adaptive_wnc(
         if (counter[j]==0) counter[j]=1; /* no zero-counters allowed */
         C+=counter[j];
       }
+      wnc_tree_build(tree,counter,s);
     }
 
     /* encode symbol */
-    symbol=sourceword[i];
-    csum=0;
-    for (j=0;j<symbol;j++) csum+=counter[j];
+    symbol = (symbols != 0) ? symbols[i] : packed[i];
+    csum=wnc_tree_prefix(tree,symbol);
     
     oldL=L;
-    L=L+(long)floor((double)(csum*(H-L))/(double)C);
-    H=oldL+(long)floor((double)((csum+counter[symbol])*(H-oldL))/(double)C);
+    L=L+(csum*(H-L))/C;
+    H=oldL+((csum+counter[symbol])*(H-oldL))/C;
     if (debug_file != 0) {
       fprintf(debug_file,"new [L,H) = [%ld,%ld)\n",L,H);
     }
     counter[symbol]++; C++;
+    wnc_tree_increment(tree,s,symbol);
   }
+  e->L=L; e->H=H; e->model->C=C; e->k=k;
+  e->n+=n;
+}
+
+/*--------------------------------------------------------------------------*/
+void wnc_encoder_finish(WNCEncoder* e) { /* encoder */
+  /* perform the final expansions and write the terminating bits, which
+     determine a number inside the final interval; frees the model of the
+     encoder, models of the caller are left alone */
+  long j;
+  FILE* debug_file=e->debug_file;
+  BITWRITER* compressed=e->compressed;
+
+  wnc_encode_symbols(e,0,0,0);    /* final expansions */
 
   /* last step */
   if (debug_file != 0) {
     fprintf(debug_file,"last interval - written bits:");
   }
-  if (L<M14) {
-      set_bit(compressed,0);
+  if (e->L<e->M14) {
+      bw_putb(compressed,0);
       if (debug_file != 0) {
         fprintf(debug_file,"0");
       }
-    for (j=0;j<k+1;j++) {
-      set_bit(compressed,1);
+    for (j=0;j<e->k+1;j++) {
+      bw_putb(compressed,1);
       if (debug_file != 0) {
         fprintf(debug_file,"1");
       }
     }
   } else {
-    set_bit(compressed,1);
+    bw_putb(compressed,1);
     if (debug_file != 0) {
       fprintf(debug_file,"1");
     }
-    for (j=0;j<k+1;j++) {
-      set_bit(compressed,0);
+    for (j=0;j<e->k+1;j++) {
+      bw_putb(compressed,0);
       if (debug_file != 0) {
         fprintf(debug_file,"0");
       }
     }
   }
 
-  /* allocate memory */
-  disalloc_long_vector(counter,s);
+  /* free memory */
+  wnc_model_free(&e->own,e->s);
+  trace_end("encode_adaptive_wnc",e->trace,e->n);
 }
 
-
 /*--------------------------------------------------------------------------*/
 
 /* apply WNC algorithm for adaptive arithmetic integer encoding */
-void decode_adaptive_wnc(
-    BFILE* compressed,  /* binary file with compressed bitstring */
-    long n,             /* length of sourceword */
-    long s,             /* size of source alphabet */
-    double r,           /* rescaling parameter */
-    long  M,            /* WNC discretisation parameter M */
-    FILE* debug_file,   /* 0 - no output, 1 - debug output to file */
-    long* sourceword)  {/* array containing n numbers from {0,...,s}
-                           where s is the end of file symbol */
-  long i,j;      /* loop variables */
-  long L,H;      /* low and high interval endpoints of current interval */
-  long oldL;     /* temporary variable to preserve L for computing new interval*/
-  long C;        /* sum of all counters */
-  long* counter; /* array of counters for adaptive probabilities */
-  long M12=M/2, M14=M/4, M34=3*M/4;  /* time savers */
-  long symbol;   /* index of current symbol in counter array */
-  long csum;     /* sum of counters 0,...,symbol-1 */
-  long w;        /* variable for finding correct decoding inverval */
-  long v;        /* partial dyadic fraction */
-  long b;        /* auxiliary variable for reading individual bits */
-  long N;        /* auxiliary variable for determining number of initial bits
-                    for v */
- 
-  /* allocate memory */
-  alloc_long_vector(&counter,s);
-  
-  /* initialise counters and C */
-  for (i=0;i<s;i++) {
-    counter[i]=1;
-  }
-  C = s;
+void encode_adaptive_wnc(
+  long* sourceword,   /* array containing n numbers from {0,...,s}
+                         where s is the end of file symbol */
+  long n,             /* length of sourceword */
+  long s,             /* size of source alphabet */
+  double r,           /* rescaling parameter */
+  long  M,            /* WNC discretisation parameter M */
+  FILE* debug_file,   /* 0 - no output, otherwise debug output to file */
+  BITWRITER* compressed)  {/* bitstream for compressed bitstring */
 
-  if ((double)C>(double)M/4.0+2.0) {
-    if (debug_file != 0) {
-      fprintf(debug_file,
-              "M=%ld is too small (C=%ld), setting M to %ld\n",C,M,8*C);
-    }
-    M=8*C;
-    M12=M/2; M14=M/4; M34=3*M/4;
+  WNCEncoder e;  /* encoder state */
+
+  if (debug_file != 0) {
+    fprintf(debug_file,"n: %ld, s: %ld, r: %f, M: %ld\n",n,s,r,M);
   }
+  wnc_encoder_init(&e,s,r,M,debug_file,compressed);
+  wnc_encode_symbols(&e,sourceword,0,n);
+  wnc_encoder_finish(&e);
+}
+
+
+/*--------------------------------------------------------------------------*/
+
+/* state of an adaptive WNC decoder, so that symbols can be decoded one at
+   a time, e.g. when the model of the next symbol depends on the decoded
+   data */
+typedef struct {
+  long s;              /* size of source alphabet */
+  double r;            /* rescaling parameter */
+  long M;              /* WNC discretisation parameter M */
+  long M12, M14, M34;  /* time savers */
+  long L,H;            /* low and high interval endpoints of current interval */
+  long v;              /* partial dyadic fraction */
+  long bits;           /* number of initial bits for v, log2(M) */
+  long top;            /* largest power of 2 <= s, for searching the tree */
+  WNCModel own;        /* model of the decoder */
+  WNCModel* model;     /* model of the next symbols, &own by default */
+  long n;              /* number of symbols decoded so far */
+  FILE* debug_file;    /* 0 - no output, otherwise debug output to file */
+  BITREADER* compressed; /* bitstream with compressed bitstring */
+  double trace;        /* start of trace span */
+} WNCDecoder;
+
+/*--------------------------------------------------------------------------*/
+void wnc_decoder_init(WNCDecoder* d,     /* decoder, output */
+                      long s,            /* size of source alphabet */
+                      double r,          /* rescaling parameter */
+                      long M,            /* WNC discretisation parameter */
+                      FILE* debug_file,  /* 0 - no output, otherwise debug
+                                            output to file */
+                      BITREADER* compressed) { /* input bitstream */
+  /* start decoding with uniform counters and read the first bits of the
+     codeword */
+  long i,b;
+
+  d->trace = trace_begin();
+
+  wnc_model_init(&d->own,s);
+  d->model = &d->own;
+  d->top=1;
+  while (2*d->top<=s) d->top*=2;
+
+  d->s = s;
+  d->r = r;
+  d->M = wnc_adjust_M(M,s,debug_file);
+  d->M12=d->M/2; d->M14=d->M/4; d->M34=3*d->M/4;
 
   /* initialise interval endpoints*/
-  L=0;
-  H=M;
+  d->L=0;
+  d->H=d->M;
+  d->n=0;
+  d->debug_file = debug_file;
+  d->compressed = compressed;
 
   /* read first bits of codeword to obtain initival v */
-  N=log2long(M); /* assumes that M is a power of 2! */
-  j=(long)pow(2,N-1);
-  v=0;
-  for (i=0;i<N;i++) {
-   b = get_bit(compressed);
-   v += b*j;
+  d->bits=log2long(d->M); /* assumes that M is a power of 2! */
+  d->v=0;
+  for (i=0;i<d->bits;i++) {
+   b = br_getb(compressed);
+   d->v = 2*d->v+b;
    if (debug_file != 0) {
-     fprintf(debug_file,
-             "v: %ld, j: %ld, i: %ld, b: %ld\n",v,j,i,b);
+     fprintf(debug_file,"v: %ld, i: %ld, b: %ld\n",d->v,i,b);
    }
-   j/=2;
   }
   if (debug_file != 0) {
     fprintf(debug_file,"initial v: %ld (%ld first bits from coded file, %f)\n",
-           v,N,log((double)M)/log(2.0));
+           d->v,d->bits,log((double)d->M)/log(2.0));
   }
+}
+
+/*--------------------------------------------------------------------------*/
+static inline void wnc_decode_symbols(WNCDecoder* d,      /* decoder */
+                                      long n,             /* number of
+                                                             symbols */
+                                      long* sourceword) { /* output: n
+                                                             symbols */
+  /* decode the next n symbols and adapt the counters; the counterpart of
+     wnc_encode_symbols. Every symbol is preceded by the underflow
+     expansions and rescalings of the interval, which wnc_decoder_finish
+     also performs after the last one. The state is kept in local
+     variables for the whole run */
+  long i,j;
+  long L=d->L,H=d->H; /* interval endpoints */
+  long v=d->v;        /* partial dyadic fraction */
+  long C=d->model->C; /* sum of all counters */
+  long M=d->M, M12=d->M12, M14=d->M14, M34=d->M34;
+  long s=d->s, top=d->top;
+  double r=d->r;
+  long oldL;     /* temporary variable to preserve L for computing new interval*/
+  long symbol;   /* index of current symbol in counter array */
+  long csum;     /* sum of counters 0,...,symbol-1 */
+  long w;        /* variable for finding correct decoding inverval */
+  long b;        /* auxiliary variable for reading individual bits */
+  long* counter=d->model->counter;
+  long* tree=d->model->tree;
+  FILE* debug_file=d->debug_file;
+  BITREADER* compressed=d->compressed;
 
-  /* decode sourceword */
-  for (i=0;i<n;i++) {
+  for (i=0;i<=n;i++) {
   
     /* underflow expansions/rescaling */
     while (1) {
@@ -608,10 +947,8 @@ void decode_adaptive_wnc(
       if ((L >= M14) && (L<M12) && (H>M12) && (H<=M34)) {
         L=2*L-M12; H=2*H-M12; v=2*v-M12;
         /* shift in next bit */
-        b=get_bit(compressed);
-        if (b!=EOF) {
-          v+=b;
-        }
+        b=br_getb(compressed);
+        v+=b;
         if (debug_file != 0) {
           fprintf(debug_file,
                  "underflow: x -> 2*x - %ld, [%ld,%ld), b %ld v %ld\n",
@@ -624,10 +961,8 @@ void decode_adaptive_wnc(
       if (H<=M12) {
         L=2*L; H=2*H; v=2*v;
         /* shift in next bit */
-        b=get_bit(compressed);
-        if (b!=EOF) {
-          v+=b;
-        }
+        b=br_getb(compressed);
+        v+=b;
         if (debug_file != 0) {
           fprintf(debug_file,"rescaling: x-> 2*x, [%ld, %ld), b %ld, v %ld\n",
                   L,H,b,v);
@@ -639,10 +974,8 @@ void decode_adaptive_wnc(
       if (L>=M12) {
         L=2*L-M; H=2*H-M; v=2*v-M;
         /* shift in next bit */
-        b=get_bit(compressed);
-        if (b!=EOF) {
-          v+=b;
-        }
+        b=br_getb(compressed);
+        v+=b;
         if (debug_file != 0) {
           fprintf(debug_file,
                   "rescaling: x-> 2*x - %ld, [%ld,%ld), b %ld, v %ld\n",
@@ -656,6 +989,7 @@ void decode_adaptive_wnc(
       }
       break;
     }
+    if (i==n) break;
     
     /* readjustment */
     while ((double)C>(double)M/4.0+2.0) {
@@ -668,29 +1002,65 @@ void decode_adaptive_wnc(
         if (counter[j]==0) counter[j]=1; /* no zero-counters allowed */
         C+=counter[j];
       }
+      wnc_tree_build(tree,counter,s);
     }
 
     /* decode symbol */
     w=((v-L+1)*C-1)/(H-L);
 
     /* find correct interval */
-    symbol=0;
-    csum=0;
-    while ((symbol < s-1) && ((csum > w) || (csum+counter[symbol])<=w)) {
-      csum+=counter[symbol];
-      symbol++;
-    }
+    symbol=wnc_tree_find(tree,s,top,w,&csum);
     sourceword[i]=symbol;
     oldL=L;
-    L=L+(long)floor((double)(csum*(H-L))/(double)C);
-    H=oldL+(long)floor((double)((csum+counter[symbol])*(H-oldL))/(double)C);
+    L=L+(csum*(H-L))/C;
+    H=oldL+((csum+counter[symbol])*(H-oldL))/C;
     counter[symbol]++; C++;
+    wnc_tree_increment(tree,s,symbol);
     if (debug_file != 0) {
       fprintf(debug_file,"[c_i,c_i-1) = [%ld %ld) ",csum,csum+counter[symbol]);
       fprintf(debug_file,"w: %ld symbol[%ld]: %ld, new [L,H)=[%ld,%ld)\n",
-              w,i,symbol,L,H);
+              w,d->n+i,symbol,L,H);
     }
   }
+  d->L=L; d->H=H; d->v=v; d->model->C=C;
+  d->n+=n;
+}
+
+/*--------------------------------------------------------------------------*/
+void wnc_decoder_finish(WNCDecoder* d) { /* decoder */
+  /* perform the final expansions of the encoder in order to consume the
+     same bits; afterwards, the bitstream points to the first bit after
+     the WNC bitstring. Frees the model of the decoder, models of the
+     caller are left alone */
+  wnc_decode_symbols(d,0,0);
+
+  /* the decoder has read log2(M) initial bits, the encoder has finished
+     with 2 bits; all other bits correspond one to one */
+  d->compressed->pos -= d->bits-2;
+
+  /* free memory */
+  wnc_model_free(&d->own,d->s);
+  trace_end("decode_adaptive_wnc",d->trace,d->n);
+}
+
+/*--------------------------------------------------------------------------*/
+
+/* apply WNC algorithm for adaptive arithmetic integer decoding;
+   afterwards, compressed points to the first bit after the WNC bitstring */
+void decode_adaptive_wnc(
+    BITREADER* compressed,  /* bitstream with compressed bitstring */
+    long n,             /* length of sourceword */
+    long s,             /* size of source alphabet */
+    double r,           /* rescaling parameter */
+    long  M,            /* WNC discretisation parameter M */
+    FILE* debug_file,   /* 0 - no output, 1 - debug output to file */
+    long* sourceword)  {/* array containing n numbers from {0,...,s}
+                           where s is the end of file symbol */
+  WNCDecoder d;  /* decoder state */
+
+  wnc_decoder_init(&d,s,r,M,debug_file,compressed);
+  wnc_decode_symbols(&d,n,sourceword);
+  wnc_decoder_finish(&d);
 }
 
 
@@ -713,14 +1083,17 @@ void RGB_to_YCbCr(long ***rgb, long ***ycbcr,long nx, long ny) {
 
 /*--------------------------------------------------------------------------*/
 void YCbCr_to_RGB(long ***ycbcr, long ***rgb,long nx, long ny) {
-  /* convert with modified YUV conversion formula of JPEG2000 */
+  /* convert with modified YUV conversion formula of JPEG2000; Y is
+     G+floor((Cb+Cr)/4), so the inverse has to round (Cb+Cr)/4 down as
+     well to be exact: the arithmetic shift does, a division would round
+     negative sums towards zero */
   long tmp; /* temporary variable that avoids problems if in and out array
                are identical */
   long i,j;
   for (i=1;i<=nx;i++) {
     for (j=1;j<=ny;j++) {
       tmp = ycbcr[1][i][j];
-      rgb[1][i][j]=ycbcr[0][i][j]-(ycbcr[1][i][j]+ycbcr[2][i][j])/4;
+      rgb[1][i][j]=ycbcr[0][i][j]-((ycbcr[1][i][j]+ycbcr[2][i][j]) >> 2);
       rgb[0][i][j]=ycbcr[2][i][j]+rgb[1][i][j];
       rgb[2][i][j]=tmp+rgb[1][i][j];
     }
@@ -728,77 +1101,287 @@ void YCbCr_to_RGB(long ***ycbcr, long ***rgb,long nx, long ny) {
 }
 
 /*--------------------------------------------------------------------------*/
-/* quantisation matrix */
+/* default quantisation matrix, w[u][v] at default_weights[8*u+v]; the
+   table of an encode (see QuantTable) is passed to all functions that
+   need it, so that images with different settings can be coded
+   concurrently */
+
+const long default_weights[64]= {10,15,25,37,51,66,82,100,
+                                 15,19,28,39,52,67,83,101,
+                                 25,28,35,45,58,72,88,105,
+                                 37,39,45,54,66,79,94,111,
+                                 51,52,58,66,76,89,103,119,
+                                 66,67,72,79,89,101,114,130,
+                                 82,83,88,94,104,114,127,142,
+                                 100,101,105,111,119,130,142,156};
+
+/* default quantisation matrix for chroma with -Q and --tables, from
+   Annex K of the JPEG standard; without a quality setting all channels use
+   default_weights */
+const long default_chroma_weights[64]= {17,18,24,47,99,99,99,99,
+                                        18,21,26,66,99,99,99,99,
+                                        24,26,56,99,99,99,99,99,
+                                        47,66,99,99,99,99,99,99,
+                                        99,99,99,99,99,99,99,99,
+                                        99,99,99,99,99,99,99,99,
+                                        99,99,99,99,99,99,99,99,
+                                        99,99,99,99,99,99,99,99};
+
+/*--------------------------------------------------------------------------*/
+void scale_weights(const long* base,  /* base quantisation matrix */
+                   long quality,      /* quality 1..100, 50: base matrix */
+                   long* weights) {   /* output: scaled matrix */
+  /* scale a quantisation matrix with a quality setting like libjpeg:
+     quality 50 keeps the base matrix, lower settings scale it up to 50
+     times, higher settings down to 1 everywhere at quality 100 */
+  long i, scale;
+
+  if (quality < 1) quality = 1;
+  if (quality > 100) quality = 100;
+  scale = (quality < 50) ? 5000/quality : 200-2*quality;
+  for (i=0;i<64;i++) {
+    weights[i] = (base[i]*scale+50)/100;
+    if (weights[i] < 1) weights[i] = 1;
+    if (weights[i] > 65535) weights[i] = 65535;
+  }
+}
 
-long w[8][8]= {{10,15,25,37,51,66,82,100}, 
-               {15,19,28,39,52,67,83,101},
-               {25,28,35,45,58,72,88,105},
-               {37,39,45,54,66,79,94,111},
-               {51,52,58,66,76,89,103,119},
-               {66,67,72,79,89,101,114,130},
-               {82,83,88,94,104,114,127,142},
-               {100,101,105,111,119,130,142,156}};
+/*--------------------------------------------------------------------------*/
+long read_weights(const char* file_name,   /* text file with matrices */
+                  long* luma,              /* output: luma matrix */
+                  long* chroma) {          /* output: chroma matrix */
+  /* read one or two quantisation matrices of 64 integers each in row
+     order, w[u][v] at position 8*u+v, separated by white space; text from
+     '#' to the end of a line is a comment. With a single matrix chroma
+     uses the luma matrix. Returns the number of matrices, 0 on error */
+  FILE *file;
+  long n = 0, value;
+  int ch;
+
+  file = fopen(file_name,"r");
+  if (file == NULL) {
+    printf("ERROR: Could not open quantisation tables %s.\n",file_name);
+    return 0;
+  }
+  for (;;) {
+    if (fscanf(file," %ld",&value) == 1) {
+      if (n == 128) {         /* more than two matrices */
+        n = -1;
+        break;
+      }
+      if (value < 1 || value > 65535) {
+        printf("ERROR: Quantisation weight %ld out of range 1..65535.\n",
+               value);
+        fclose(file);
+        return 0;
+      }
+      if (n < 64) luma[n] = value; else chroma[n-64] = value;
+      n++;
+      continue;
+    }
+    ch = getc(file);
+    if (ch == '#') {
+      while (ch != EOF && ch != '\n') ch = getc(file);
+    } else {
+      if (ch != EOF) n = -1;  /* anything but numbers and comments */
+      break;
+    }
+  }
+  fclose(file);
+  if (n != 64 && n != 128) {
+    printf("ERROR: %s does not contain 64 or 128 quantisation weights.\n",
+           file_name);
+    return 0;
+  }
+  if (n == 64) memcpy(chroma,luma,64*sizeof(long));
+  return n/64;
+}
 
 /*--------------------------------------------------------------------------*/
-/* calulates block DCT of input image/channel */
-void block_DCT(long  **f,            /* input image */
-               long nx, long ny,     /* image dimensions */
-               long N,               /* block size */
-               double  **dct) {      /* output DCT coefficients */        
+
+void init_zigzag_table(long N, long* zigzag_x, long* zigzag_y) {
+  /* create lookup tables for zig-zag pattern of N x N blocks: array index is
+  the number of the coefficient in the linear sequence of the zig-zag
+  pattern, starting with 0, value is the corresponding coordinate (for x and
+  y tables respectively). */
+  long i,j,c;
+  c=0;
+  i=0;
+  j=0;
+  zigzag_x[0]=0;
+  zigzag_y[0]=0;
+  while (i!=N-1 || j!=N-1) {
+    if ((i+j)%2 == 0) {
+      /* even diagonal: move up and to the right */
+      if (i == N-1)    j++;
+      else if (j == 0) i++;
+      else           { i++; j--; }
+    } else {
+      /* odd diagonal: move down and to the left */
+      if (j == N-1)    i++;
+      else if (i == 0) j++;
+      else           { i--; j++; }
+    }
+    c++;
+    zigzag_x[c]=i;
+    zigzag_y[c]=j;
+  }
+  return;
+}
+
+/*--------------------------------------------------------------------------*/
+void init_idct_basis(long N, double *ab) {
+  /* precompute scaled cosine basis alpha[u]*basis[u][x] of the DCT, see
+     idct_block; in double precision throughout, since the coefficients of
+     16 bit samples reach 2^20 and a single precision basis would already
+     be off by a few hundredths of a grey level */
+  double pi = 2.0 * asin (1.0);
+  long u,x;
+  for (u=0; u<N; u++)
+    for (x=0; x<N; x++) {
+      ab[u*N+x] = ((u==0) ? sqrt(1.0/(double)N) : sqrt(2.0/(double)N))*
+                  cos(pi/(double)N*((double)x+0.5)*(double)u);
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+/* tables of all block sizes, built once by get_block_tables and never
+   changed afterwards */
+static BlockTables block_tables[MAXBLOCKSIZE+1];
+static int block_tables_built = 0;
+
+const BlockTables* get_block_tables(long N) { /* block size 1..MAXBLOCKSIZE */
+  /* return the transform and scan tables of N x N blocks; the first call
+     builds the tables of all sizes, since they depend on N only */
+  long n,u,x;
+
+  #pragma omp critical (block_tables)
+  {
+    if (!block_tables_built) {
+      for (n=1;n<=MAXBLOCKSIZE;n++) {
+        init_idct_basis(n,block_tables[n].basis);
+        for (u=0;u<n;u++)
+          for (x=0;x<n;x++)
+            block_tables[n].basis_t[x*n+u] = block_tables[n].basis[u*n+x];
+        init_zigzag_table(n,block_tables[n].zigzag_x,
+                          block_tables[n].zigzag_y);
+      }
+      block_tables_built = 1;
+    }
+  }
+  return &block_tables[N];
+}
+
+/*--------------------------------------------------------------------------*/
+/* block DCT with the scaled cosine basis of the block tables, see
+   block_DCT; block_DCT calls it with a constant block size, so that every
+   supported size gets its own instance with fully known loop bounds */
+static inline void dct_blocks(long  **f,            /* input image */
+                              long nx, long ny,     /* image dimensions */
+                              long N,               /* block size */
+                              long flat,            /* largest range of a
+                                                       flat block */
+                              const BlockTables *bt,/* scaled basis */
+                              double  **dct) {      /* output DCT */
   long   x,y,u,v,k,l;   /* loop variables */
-  double  pi;            /* variable pi */
-  /* double  **f;           /\* extended image *\/ */
-  /* double  **c;           /\* extended coefficient matrix *\/ */
-  double  **basis;       /* time saver */
-  double  *alpha;        /* array for coefficients */
-  /* long   N=8;            /\* block size *\/ */
   long   blocks_x;       /* number of blocks in each direction */
   long   blocks_y;
   long   ox,oy;          /* block offsets */
+  long   fmin,fmax;      /* range of samples of a block */
+  double dc;             /* DC coefficient of a flat block */
+  const double *ab = bt->basis;    /* ab[u*N+x] */
+  const double *abt = bt->basis_t; /* ab[u*N+x] at abt[x*N+u] */
+  double fd[MAXCOEFFICIENTS];  /* samples of one block */
+  double tmp[MAXCOEFFICIENTS]; /* result of transform in y */
+  double acc[MAXBLOCKSIZE];    /* sums of one row */
 
-  /* ---- set time savers ---- */
-  pi = 2.0 * asinf (1.0);
-  
   /* determine number of blocks */
   blocks_x = nx/N;
   if ((nx % N) > 0) blocks_x++;
   blocks_y = ny/N;
   if ((ny % N) > 0) blocks_y++;
 
-  /* ---- allocate memory ---- */
-  alloc_vector (&alpha, N);
-  alloc_matrix (&basis, N,N);
- 
-  /* precompute scaling functions */
-  alpha[0]=sqrt(1.0/(double)N);
-  for (x=1;x<N;x++) {
-    alpha[x]=sqrt(2.0/(double)N); 
-  }
-
-  /* precompute cosine basis functions */
-  for (u=0; u<N; u++)
-    for (x=0; x<N; x++) {
-      basis[u][x] = cosf(pi/(double)N*((double)x+0.5)*(double)u);
-    }
-
   /* Iterate over all blocks */
   for (k=0;k<blocks_x;k++)
     for (l=0;l<blocks_y;l++) {
       ox = k*N+1; oy=l*N+1; /* define block offsets */
- 
-      /* 2-D block DCT */
-      /* supplement code here */
-      /* HINT: For the block k/l, the offsets ox and oy help you to find
-         the pixel coordinates in the full image. You can assume that
-         each block has full size NxN, the image is extended appropriately
-         elsewhere. Make use of the predefined cosine-basis and scaling
-         functions. */
+
+      /* flat block: only the DC coefficient, computed with the same
+         products and summation order as the v=0 column and u=0 row of
+         the full transform below, so that it is bit identical; the AC
+         coefficients of the full transform quantise to 0 by flat_range */
+      if (flat >= 0) {
+        fmin = fmax = f[ox][oy];
+        for (x=0; x<N; x++)
+          for (y=0; y<N; y++) {
+            fmin = min(fmin,f[ox+x][oy+y]);
+            fmax = max(fmax,f[ox+x][oy+y]);
+          }
+        if (fmax-fmin <= flat) {
+          dc = 0;
+          for (x=0; x<N; x++) {
+            acc[0] = 0;
+            for (y=0; y<N; y++)
+              acc[0] += (double)f[ox+x][oy+y]*abt[y*N];
+            dc += ab[x]*acc[0];
+          }
+          for (u=0; u<N; u++)
+            for (v=0; v<N; v++)
+              dct[ox+u][oy+v]=0;
+          dct[ox][oy] = dc;
+          continue;
+        }
+      }
+
+      /* 2-D block DCT, computed separably with 2*N^3 multiplications;
+         the innermost loops run over v and vectorise */
+      for (x=0; x<N; x++)
+        for (y=0; y<N; y++)
+          fd[x*N+y] = (double)f[ox+x][oy+y];
+
+      /* transform in second direction: tmp[x][v] = sum_y f[x][y] ab[v][y] */
+      for (x=0; x<N; x++) {
+        for (v=0; v<N; v++) acc[v]=0;
+        for (y=0; y<N; y++)
+          for (v=0; v<N; v++)
+            acc[v] += fd[x*N+y]*abt[y*N+v];
+        for (v=0; v<N; v++) tmp[x*N+v]=acc[v];
+      }
+
+      /* transform in first direction: dct[u][v] = sum_x ab[u][x] tmp[x][v] */
+      for (u=0; u<N; u++) {
+        for (v=0; v<N; v++) acc[v]=0;
+        for (x=0; x<N; x++)
+          for (v=0; v<N; v++)
+            acc[v] += ab[u*N+x]*tmp[x*N+v];
+        for (v=0; v<N; v++) dct[ox+u][oy+v]=acc[v];
+      }
     }
- 
-  /* ---- free memory ---- */
-  disalloc_vector (alpha, N);
-  disalloc_matrix (basis, N, N);
-  
+}
+
+/*--------------------------------------------------------------------------*/
+/* calulates block DCT of input image/channel; blocks with a sample range
+   (max-min) of at most flat only get their DC coefficient, all AC
+   coefficients are set to 0. The DC is bit identical to that of the full
+   DCT, and with the flat_range of the quantisation tables the AC
+   coefficients of the full DCT quantise to 0, so the quantised result is
+   the same; flat = 0 skips uniform blocks only and flat < 0 transforms all
+   blocks */
+void block_DCT(long  **f,            /* input image */
+               long nx, long ny,     /* image dimensions */
+               long N,               /* block size */
+               long flat,            /* largest range of a flat block */
+               double  **dct) {      /* output DCT coefficients */        
+  const BlockTables *bt = get_block_tables(N);
+
+  /* transform with a constant block size for the supported sizes */
+  switch (N) {
+  case 4:  dct_blocks(f,nx,ny,4,flat,bt,dct); break;
+  case 8:  dct_blocks(f,nx,ny,8,flat,bt,dct); break;
+  case 16: dct_blocks(f,nx,ny,16,flat,bt,dct); break;
+  default: dct_blocks(f,nx,ny,N,flat,bt,dct); break;
+  }
+
   return;
 }
 
@@ -847,80 +1430,138 @@ void extend_image(long **orig,               /* original input image */
 }
 
 
+/*--------------------------------------------------------------------------*/
+/* inverse DCT of an N x N block whose nonzero coefficients all lie in the
+   S x S corner of the lowest frequencies. The sums leave out the zero
+   coefficients but keep the order of the full transform, so the result is
+   the same for any S that covers the nonzero coefficients; called with
+   constant S, every support size gets its own unrolled kernel */
+static inline void idct_lowpass(const long   *coef, /* coefficients */
+                                long          N,    /* block size */
+                                long          S,    /* support */
+                                const double *ab,   /* scaled basis */
+                                double       *out) {/* reconstruction */
+  double tmp[MAXBLOCKSIZE*MAXBLOCKSIZE]; /* result of transform in v */
+  double sum;
+  long   u,v,x,y;
+
+  /* transform in second direction: tmp[u][y] = sum_v c[u][v] ab[v][y] */
+  for (u=0; u<S; u++)
+    for (y=0; y<N; y++) {
+      sum=0;
+      for (v=0; v<S; v++)
+        sum += coef[u*N+v]*ab[v*N+y];
+      tmp[u*N+y]=sum;
+    }
+
+  /* transform in first direction: out[x][y] = sum_u ab[u][x] tmp[u][y] */
+  for (x=0; x<N; x++)
+    for (y=0; y<N; y++) {
+      sum=0;
+      for (u=0; u<S; u++)
+        sum += ab[u*N+x]*tmp[u*N+y];
+      out[x*N+y]=sum;
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+/* inverse DCT of a block over the support of its coefficients, see
+   idct_block */
+static inline void idct_support(const long   *coef, /* coefficients */
+                                long          N,    /* block size */
+                                long          S,    /* support */
+                                const double *ab,   /* scaled basis */
+                                double       *out) {/* reconstruction */
+  double value;
+  long   i;
+
+  if (S <= 1) {
+    value = ab[0]*(coef[0]*ab[0]);
+    for (i=0; i<N*N; i++) out[i]=value;
+  } else if (S <= 2) {
+    idct_lowpass(coef,N,2,ab,out);
+  } else if (S <= 4) {
+    idct_lowpass(coef,N,4,ab,out);
+  } else {
+    idct_lowpass(coef,N,N,ab,out);
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+/* inverse DCT of a single N x N block; coef and out are stored row by row
+   with the first index (u resp. x) running slowest, ab holds the scaled
+   cosine basis alpha[u]*basis[u][x] at ab[u*N+x]. The 2-D transform is
+   computed separably, i.e. with 2*N^3 instead of N^4 multiplications, and
+   only over the support of the coefficients: a block with DC only is
+   constant, blocks within the lowest 2 x 2 or 4 x 4 frequencies have their
+   own kernels, for each of the block sizes 4, 8 and 16 */
+void idct_block(const long   *coef,  /* dequantised DCT coefficients */
+                long          N,     /* block size */
+                long          S,     /* support: nonzero coefficients have
+                                        u,v < S */
+                const double *ab,    /* scaled cosine basis */
+                double       *out) { /* reconstructed block */
+  switch (N) {
+  case 4:  idct_support(coef,4,S,ab,out); break;
+  case 8:  idct_support(coef,8,S,ab,out); break;
+  case 16: idct_support(coef,16,S,ab,out); break;
+  default: idct_support(coef,N,S,ab,out); break;
+  }
+}
+
 /*--------------------------------------------------------------------------*/
 /* inverts block DCT of quantised input coefficients */
 void block_IDCT(long   **dct,       /* quantised input coefficients */
                 long   nx, long ny,  /* image dimensions */
                 long   N,            /* block_size */
                 double **f) {       /* output image */        
-  long   x,y,u,v,k,l;   /* loop variables */
-  double  pi;            /* variable pi */
-  double  **basis;       /* time saver */
-  double  *alpha;        /* array for coefficients */
+  long   x,y,k,l;       /* loop variables */
+  const double *ab = get_block_tables(N)->basis; /* scaled cosine basis */
+  long   coef[MAXBLOCKSIZE*MAXBLOCKSIZE];/* coefficients of one block */
+  double out[MAXBLOCKSIZE*MAXBLOCKSIZE]; /* reconstruction of one block */
   long   blocks_x;       /* number of blocks in each direction */
   long   blocks_y;
   long   ox,oy;          /* block offsets */
+  long   S;              /* support of the nonzero coefficients */
 
-  /* ---- set time savers ---- */
-  pi = 2.0 * asinf (1.0);
-  
   /* determine number of blocks */
   blocks_x = nx/N;
   if ((nx % N) > 0) blocks_x++;
   blocks_y = ny/N;
   if ((ny % N) > 0) blocks_y++;
 
-  /* ---- allocate memory ---- */
-  alloc_vector (&alpha, N);
-  alloc_matrix (&basis, N,N);
-
-  /* precompute scaling functions */
-  alpha[0]=sqrt(1.0/(double)N);
-  for (x=1;x<N;x++) {
-    alpha[x]=sqrt(2.0/(double)N); 
-  }
-
-  /* precompute cosine basis functions */
-  for (u=0; u<N; u++)
-    for (x=0; x<N; x++) {
-      basis[u][x] = cosf(pi/(double)N*((double)x+0.5)*(double)u);
-    }
-
   /* Iterate over all blocks */
   for (k=0;k<blocks_x;k++)
     for (l=0;l<blocks_y;l++) {
       ox = k*N+1; oy=l*N+1; /* define block offsets */
  
-      /* 2-D block DCT */
+      /* 2-D block IDCT over the support of the nonzero coefficients */
+      S = 1;
       for (x=0; x<N; x++)
         for (y=0; y<N; y++) {
-          f[ox+x][oy+y]=0;
-          for (u=0; u<N; u++)
-            for (v=0; v<N; v++) {
-              f[ox+x][oy+y] += alpha[u]*alpha[v]*dct[ox+u][oy+v]*
-                               basis[u][x]*basis[v][y];
-            }
+          coef[x*N+y]=dct[ox+x][oy+y];
+          if (coef[x*N+y] != 0) S = max(S,max(x,y)+1);
         }
+      idct_block(coef,N,S,ab,out);
+      for (x=0; x<N; x++)
+        for (y=0; y<N; y++)
+          f[ox+x][oy+y]=out[x*N+y];
     }
   
-  /* ---- free memory ---- */
-  disalloc_vector (alpha, N);
-  disalloc_matrix (basis, N, N);
-  
   return;
 }
 
 
 /*--------------------------------------------------------------------------*/
-/* quantises DCT coefficients in blocks */
-void block_quantise(double  **dct,      /* input DCT coefficients */
-                    long nx, long ny,   /* image dimensions */
-                    FILE* debug_file,   /* 0 - no output, 
-                                           otherwise debug output to file */
-                    long  **quant) {    /* output quantised DCT coefficients */
-
-  long   u,v,k,l;   /* loop variables */
-  long   N=8;            /* block size */
+/* quantisation of all blocks, see block_quantise */
+static inline long quantise_blocks(double  **dct,      /* input DCT */
+                                   long nx, long ny,   /* image dimensions */
+                                   long N,             /* block size */
+                                   const QuantTable* qt,/* table */
+                                   FILE* debug_file,   /* debug output */
+                                   long  **quant) {    /* output */
+
+  long   u,v,k,l,i; /* loop variables */
   long   blocks_x;       /* number of blocks in each direction */
   long   blocks_y;
   long   ox,oy;          /* block offsets */
@@ -948,16 +1589,31 @@ void block_quantise(double  **dct,      /* input DCT coefficients */
         fprintf(debug_file,"Block %ld %ld\n",k,l);
         fprintf(debug_file,"-------------\n");
       }
+
+      /* flat block of block_DCT: only the DC coefficient is nonzero */
+      if (debug_file == 0 && ox+N-1 <= nx && oy+N-1 <= ny) {
+        for (i=1; i<N*N && dct[ox+i/N][oy+i%N] == 0.0; i++);
+        if (i == N*N) {
+          for (u=0; u<N; u++)
+            for (v=0; v<N; v++)
+              quant[ox+u][oy+v] = 0;
+          quant[ox][oy] = (long)(dct[ox][oy]/(double)qt->weights[0]);
+          max = max(max,quant[ox][oy]);
+          min = min(min,min(quant[ox][oy],0));
+          continue;
+        }
+      }
       
       /* apply quantisation matrix (handle incomplete blocks correctly!) */
       for (u=0; u<N; u++)
         for (v=0; v<N; v++) {
           if ((ox+u<=nx) && (oy+v<=ny)) {
-            quant[ox+u][oy+v] = (long)(dct[ox+u][oy+v]/(double)w[u][v]);
+            quant[ox+u][oy+v] = (long)(dct[ox+u][oy+v]/
+                                       (double)qt->weights[N*u+v]);
           }
           if (debug_file != 0) {
             fprintf(debug_file,"%f -> %ld (w %ld)\n",dct[ox+u][oy+v],
-                    quant[ox+u][oy+v],w[u][v]);
+                    quant[ox+u][oy+v],qt->weights[N*u+v]);
           }
           if (quant[ox+u][oy+v]>max) max = quant[ox+u][oy+v];
           if (quant[ox+u][oy+v]<min) min = quant[ox+u][oy+v];
@@ -969,20 +1625,37 @@ void block_quantise(double  **dct,      /* input DCT coefficients */
            min,max);
   }
   
-  return;
+  return max(max,-min);
   
 }
 
 /*--------------------------------------------------------------------------*/
-/* quantises DCT coefficients in blocks with INVERSE of quantisation weights */
-void block_requantise(long  **quant,      /* input DCT coefficients */
-                      long nx, long ny,   /* image dimensions */
-                      FILE* debug_file,   /* 0 - no output, 
-                                             otherwise debug output to file */
-                      long  **dct) {    /* output quantised DCT coefficients */
+/* quantises DCT coefficients in blocks of the size of the quantisation
+   table; returns the largest magnitude of a quantised coefficient */
+long block_quantise(double  **dct,      /* input DCT coefficients */
+                    long nx, long ny,   /* image dimensions */
+                    const QuantTable* qt,/* quantisation table */
+                    FILE* debug_file,   /* 0 - no output, 
+                                           otherwise debug output to file */
+                    long  **quant) {    /* output quantised DCT coefficients */
+  switch (qt->N) {
+  case 4:  return quantise_blocks(dct,nx,ny,4,qt,debug_file,quant);
+  case 8:  return quantise_blocks(dct,nx,ny,8,qt,debug_file,quant);
+  case 16: return quantise_blocks(dct,nx,ny,16,qt,debug_file,quant);
+  default: return quantise_blocks(dct,nx,ny,qt->N,qt,debug_file,quant);
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+/* requantisation of all blocks, see block_requantise */
+static inline void requantise_blocks(long  **quant,      /* input */
+                                     long nx, long ny,   /* dimensions */
+                                     long N,             /* block size */
+                                     const QuantTable* qt,/* table */
+                                     FILE* debug_file,   /* debug output */
+                                     long  **dct) {      /* output */
   
   long   u,v,k,l;   /* loop variables */
-  long   N=8;            /* block size */
   long   blocks_x;       /* number of blocks in each direction */
   long   blocks_y;
   long   ox,oy;          /* block offsets */
@@ -1015,11 +1688,11 @@ void block_requantise(long  **quant,      /* input DCT coefficients */
       for (u=0; u<N; u++)
         for (v=0; v<N; v++) {
           if ((ox+u<=nx) && (oy+v<=ny)) {
-            dct[ox+u][oy+v] = (long)(quant[ox+u][oy+v]*(double)w[u][v]);
+            dct[ox+u][oy+v] = quant[ox+u][oy+v]*qt->weights[N*u+v];
           }
           if (debug_file != 0) {
             fprintf(debug_file,"%ld -> %ld (w %ld)\n",quant[ox+u][oy+v],
-                    dct[ox+u][oy+v],w[u][v]);
+                    dct[ox+u][oy+v],qt->weights[N*u+v]);
           }
           if (dct[ox+u][oy+v]>max) max = dct[ox+u][oy+v];
           if (dct[ox+u][oy+v]<min) min = dct[ox+u][oy+v];
@@ -1035,42 +1708,165 @@ void block_requantise(long  **quant,      /* input DCT coefficients */
   
 }
 
+/*--------------------------------------------------------------------------*/
+/* quantises DCT coefficients in blocks of the size of the quantisation
+   table with INVERSE of quantisation weights */
+void block_requantise(long  **quant,      /* input DCT coefficients */
+                      long nx, long ny,   /* image dimensions */
+                      const QuantTable* qt,/* quantisation table */
+                      FILE* debug_file,   /* 0 - no output, 
+                                             otherwise debug output to file */
+                      long  **dct) {    /* output quantised DCT coefficients */
+  switch (qt->N) {
+  case 4:  requantise_blocks(quant,nx,ny,4,qt,debug_file,dct); break;
+  case 8:  requantise_blocks(quant,nx,ny,8,qt,debug_file,dct); break;
+  case 16: requantise_blocks(quant,nx,ny,16,qt,debug_file,dct); break;
+  default: requantise_blocks(quant,nx,ny,qt->N,qt,debug_file,dct); break;
+  }
+}
+
+
+/*--------------------------------------------------------------------------*/
+
+static inline long bit_length(unsigned long x) {
+  /* number of significant bits of x, 0 for x = 0; this is the category of
+     a coefficient of magnitude x */
+#if defined(__GNUC__)
+  return (x == 0) ? 0 : (long)(8*sizeof(unsigned long))-__builtin_clzl(x);
+#else
+  long n = 0;
+  while (x) { n++; x >>= 1; }
+  return n;
+#endif
+}
 
 /*--------------------------------------------------------------------------*/
+static inline long lowest_bit(uint64_t mask) {
+  /* index of the lowest set bit of a nonzero mask */
+#if defined(__GNUC__)
+  return __builtin_ctzll(mask);
+#else
+  long n = 0;
+  while (!(mask & 1)) { n++; mask >>= 1; }
+  return n;
+#endif
+}
 
-void init_category_table(long* table) {
-  /* initialise lookup table for categories: array index is the number to encode,
-     value of the table entry the corresponding category */
-  long i,cat;
-  long limits[12]={0,1,3,7,15,31,63,127,255,511,1023,2047};
-  cat=0;
-  for (i=0;i<=2047;i++) {
-    if (i>limits[cat]) cat++;
-    table[i]=cat;
+/*--------------------------------------------------------------------------*/
+static inline uint64_t nonzero_mask(const int32_t* coef) { /* 64 values */
+  /* bit i of the result is set iff coef[i] != 0. With SSE2 the values are
+     narrowed with signed saturation, which keeps nonzero values nonzero,
+     and 16 of them are compared with zero per movemask */
+  uint64_t mask = 0;
+  long i;
+#if defined(__SSE2__)
+  const __m128i *p = (const __m128i*)coef;
+  __m128i zero = _mm_setzero_si128();
+  __m128i a, b;
+
+  for (i=0;i<4;i++) {
+    a = _mm_packs_epi32(_mm_loadu_si128(p+4*i),_mm_loadu_si128(p+4*i+1));
+    b = _mm_packs_epi32(_mm_loadu_si128(p+4*i+2),_mm_loadu_si128(p+4*i+3));
+    a = _mm_cmpeq_epi8(_mm_packs_epi16(a,b),zero);
+    mask |= (uint64_t)(~_mm_movemask_epi8(a) & 0xffff) << (16*i);
   }
+#else
+  for (i=0;i<64;i++)
+    mask |= (uint64_t)(coef[i] != 0) << i;
+#endif
+  return mask;
 }
 
 /*--------------------------------------------------------------------------*/
+void init_quant_table(QuantTable* qt,        /* table, output */
+                      const long* matrix,    /* 8 x 8 quantisation matrix */
+                      long N) {              /* block size */
+  /* compute all derived forms of a quantisation matrix for N x N blocks.
+     Frequency u of an N x N block has the same spatial frequency as
+     frequency 8u/N of an 8 x 8 block, so the matrix is resampled at these
+     frequencies: for N = 16 every weight covers 2 x 2 frequencies, for
+     N = 4 every other weight is used. The orthonormal DCT keeps the error
+     per sample independent of N for the same weights */
+  const BlockTables *bt = get_block_tables(N);
+  double alpha[MAXBLOCKSIZE];
+  double sum[MAXBLOCKSIZE];     /* sum_x |cos(pi/N*(x+0.5)*u)| */
+  double pi = 2.0 * asin (1.0);
+  long i,u,v,x;
+
+  memcpy(qt->matrix,matrix,sizeof(qt->matrix));
+  qt->N = N;
+  alpha[0]=sqrt(1.0/(double)N);
+  for (u=1;u<N;u++) alpha[u]=sqrt(2.0/(double)N);
+  for (u=0;u<N;u++)
+    for (v=0;v<N;v++) {
+      i = N*u+v;
+      qt->weights[i] = matrix[8*(u*8/N)+v*8/N];
+      qt->reciprocal[i] = 1.0/(double)qt->weights[i];
+      qt->scaled[i] = alpha[u]*alpha[v]/(double)qt->weights[i];
+    }
+  for (i=0;i<N*N;i++)
+    qt->zigzag[i] = qt->weights[N*bt->zigzag_x[i]+bt->zigzag_y[i]];
+
+  /* the AC coefficient (u,v) of a block with samples in [c-r/2,c+r/2] is
+     at most alpha[u]*alpha[v]*r/2*sum[u]*sum[v] in magnitude, since the
+     basis functions sum to 0; half a weight is left for rounding errors */
+  for (u=0;u<N;u++) {
+    sum[u]=0;
+    for (x=0;x<N;x++)
+      sum[u] += fabs(cos(pi/(double)N*((double)x+0.5)*(double)u));
+  }
+  qt->flat_range = LONG_MAX;
+  for (u=0;u<N;u++)
+    for (v=0;v<N;v++) {
+      if (u == 0 && v == 0) continue;
+      qt->flat_range = min(qt->flat_range,
+                           (long)floor((qt->weights[N*u+v]-0.5)/
+                                       (alpha[u]*alpha[v]*0.5*sum[u]*sum[v])));
+    }
+  qt->next = 0;
+}
 
-void init_zigzag_table(long* zigzag_x, long* zigzag_y) {
-  /* create lookup tables for zig-zag pattern: array index is the number of the
-  coefficient in the linear sequence of the zig-zag pattern, starting with 0,
-  value is the corresponding coordinate (for x and y tables respectively). */
-  long i,j,c;
-  c=0;
-  i=0;
-  j=0;
-  zigzag_x[0]=0;
-  zigzag_y[0]=0;
-  while (i!=7 || j!=7) {
-    /* supplement your code here */
-    /* HINT: set i and j to the next coordinate in the zig zag pattern.
-       You can use case distinctions to do that. */ 
-    c++;
-    zigzag_x[c]=i;
-    zigzag_y[c]=j;
+/*--------------------------------------------------------------------------*/
+/* cache of all quantisation tables built so far; tables are never changed
+   or freed while the program runs, so they can be shared by all encoders
+   and decoders without locking */
+static QuantTable* quant_cache = 0;
+
+const QuantTable* get_quant_table(const long* matrix, /* 8 x 8 matrix */
+                                  long N) {           /* block size */
+  /* return the table of a quantisation matrix for N x N blocks, built on
+     first use */
+  QuantTable* qt;
+
+  #pragma omp critical (quant_cache)
+  {
+    for (qt=quant_cache; qt!=0; qt=qt->next)
+      if (qt->N == N && !memcmp(qt->matrix,matrix,sizeof(qt->matrix)))
+        break;
+    if (qt == 0) {
+      qt = (QuantTable*)malloc(sizeof(QuantTable));
+      if (qt == NULL) {
+        printf("get_quant_table: not enough memory available\n");
+        exit(1);
+      }
+      init_quant_table(qt,matrix,N);
+      qt->next = quant_cache;
+      quant_cache = qt;
+    }
+  }
+  return qt;
+}
+
+/*--------------------------------------------------------------------------*/
+void free_quant_tables(void) {
+  /* free the cache; no table may be in use any more */
+  QuantTable* qt;
+
+  while (quant_cache != 0) {
+    qt = quant_cache->next;
+    free(quant_cache);
+    quant_cache = qt;
   }
-  return;
 }
 
 /*--------------------------------------------------------------------------*/
@@ -1080,8 +1876,8 @@ void write_long_bitwise(long c, /* (positive) number to write */
                         long n, /* number of bits */
                         FILE* debug_file,   /* 0 - no output, 
                                             otherwise debug output to file */
-                        BFILE* output_file) /* 0 no output,
-                                               otherwise write to binary file */
+                        BITWRITER* output_file) /* 0 no output,
+                                               otherwise write to bitstream */
 {
   long i;
   if (debug_file !=0) {
@@ -1092,7 +1888,7 @@ void write_long_bitwise(long c, /* (positive) number to write */
   }
   if (output_file !=0) {
     for (i=0;i<n;i++) {
-      set_bit(output_file,c%2);
+      bw_putb(output_file,c%2);
       c/=2;
     }
   }
@@ -1101,177 +1897,780 @@ void write_long_bitwise(long c, /* (positive) number to write */
 
 
 /*--------------------------------------------------------------------------*/
-/* calulates block DCT of input image/channel */
-void block_encode(long  **quant,      /* input quantised DCT coefficients */
+/* number of categories that block_encode needs for a channel coded in
+   slices of interval block rows, at least NDCSYMBOLS: one more than the
+   bit length of the largest coefficient magnitude (as returned by
+   block_quantise) and of the largest DC prediction error */
+long channel_categories(long **quant,     /* quantised DCT coefficients */
+                        long nx, long ny, /* image dimensions */
+                        long N,           /* block size */
+                        long interval,    /* block rows per slice */
+                        long largest) {   /* largest coefficient magnitude */
+  long k,l;            /* loop variables */
+  long blocks_x;       /* number of blocks in each direction */
+  long blocks_y;
+  long last_dc = 0;    /* previous dc coefficient in coding order */
+
+  blocks_x = nx/N;
+  if ((nx % N) > 0) blocks_x++;
+  blocks_y = ny/N;
+  if ((ny % N) > 0) blocks_y++;
+
+  /* DC prediction restarts from 0 in every slice */
+  for (l=0;l<blocks_y;l++) {
+    if (l % interval == 0) last_dc = 0;
+    for (k=0;k<blocks_x;k++) {
+      largest = max(largest,labs(quant[k*N+1][l*N+1]-last_dc));
+      last_dc = quant[k*N+1][l*N+1];
+    }
+  }
+  return max(NDCSYMBOLS,bit_length(largest)+1);
+}
+
+/*--------------------------------------------------------------------------*/
+/* encodes the quantised DCT coefficients of the block rows
+   first_row,...,first_row+rows-1 of an image/channel (one slice); blocks are
+   traversed row by row. DC and AC coefficients are coded with separate WNC
+   models, and symbols and category offsets are kept apart, which results in
+   the four bitstreams STREAM_DC_SYMBOLS, ..., STREAM_AC_OFFSETS; a decoder
+   that needs DC coefficients only does not have to touch the AC streams.
+   All coefficients must lie in the given number of categories, see
+   channel_categories. Returns the number of AC symbols. */
+long block_encode(long  **quant,      /* input quantised DCT coefficients */
                   long nx, long ny,   /* image dimensions */
+                  long N,             /* block size */
+                  long first_row,     /* first block row of slice */
+                  long rows,          /* number of block rows in slice */
+                  long categories,    /* number of categories */
                   FILE* debug_file,   /* 0 - no output, 
                                          otherwise debug output to file */
-                  BFILE *binary_file) {/* file for binary output */
+                  BITWRITER *streams) {/* output: WNC_STREAMS bitstreams */
 
-  long u,v,k,l,i;      /* loop variables */
-  long N=8;            /* block size */
+  long u,v,k,l,i,w;    /* loop variables */
   long blocks_x;       /* number of blocks in each direction */
   long blocks_y;
   long ox,oy;          /* block offsets */
-  long category_lookup[2048]; /* lookup table for categories */
-  long zigzag_x[64];   /* x-index for zig-zag traversal of blocks */ 
-  long zigzag_y[64];   /* y-index for zig-zag traversal of blocks */
+  const BlockTables *bt = get_block_tables(N);
+  const long *zigzag_x = bt->zigzag_x; /* x-index for zig-zag traversal */
+  const long *zigzag_y = bt->zigzag_y; /* y-index for zig-zag traversal */
+  long *column[MAXBLOCKSIZE]; /* columns of current block */
+  int32_t coef[MAXCOEFFICIENTS]; /* coefficients of current block in
+                                    zig-zag order, padded with zeros to
+                                    full words of mask */
+  long words;          /* 64 bit words of mask per block */
+  uint64_t mask;       /* nonzero AC coefficients, bit i for position
+                          64*w+i */
+  long pos;            /* zig-zag position of previous coded coefficient */
   long last_dc = 0;    /* previously encoded dc coefficient */
   long cat;            /* category */
   long c;              /* number to encode in each category */
   long runlength;      /* run length */
-  long symbols;        /* number of symbols to encode */
-  long *cache_sym;     /* temporary storage for symbols */
-  long *cache_c;       /* temporary storage for numbers */
+  long symbols;        /* number of AC symbols to encode */
+  long blocks;         /* number of blocks = number of DC symbols */
+  SYMBUF dc_buf;       /* DC symbols and offsets of current block row */
+  SYMBUF ac_buf;       /* AC symbols and offsets of current block row */
+  SYMSEGMENT *seg;     /* segment of a symbol stream */
+  WNCEncoder dc_wnc;   /* WNC encoders for DC and AC symbols */
+  WNCEncoder ac_wnc;
+  long bytes;          /* size of symbol or offset streams before a row */
+  unsigned char category[AC_ALPHABET(WNC_MAXCATEGORIES)]; /* category of
+                                                             AC symbols */
   long pred_error;     /* prediction error for DC coefficients */
+  StatsTimer timer;    /* timer for statistics */
+  double trace;        /* start of trace spans for slice and block row */
+  double row_trace;
+
+  trace = trace_begin();
+  stats_start(&timer);
 
-  /* allocate memory */
-  alloc_long_vector(&cache_sym,nx*ny);
-  alloc_long_vector(&cache_c,nx*ny);
-  
   /* determine number of blocks */
   blocks_x = nx/N;
   if ((nx % N) > 0) blocks_x++;
   blocks_y = ny/N;
   if ((ny % N) > 0) blocks_y++;
+  if (first_row+rows > blocks_y) rows = blocks_y-first_row;
+
+  /* symbols are buffered for one block row only and then passed on to
+     the WNC encoders, which keep their state across rows */
+  sb_init(&dc_buf);
+  sb_init(&ac_buf);
+  wnc_encoder_init(&dc_wnc,categories,WNC_R,WNC_M,0,
+                   &streams[STREAM_DC_SYMBOLS]);
+  wnc_encoder_init(&ac_wnc,AC_ALPHABET(categories),WNC_R,WNC_M,0,
+                   &streams[STREAM_AC_SYMBOLS]);
+  for (i=0;i<AC_ALPHABET(categories);i++)
+    category[i] = (i < ZRL(categories)) ? i%categories : 0;
 
   if (debug_file != 0) {
     fprintf(debug_file,"ENCODING\n");
     fprintf(debug_file,"========\n");
   }
 
-  /* initialise lookup tables */
-  init_category_table((long*)category_lookup);
-  init_zigzag_table((long*)zigzag_x,(long*)zigzag_y);
+  /* pad the coefficients to full words of mask */
+  words = (N*N+63)/64;
+  for (i=N*N;i<64*words;i++) coef[i] = 0;
 
-  /* initialise symbol counter */
+  /* initialise symbol counters */
   symbols = 0;
+  blocks = 0;
   
   /* Iterate over all blocks and transform them into sequence of symbols */
-  for (k=0;k<blocks_x;k++)
-    for (l=0;l<blocks_y;l++) {
-      ox = k*N+1; oy=l*N+1; /* define block offsets */
+  for (l=first_row;l<first_row+rows;l++) {
+    row_trace = trace_begin();
+    stats_start(&timer);
+      for (k=0;k<blocks_x;k++) {
+        ox = k*N+1; oy=l*N+1; /* define block offsets */
 
-      /* print block for debugging */
-      if (debug_file != 0) {
-        fprintf(debug_file,"Block %ld %ld\n",k,l);
-        fprintf(debug_file,"quantised DCT:\n");
-        for (v=0; v<N; v++) {
-          for (u=0; u<N; u++) {
-            fprintf(debug_file,"%ld ",quant[ox+u][oy+v]);
+        /* print block for debugging */
+        if (debug_file != 0) {
+          fprintf(debug_file,"Block %ld %ld\n",k,l);
+          fprintf(debug_file,"quantised DCT:\n");
+          for (v=0; v<N; v++) {
+            for (u=0; u<N; u++) {
+              fprintf(debug_file,"%ld ",quant[ox+u][oy+v]);
+            }
+            fprintf(debug_file,"\n");
           }
-          fprintf(debug_file,"\n");
+          fprintf(debug_file,"encoded sequence:\n");
         }
-        fprintf(debug_file,"encoded sequence:\n");
-      }
 
-      /* encode DC coefficient of current block */
-      pred_error = quant[ox][oy]-last_dc;
-      cat = /* supplement your code here */
-            /* HINT: the array category_lookup has been initialised with
-               init_category_table to assist you. Find out what it does
-               and use it here. */
-      if (pred_error > 0) {
-        c = /* supplement your code here */
-      } else {
-        c = /* supplement your code here */
-      }
+        /* encode DC coefficient of current block */
+        pred_error = quant[ox][oy]-last_dc;
+        cat = bit_length(labs(pred_error));
+        if (pred_error > 0) {
+          c = pred_error;
+        } else {
+          c = (1L << cat)-1+pred_error;
+        }
 
-      /* store DC representation into cache */
-      cache_sym[symbols]=cat;
-      cache_c[symbols]=c;
-      symbols++;
+        /* store DC representation into row buffer */
+        sb_put(&dc_buf,cat,c);
+        blocks++;
       
-      /* write encoded DC coefficient to debug file */
-      if (debug_file != 0) {
-        fprintf(debug_file,"DC: %ld (diff %ld, last %ld, ",
-                cat,pred_error,last_dc);
-      }
-        write_long_bitwise(c,cat,debug_file,0);
-      if (debug_file != 0) {
-        fprintf(debug_file,") ");
-      }
+        /* write encoded DC coefficient to debug file */
+        if (debug_file != 0) {
+          fprintf(debug_file,"DC: %ld (diff %ld, last %ld, ",
+                  cat,pred_error,last_dc);
+        }
+          write_long_bitwise(c,cat,debug_file,0);
+        if (debug_file != 0) {
+          fprintf(debug_file,") ");
+        }
 
-      last_dc = quant[ox][oy];
+        last_dc = quant[ox][oy];
       
-      /* store AC coefficients */
-      /* symbols for AC: symbol:=12*runlength+cat covers 0,...,191 */
-      /* EOB: 193, ZRL: 192, both are available as defines */
-      /* for symbols without associated c, set cache_c to -1 */
-      runlength=0;
-      for (i=1;i<64;i++) {
-        u=zigzag_x[i]; v=zigzag_y[i];
-        if (quant[ox+u][oy+v]==0) {
-          runlength++;
-        } else {
-          cat = category_lookup[abs(quant[ox+u][oy+v])];
-          if (quant[ox+u][oy+v] > 0) {
-            c = quant[ox+u][oy+v];
-          } else {
-            c = (long)pow(2,cat)-1+quant[ox+u][oy+v];
-          }
+        /* store AC coefficients */
+        /* symbols for AC: symbol:=categories*runlength+cat, followed by
+           ZRL and EOB */
+        /* ZRL and EOB have no associated c and get offset 0 */
+        /* gather the block in zig-zag order and visit only the nonzero
+           coefficients given by the bits of mask, 64 positions at a
+           time */
+        for (u=0;u<N;u++) column[u] = quant[ox+u]+oy;
+        for (i=0;i<N*N;i++)
+          coef[i] = (int32_t)column[zigzag_x[i]][zigzag_y[i]];
+        pos = 0;
+        for (w=0;w<words;w++) {
+          mask = nonzero_mask(coef+64*w);
+          if (w == 0) mask &= ~(uint64_t)1;
+          while (mask != 0) {
+            i = 64*w+lowest_bit(mask);
+            mask &= mask-1;
+            runlength = i-pos-1;
+            pos = i;
+            cat = bit_length(labs(coef[i]));
+            if (coef[i] > 0) {
+              c = coef[i];
+            } else {
+              c = (1L << cat)-1+coef[i];
+            }
 
-          /* handle run lengths > 15 */
-          while (runlength > 15) {
-            cache_sym[symbols]=/* supplement your code here */
-            cache_c[symbols]=-1;
+            /* handle run lengths > 15 */
+            while (runlength > 15) {
+              sb_put(&ac_buf,ZRL(categories),0);
+              symbols++;
+              runlength-=16;
+              if (debug_file != 0) {
+              fprintf(debug_file,"ZRL ");
+              }
+            }
+
+            /* store AC representation into row buffer */
+            sb_put(&ac_buf,cat+categories*runlength,c);
             symbols++;
-            runlength=/* supplement your code here */
+
+            /* write encoded AC coefficient to debug file */
             if (debug_file != 0) {
-            fprintf(debug_file,"ZRL ");
+              fprintf(debug_file,"%ld/%ld ~ %ld (",
+                      runlength,cat,cat+categories*runlength);
+            }
+              write_long_bitwise(c,cat,debug_file,0);
+            if (debug_file != 0) {
+              fprintf(debug_file,") ");
             }
           }
-          
-          /* store AC representation into cache */
-          cache_sym[symbols]=cat+12*runlength;
-          cache_c[symbols]=c;
-          symbols++;
+        }
 
-          /* write encoded AC coefficient to debug file */
-          if (debug_file != 0) {
-            fprintf(debug_file,"%ld/%ld ~ %ld (",
-                    runlength,cat,cache_sym[symbols-1]);
-          }
-            write_long_bitwise(c,cat,debug_file,0);
+        /* handle end of block (EOB): zeros after the last nonzero
+           coefficient */
+        if (pos < N*N-1) {
+          sb_put(&ac_buf,EOB(categories),0);
+          symbols++;
           if (debug_file != 0) {
-            fprintf(debug_file,") ");
+            fprintf(debug_file,"EOB");
           }
-          runlength=0;
         }
-      }
 
-      /* handle end of block (EOB) */
-      if (runlength > 0) {
-        cache_sym[symbols]=EOB;
-        cache_c[symbols]=-1;
-        symbols++;
         if (debug_file != 0) {
-          fprintf(debug_file,"EOB");
+          fprintf(debug_file,"\n");
         }
       }
+    stats_stop(STAGE_SYMBOLISE,&timer,blocks_x*N*N*sizeof(long),0,blocks_x,
+               dc_buf.n+ac_buf.n);
+
+    /* encode DC and AC symbols of the row with adaptive arithmetic
+       coding */
+    stats_start(&timer);
+    bytes = bw_bytes(&streams[STREAM_DC_SYMBOLS])+
+            bw_bytes(&streams[STREAM_AC_SYMBOLS]);
+    for (seg=dc_buf.first;seg != 0 && seg->n > 0;seg=seg->next)
+      wnc_encode_symbols(&dc_wnc,0,seg->symbol,seg->n);
+    for (seg=ac_buf.first;seg != 0 && seg->n > 0;seg=seg->next)
+      wnc_encode_symbols(&ac_wnc,0,seg->symbol,seg->n);
+    stats_stop(STAGE_WNC,&timer,0,bw_bytes(&streams[STREAM_DC_SYMBOLS])+
+               bw_bytes(&streams[STREAM_AC_SYMBOLS])-bytes,0,
+               dc_buf.n+ac_buf.n);
+
+    /* store category offsets in their own bitstreams; the DC symbol is
+       the category, ZRL and EOB have category 0 and no offset */
+    stats_start(&timer);
+    bytes = bw_bytes(&streams[STREAM_DC_OFFSETS])+
+            bw_bytes(&streams[STREAM_AC_OFFSETS]);
+    for (seg=dc_buf.first;seg != 0 && seg->n > 0;seg=seg->next) {
+      for (i=0;i<seg->n;i++) {
+        write_long_bitwise(seg->offset[i],seg->symbol[i],debug_file,
+                           &streams[STREAM_DC_OFFSETS]);
+      }
+    }
+    for (seg=ac_buf.first;seg != 0 && seg->n > 0;seg=seg->next) {
+      for (i=0;i<seg->n;i++) {
+        write_long_bitwise(seg->offset[i],category[seg->symbol[i]],
+                           debug_file,&streams[STREAM_AC_OFFSETS]);
+      }
+    }
+    stats_stop(STAGE_OFFSETS,&timer,0,bw_bytes(&streams[STREAM_DC_OFFSETS])+
+               bw_bytes(&streams[STREAM_AC_OFFSETS])-bytes,0,0);
+
+    sb_reset(&dc_buf);
+    sb_reset(&ac_buf);
+    trace_end("block_row",row_trace,l);
+  }
+
+  /* terminate the WNC bitstreams and free memory */
+  stats_start(&timer);
+  wnc_encoder_finish(&dc_wnc);
+  wnc_encoder_finish(&ac_wnc);
+  stats_stop(STAGE_WNC,&timer,0,0,0,0);
+  sb_free(&dc_buf);
+  sb_free(&ac_buf);
+
+  trace_end("block_encode",trace,first_row);
+  return symbols;
+  
+}
+
+/*--------------------------------------------------------------------------*/
+static inline long decode_category_offset(long c,    /* offset */
+                                          long cat) {/* category */
+  /* invert the category representation of block_encode: positive numbers
+     are stored directly and have the leading bit set, negative numbers q
+     are stored as 2^cat-1+q */
+  if (cat == 0) return 0;
+  if (c >> (cat-1)) return c;
+  return c-((1L<<cat)-1);
+}
+
+/*--------------------------------------------------------------------------*/
+/* rebuilds the quantised DCT coefficients of one slice from symbols and
+   category offsets and reconstructs the image/channel; requantisation and
+   inverse DCT are fused per block, so no full size coefficient array is
+   needed. For K < N every block is reconstructed at size K x K only: the
+   orthonormal K x K IDCT of the K x K lowest frequencies, scaled by K/N,
+   yields a low-pass downscaled block, and for K = 1 this is simply the
+   block mean DC/N, so the AC symbols are not needed at all. Only the block
+   columns first_col,...,last_col are reconstructed; all other blocks are
+   parsed but neither requantised nor transformed */
+void block_decode(long* dc_symbols,     /* decoded DC symbols */
+                  long* ac_symbols,     /* decoded AC symbols (unused if
+                                           K = 1) */
+                  long n,               /* number of AC symbols */
+                  BITREADER* dc_offsets,/* stream of DC category offsets */
+                  BITREADER* ac_offsets,/* stream of AC category offsets */
+                  long nx, long ny,     /* image dimensions */
+                  long first_row,       /* first block row of slice */
+                  long rows,            /* number of block rows in slice */
+                  long first_col,       /* first reconstructed block column */
+                  long last_col,        /* last reconstructed block column */
+                  long categories,      /* number of categories */
+                  long K,               /* reconstructed block size: the
+                                           block size N of qt, N/2, N/4 or
+                                           1 (DC only) */
+                  const QuantTable* qt, /* quantisation table, for blocks
+                                           of size N */
+                  FILE* debug_file,     /* 0 - no output,
+                                           otherwise debug output to file */
+                  long **rec) {         /* output reconstructed image,
+                                           downscaled by K/N */
+
+  long u,v,k,l,i,x,y;  /* loop variables */
+  long N = qt->N;      /* block size */
+  long blocks_x;       /* number of blocks in each direction */
+  long blocks_y;
+  long ox,oy;          /* block offsets in output */
+  const long *zigzag_x = get_block_tables(N)->zigzag_x; /* x-index and */
+  const long *zigzag_y = get_block_tables(N)->zigzag_y; /* y-index for
+                                                   zig-zag traversal */
+  const long* weight = qt->zigzag; /* weights in zig-zag order */
+  long last_dc = 0;    /* previously decoded dc coefficient */
+  long sym;            /* current symbol */
+  long cat;            /* category */
+  long pos;            /* zig-zag position of next coefficient */
+  long next;           /* index of next AC symbol */
+  long block;          /* index of current block */
+  long coef[MAXCOEFFICIENTS]; /* requantised coefficients of current
+                                block */
+  const double *ab = get_block_tables(K)->basis; /* scaled cosine basis of
+                                                   the reconstructed blocks */
+  double out[MAXCOEFFICIENTS]; /* reconstruction of current block */
+  double scale;        /* amplitude scaling of the reduced size IDCT */
+  long skip;           /* block outside of the reconstructed columns? */
+  long value;          /* reconstruction of a flat block */
+  long S;              /* support of the nonzero coefficients */
+  unsigned char run[AC_ALPHABET(WNC_MAXCATEGORIES)];      /* run length and */
+  unsigned char category[AC_ALPHABET(WNC_MAXCATEGORIES)]; /* category of
+                                                             AC symbols */
+
+  /* determine number of blocks */
+  blocks_x = nx/N;
+  if ((nx % N) > 0) blocks_x++;
+  blocks_y = ny/N;
+  if ((ny % N) > 0) blocks_y++;
+
+  if (debug_file != 0) {
+    fprintf(debug_file,"DECODING\n");
+    fprintf(debug_file,"========\n");
+  }
+
+  /* initialise lookup tables */
+  scale = (double)K/(double)N;
+  for (i=0;i<ZRL(categories);i++) {
+    run[i] = i/categories;
+    category[i] = i%categories;
+  }
+
+  next = 0;
+  block = 0;
+  
+  if (first_row+rows > blocks_y) rows = blocks_y-first_row;
+
+  /* Iterate over all blocks in the order of block_encode */
+  for (l=first_row;l<first_row+rows;l++)
+    for (k=0;k<blocks_x;k++) {
+      ox = k*K+1; oy=l*K+1; /* define block offsets */
+      skip = (k < first_col || k > last_col);
+
+      /* DC coefficient: category and offset of the prediction error */
+      cat = dc_symbols[block++];
+      last_dc += decode_category_offset(br_getbits(dc_offsets,cat),cat);
 
       if (debug_file != 0) {
-        fprintf(debug_file,"\n");
+        fprintf(debug_file,"Block %ld %ld: DC %ld\n",k,l,last_dc);
+      }
+
+      /* DC only: the block mean */
+      if (K == 1) {
+        if (skip) continue;
+        rec[ox][oy]=(long)round(last_dc*weight[0]/(double)N);
+        continue;
+      }
+
+      /* flat block (EOB right after DC): constant, as from idct_block */
+      if (next < n && ac_symbols[next] == EOB(categories)) {
+        next++;
+        if (skip) continue;
+        value = (long)round(scale*(ab[0]*(last_dc*weight[0]*ab[0])));
+        for (x=0; x<K; x++)
+          for (y=0; y<K; y++)
+            rec[ox+x][oy+y]=value;
+        continue;
+      }
+
+      for (i=0;i<K*K;i++) coef[i]=0;
+      coef[0] = last_dc*weight[0];
+
+      /* AC coefficients: symbol = categories*runlength+cat, ZRL or EOB */
+      pos = 1;
+      S = 1;
+      while (pos < N*N) {
+        if (next >= n) {
+          printf("ERROR: Bitstream ends in block %ld %ld, aborting.\n",k,l);
+          exit(1);
+        }
+        sym = ac_symbols[next++];
+        if (sym == EOB(categories)) break;
+        if (sym == ZRL(categories)) {
+          pos += 16;
+          continue;
+        }
+        pos += run[sym];
+        cat = category[sym];
+        if (pos >= N*N) {
+          printf("ERROR: Corrupt run length in block %ld %ld, aborting.\n",
+                 k,l);
+          exit(1);
+        }
+        u = zigzag_x[pos]; v = zigzag_y[pos];
+        if (!skip && u < K && v < K) {
+          coef[u*K+v] = decode_category_offset(br_getbits(ac_offsets,cat),
+                                               cat)*weight[pos];
+          S = max(S,max(u,v)+1);
+        } else {
+          /* frequency is not reconstructed, skip its offset */
+          ac_offsets->pos += cat;
+        }
+        pos++;
       }
+
+      /* inverse DCT and rounding to integers */
+      if (skip) continue;
+      idct_block(coef,K,S,ab,out);
+      for (x=0; x<K; x++)
+        for (y=0; y<K; y++)
+          rec[ox+x][oy+y]=(long)round(scale*out[x*K+y]);
     }
 
-  /* encode and store symbols with adaptive arithmetic coding */
-  encode_adaptive_wnc(cache_sym,symbols,194,0.3,(long)pow(2,8),0,binary_file);
+  return;
+}
+
+/*--------------------------------------------------------------------------*/
+/* prediction of a sample in lossless coding from its neighbours a (left),
+   b (above), c (above left) and d (above right) with the median edge
+   detector of LOCO-I (JPEG-LS): the smaller of a and b above a
+   horizontal or vertical edge, the larger one below it, and the plane
+   through a, b and c otherwise. Samples above the first row of a slice
+   are not used, so that slices stay independent. The context of the
+   prediction error is the bit length of the local activity
+   |d-b|+|b-c|+|c-a|, so that flat and textured regions adapt their own
+   statistics */
+static inline long ll_predict(long **f,       /* channel */
+                              long x, long y, /* position of sample */
+                              long nx,        /* width of channel */
+                              long top,       /* first row of slice? */
+                              long *ctx) {    /* output: context */
+  long a,b,c,d;
+
+  if (top) {
+    a = (x > 1) ? f[x-1][y] : 0;
+    b = c = d = a;
+  } else {
+    b = f[x][y-1];
+    a = (x > 1) ? f[x-1][y] : b;
+    c = (x > 1) ? f[x-1][y-1] : b;
+    d = (x < nx) ? f[x+1][y-1] : b;
+  }
+  *ctx = min(bit_length(labs(d-b)+labs(b-c)+labs(c-a)),LL_CONTEXTS-1);
+  if (c >= max(a,b)) return min(a,b);
+  if (c <= min(a,b)) return max(a,b);
+  return a+b-c;
+}
 
-  /* append category offsets at end of file */
-  for (i=0;i<symbols;i++) {
-    if (cache_c[i] != -1) {
-      /* category is given as symbol mod 12 */
-      write_long_bitwise(cache_c[i],cache_sym[i]%12,debug_file,0);
+/*--------------------------------------------------------------------------*/
+/* number of categories of the prediction errors of lossless coding: the
+   colour differences of the reversible colour transform range from -maxval
+   to maxval, so prediction errors need one bit more than the samples. 8 bit
+   images keep the NDCSYMBOLS categories of the DC alphabet */
+static inline long lossless_categories(long maxval) {
+  return max(NDCSYMBOLS,bit_length(2*maxval)+1);
+}
+
+/*--------------------------------------------------------------------------*/
+/* lossless coding of the rows first_row,...,first_row+rows-1 of a channel
+   (counted from 0) into the DC streams of a slice: the prediction error
+   of every sample is represented like a DC prediction error of
+   block_encode, as category and category offset. The categories are WNC
+   coded with one model per context of ll_predict, the offsets are stored
+   in STREAM_DC_OFFSETS; the AC streams stay empty. Samples are predicted,
+   symbolised and coded one row at a time. Returns the number of coded
+   samples */
+long lossless_encode(long **f,          /* channel */
+                     long nx, long ny,  /* size of channel */
+                     long first_row,    /* first row of slice */
+                     long rows,         /* number of rows in slice */
+                     long categories,   /* number of categories */
+                     FILE* debug_file,  /* 0 - no output, otherwise debug
+                                           output to file */
+                     BITWRITER *streams) {/* output: WNC_STREAMS
+                                             bitstreams */
+  long x,y,i;          /* loop variables */
+  long pred;           /* predicted sample */
+  long ctx;            /* context of prediction error */
+  long pred_error;     /* prediction error */
+  long cat;            /* category */
+  long c;              /* number to encode in category */
+  long samples = 0;    /* number of coded samples */
+  long bytes;          /* size of symbol or offset stream before a row */
+  SYMBUF buf;          /* contexts, categories and offsets of a row */
+  SYMSEGMENT *seg;     /* segment of the row buffer */
+  WNCEncoder wnc;      /* WNC encoder of the categories */
+  WNCModel model[LL_CONTEXTS]; /* adaptive models per context */
+  StatsTimer timer;    /* timer for statistics */
+  double trace;        /* start of trace spans for slice and row */
+  double row_trace;
+
+  trace = trace_begin();
+  if (first_row+rows > ny) rows = ny-first_row;
+  sb_init(&buf);
+  wnc_encoder_init(&wnc,categories,WNC_R,WNC_M,0,
+                   &streams[STREAM_DC_SYMBOLS]);
+  for (i=0;i<LL_CONTEXTS;i++) wnc_model_init(&model[i],categories);
+
+  for (y=first_row+1;y<=first_row+rows;y++) {
+    row_trace = trace_begin();
+
+    /* predict the row and store context and category as one symbol */
+    stats_start(&timer);
+    for (x=1;x<=nx;x++) {
+      pred = ll_predict(f,x,y,nx,y == first_row+1,&ctx);
+      pred_error = f[x][y]-pred;
+      cat = bit_length(labs(pred_error));
+      if (pred_error > 0) {
+        c = pred_error;
+      } else {
+        c = (1L << cat)-1+pred_error;
+      }
+      sb_put(&buf,ctx*WNC_MAXCATEGORIES+cat,c);
+      if (debug_file != 0) {
+        fprintf(debug_file,"sample %ld %ld: %ld (pred %ld, ctx %ld)\n",
+                x,y,f[x][y],pred,ctx);
+      }
     }
+    samples += nx;
+    stats_stop(STAGE_SYMBOLISE,&timer,nx*sizeof(long),0,0,nx);
+
+    /* code the categories with the model of their context */
+    stats_start(&timer);
+    bytes = bw_bytes(&streams[STREAM_DC_SYMBOLS]);
+    for (seg=buf.first;seg != 0 && seg->n > 0;seg=seg->next)
+      for (i=0;i<seg->n;i++) {
+        wnc.model = &model[seg->symbol[i]/WNC_MAXCATEGORIES];
+        cat = seg->symbol[i]%WNC_MAXCATEGORIES;
+        wnc_encode_symbols(&wnc,&cat,0,1);
+      }
+    stats_stop(STAGE_WNC,&timer,0,bw_bytes(&streams[STREAM_DC_SYMBOLS])-
+               bytes,0,nx);
+
+    /* store the category offsets */
+    stats_start(&timer);
+    bytes = bw_bytes(&streams[STREAM_DC_OFFSETS]);
+    for (seg=buf.first;seg != 0 && seg->n > 0;seg=seg->next)
+      for (i=0;i<seg->n;i++)
+        write_long_bitwise(seg->offset[i],seg->symbol[i]%WNC_MAXCATEGORIES,
+                           0,&streams[STREAM_DC_OFFSETS]);
+    stats_stop(STAGE_OFFSETS,&timer,0,bw_bytes(&streams[STREAM_DC_OFFSETS])-
+               bytes,0,0);
+
+    sb_reset(&buf);
+    trace_end("sample_row",row_trace,y-1);
   }
 
-  /* free memory */
-  disalloc_long_vector(cache_sym,nx*ny);
-  disalloc_long_vector(cache_c,nx*ny);
+  /* terminate the WNC bitstream and free memory */
+  stats_start(&timer);
+  wnc_encoder_finish(&wnc);
+  stats_stop(STAGE_WNC,&timer,0,0,0,0);
+  for (i=0;i<LL_CONTEXTS;i++) wnc_model_free(&model[i],categories);
+  sb_free(&buf);
 
-  return;
-  
+  trace_end("lossless_encode",trace,first_row);
+  return samples;
+}
+
+/*--------------------------------------------------------------------------*/
+/* decodes the rows first_row,...,first_row+rows-1 of a channel coded by
+   lossless_encode; every sample is predicted from the samples decoded
+   before it, which also select the model of its category */
+void lossless_decode(BITREADER* symbols,  /* stream of categories */
+                     BITREADER* offsets,  /* stream of category offsets */
+                     long nx, long ny,    /* size of channel */
+                     long first_row,      /* first row of slice */
+                     long rows,           /* number of rows in slice */
+                     long categories,     /* number of categories */
+                     double r,            /* WNC rescaling parameter */
+                     long M,              /* WNC discretisation parameter */
+                     long **rec) {        /* output: decoded channel */
+  long x,y,i;          /* loop variables */
+  long pred;           /* predicted sample */
+  long ctx;            /* context of prediction error */
+  long cat;            /* category */
+  WNCDecoder wnc;      /* WNC decoder of the categories */
+  WNCModel model[LL_CONTEXTS]; /* adaptive models per context */
+
+  if (first_row+rows > ny) rows = ny-first_row;
+  wnc_decoder_init(&wnc,categories,r,M,0,symbols);
+  for (i=0;i<LL_CONTEXTS;i++) wnc_model_init(&model[i],categories);
+
+  for (y=first_row+1;y<=first_row+rows;y++)
+    for (x=1;x<=nx;x++) {
+      pred = ll_predict(rec,x,y,nx,y == first_row+1,&ctx);
+      wnc.model = &model[ctx];
+      wnc_decode_symbols(&wnc,1,&cat);
+      rec[x][y] = pred+decode_category_offset(br_getbits(offsets,cat),cat);
+    }
+
+  wnc_decoder_finish(&wnc);
+  for (i=0;i<LL_CONTEXTS;i++) wnc_model_free(&model[i],categories);
+}
+
+/*--------------------------------------------------------------------------*/
+long layout_compressed_file(WNCHeader* hdr,       /* header, slice
+                                                     positions are filled
+                                                     in */
+                            BITWRITER** streams) {/* WNC_STREAMS bitstreams
+                                                     of all slices per
+                                                     channel */
+  /* lay out all slices behind header and slice index; returns the size of
+     the container in bytes */
+  long c,i,j,pos;
+  SliceInfo* s;
+
+  /* assign byte positions to all bitstreams */
+  pos = wnc_header_size(hdr);
+  for (c=0;c<hdr->nc;c++)
+    for (i=0;i<hdr->slices[c];i++) {
+      s = &hdr->slice[c][i];
+      for (j=0;j<WNC_STREAMS;j++) {
+        s->pos[j] = pos;
+        s->len[j] = bw_bytes(&streams[c][i*WNC_STREAMS+j]);
+        pos += s->len[j];
+      }
+    }
+  return pos;
+}
+
+/*--------------------------------------------------------------------------*/
+void store_compressed_file(const WNCHeader* hdr,  /* laid out header */
+                           BITWRITER** streams,   /* bitstreams of all
+                                                     slices per channel */
+                           unsigned char* data) { /* output: container, of
+                                                     the size returned by
+                                                     layout_compressed_file */
+  /* store the complete container in memory */
+  long c,i;
+
+  data += store_wnc_header(hdr,data);
+  for (c=0;c<hdr->nc;c++)
+    for (i=0;i<hdr->slices[c]*WNC_STREAMS;i++) {
+      memcpy(data,streams[c][i].data,bw_bytes(&streams[c][i]));
+      data += bw_bytes(&streams[c][i]);
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+long write_compressed_stream(FILE* file,         /* output stream */
+                             WNCHeader* hdr,     /* header, slice positions
+                                                    are filled in */
+                             BITWRITER** streams) {/* WNC_STREAMS
+                                                    bitstreams of all slices
+                                                    per channel */
+  /* lay out all slices behind header and slice index and write the
+     container sequentially, so that file can be a pipe; returns the size
+     of the container in bytes, -1 on write errors */
+  long c,i,size;
+
+  size = layout_compressed_file(hdr,streams);
+  write_wnc_header(hdr,file);
+  for (c=0;c<hdr->nc;c++)
+    for (i=0;i<hdr->slices[c]*WNC_STREAMS;i++)
+      fwrite(streams[c][i].data,1,bw_bytes(&streams[c][i]),file);
+  return ferror(file) ? -1 : size;
+}
+
+/*--------------------------------------------------------------------------*/
+long write_compressed_file(const char* file_name,/* output file */
+                           WNCHeader* hdr,       /* header, slice positions
+                                                    are filled in */
+                           BITWRITER** streams) {/* WNC_STREAMS bitstreams
+                                                    of all slices per
+                                                    channel */
+  /* write the container to file_name; returns the size of the file in
+     bytes, -1 if it cannot be written */
+  FILE* file;
+  long size;
+
+  file = fopen(file_name,"wb");
+  if (file == NULL) {
+    printf("Could not open file '%s' for writing\n",file_name);
+    return -1;
+  }
+  size = write_compressed_stream(file,hdr,streams);
+  fclose(file);
+  return size;
+}
+
+/*--------------------------------------------------------------------------*/
+void decode_slice(const unsigned char* data, /* compressed file in memory */
+                  WNCHeader* hdr,            /* header with slice index */
+                  const QuantTable* qt,      /* table of channel c */
+                  long c,                    /* channel */
+                  long i,                    /* slice */
+                  long nx, long ny,          /* extended channel size */
+                  long first_col,            /* reconstructed block columns */
+                  long last_col,
+                  long K,                    /* reconstructed block size */
+                  long** rec) {              /* output: reconstruction */
+  /* decode one slice of a channel; slices are independent of each other.
+     For K = 1 only the DC streams are read */
+  SliceInfo* s = &hdr->slice[c][i];
+  BITREADER stream[WNC_STREAMS];
+  long *dc_symbols, *ac_symbols = 0;
+  long blocks,j;
+  StatsTimer timer;
+
+  for (j=0;j<WNC_STREAMS;j++)
+    br_init(&stream[j],data+s->pos[j],s->len[j]);
+
+  /* lossless coding: symbols and samples are decoded together */
+  if (hdr->block_size == BLOCKSIZE_LOSSLESS) {
+    stats_start(&timer);
+    lossless_decode(&stream[STREAM_DC_SYMBOLS],&stream[STREAM_DC_OFFSETS],
+                    nx,ny,s->first_row,s->rows,hdr->dc_alphabet,hdr->r,
+                    hdr->M,rec);
+    stats_stop(STAGE_RECONSTRUCT,&timer,s->len[STREAM_DC_SYMBOLS]+
+               s->len[STREAM_DC_OFFSETS],s->rows*nx*sizeof(long),0,
+               s->rows*nx);
+    return;
+  }
+  blocks = s->rows*((nx+hdr->block_size-1)/hdr->block_size);
+  alloc_long_vector(&dc_symbols,blocks > 0 ? blocks : 1);
+  stats_start(&timer);
+  decode_adaptive_wnc(&stream[STREAM_DC_SYMBOLS],blocks,hdr->dc_alphabet,
+                      hdr->r,hdr->M,0,dc_symbols);
+  if (K > 1) {
+    alloc_long_vector(&ac_symbols,s->symbols > 0 ? s->symbols : 1);
+    decode_adaptive_wnc(&stream[STREAM_AC_SYMBOLS],s->symbols,
+                        hdr->ac_alphabet,hdr->r,hdr->M,0,ac_symbols);
+  }
+  stats_stop(STAGE_WNC,&timer,s->len[STREAM_DC_SYMBOLS]+
+             (K > 1 ? s->len[STREAM_AC_SYMBOLS] : 0),0,0,
+             blocks+(K > 1 ? s->symbols : 0));
+  stats_start(&timer);
+  block_decode(dc_symbols,ac_symbols,s->symbols,&stream[STREAM_DC_OFFSETS],
+               &stream[STREAM_AC_OFFSETS],nx,ny,s->first_row,s->rows,
+               first_col,last_col,hdr->dc_alphabet,K,qt,0,rec);
+  stats_stop(STAGE_RECONSTRUCT,&timer,s->len[STREAM_DC_OFFSETS]+
+             (K > 1 ? s->len[STREAM_AC_OFFSETS] : 0),
+             blocks*K*K*sizeof(long),blocks,0);
+  disalloc_long_vector(dc_symbols,blocks > 0 ? blocks : 1);
+  if (K > 1) disalloc_long_vector(ac_symbols,s->symbols);
 }
 
 /*--------------------------------------------------------------------------*/
@@ -1287,73 +2686,925 @@ float mse(long ***u, long ***f, long nx, long ny, long nc) {
         sum += diff*diff;
       }
   
-  return (double)sum/(double)(nx*ny*(nc+1));
+  return (double)sum/(double)(nx*ny*nc);
+}
+
+/*--------------------------------------------------------------------------*/
+static inline long average(long sum, long counter) {
+  /* average of counter values with given sum, rounded half away from zero */
+  if (sum >= 0) return (sum+counter/2)/counter;
+  return -((-sum+counter/2)/counter);
+}
+
+/*--------------------------------------------------------------------------*/
+static inline void subsample_cells(long **f, long **g,
+                                   long kx, long ky, /* number of cells */
+                                   long fx, long fy) {/* cell size */
+  /* average all complete fx x fy cells of f; called with constant factors
+     for the common ratios so that the inner loops are fully unrolled */
+  long k,l,u,v,sum;
+  long *col[16];  /* columns of the current cell */
+
+  for (k=0;k<kx;k++) {
+    for (u=0;u<fx;u++) col[u]=f[k*fx+1+u];
+    for (l=0;l<ky;l++) {
+      sum=0;
+      for (u=0;u<fx;u++)
+        for (v=0;v<fy;v++)
+          sum+=col[u][l*fy+1+v];
+      g[k+1][l+1]=average(sum,fx*fy);
+    }
+  }
 }
 
 /*--------------------------------------------------------------------------*/
 void subsample(long **f, /* input: fine resolution */
                long **g, /* output: coarse resolution */
                long nx, long ny, /* fine resolution */
-               long factor) {    /* downsampling factor */
-  /* subsample by factor in each dimension with simple averaging */
+               long fx,          /* downsampling factor in x direction */
+               long fy) {        /* downsampling factor in y direction */
+  /* subsample by independent factors in each dimension with simple
+     averaging */
   
-  long nx_coarse, ny_coarse, sum, counter, k, l, u, v, ox, oy;
+  long nx_coarse, ny_coarse, kx, ky, sum, counter, k, l, u, v, ox, oy;
   
   /* determine coarse resolution */
-  nx_coarse = nx/factor;
-  ny_coarse = ny/factor;
-  if ((nx % factor) > 0) nx_coarse++;
-  if ((ny % factor) > 0) ny_coarse++;
+  nx_coarse = nx/fx;
+  ny_coarse = ny/fy;
+  if ((nx % fx) > 0) nx_coarse++;
+  if ((ny % fy) > 0) ny_coarse++;
+
+  /* number of complete cells in each direction */
+  kx = nx/fx;
+  ky = ny/fy;
+
+  /* complete cells: specialised kernels for the common ratios */
+  if      (fx==2 && fy==2) subsample_cells(f,g,kx,ky,2,2); /* 4:2:0 */
+  else if (fx==2 && fy==1) subsample_cells(f,g,kx,ky,2,1); /* 4:2:2 */
+  else if (fx==4 && fy==1) subsample_cells(f,g,kx,ky,4,1); /* 4:1:1 */
+  else if (fx==1 && fy==2) subsample_cells(f,g,kx,ky,1,2); /* 4:4:0 */
+  else                     subsample_cells(f,g,kx,ky,fx,fy);
   
-   /* Iterate over all fine resolution blocks corresponding to a coarse
-      resolution pixel and average */
+  /* Iterate over all incomplete fine resolution blocks at the right and
+     bottom image boundary and average over the available pixels */
   for (k=0;k<nx_coarse;k++)
     for (l=0;l<ny_coarse;l++) {
-      ox = k*factor+1; oy=l*factor+1; 
+      if (k<kx && l<ky) {
+        l=ky-1; /* skip complete cells */
+        continue;
+      }
+      ox = k*fx+1; oy=l*fy+1;
       sum=0; counter=0;
-      for (u=0; u<factor; u++)
-        for (v=0; v<factor; v++) {
+      for (u=0; u<fx; u++)
+        for (v=0; v<fy; v++) {
           if ((u+ox <= nx) && (v+oy <=ny)) {
-            sum+=/* supplement code here */
+            sum+=f[u+ox][v+oy];
             counter++;
           }
         }
-      g[k+1][l+1]=/*supplement code here */
+      g[k+1][l+1]=average(sum,counter);
     }
 }
 
+/*--------------------------------------------------------------------------*/
+static inline void upsample_cells(long **f, long **g,
+                                  long kx, long ky, /* number of cells */
+                                  long fx, long fy) {/* cell size */
+  /* nearest neighbour interpolation for all complete fx x fy cells; called
+     with constant factors for the common ratios */
+  long k,l,u,v,value;
+  long *col[16];  /* columns of the current cell */
+
+  for (k=0;k<kx;k++) {
+    for (u=0;u<fx;u++) col[u]=g[k*fx+1+u];
+    for (l=0;l<ky;l++) {
+      value=f[k+1][l+1];
+      for (u=0;u<fx;u++)
+        for (v=0;v<fy;v++)
+          col[u][l*fy+1+v]=value;
+    }
+  }
+}
+
 /*--------------------------------------------------------------------------*/
 void upsample(long **f, /* input: coarse resolution */
               long **g, /* output: fine resolution */
               long nx, long ny, /* fine resolution */
-              long factor) {    /* upsampling factor */
-  /* upsample by factor in each dimension with nearest neighbour */
+              long fx,          /* upsampling factor in x direction */
+              long fy) {        /* upsampling factor in y direction */
+  /* upsample by independent factors in each dimension with nearest
+     neighbour */
   
-  long nx_coarse, ny_coarse, k, l, u, v, ox, oy;
+  long nx_coarse, ny_coarse, kx, ky, k, l, u, v, ox, oy;
   
   /* determine coarse resolution */
-  nx_coarse = nx/factor;
-  ny_coarse = ny/factor;
-  if ((nx % factor) > 0) nx_coarse++;
-  if ((ny % factor) > 0) ny_coarse++;
+  nx_coarse = nx/fx;
+  ny_coarse = ny/fy;
+  if ((nx % fx) > 0) nx_coarse++;
+  if ((ny % fy) > 0) ny_coarse++;
+
+  /* number of complete cells in each direction */
+  kx = nx/fx;
+  ky = ny/fy;
+
+  /* complete cells: specialised kernels for the common ratios */
+  if      (fx==2 && fy==2) upsample_cells(f,g,kx,ky,2,2); /* 4:2:0 */
+  else if (fx==2 && fy==1) upsample_cells(f,g,kx,ky,2,1); /* 4:2:2 */
+  else if (fx==4 && fy==1) upsample_cells(f,g,kx,ky,4,1); /* 4:1:1 */
+  else if (fx==1 && fy==2) upsample_cells(f,g,kx,ky,1,2); /* 4:4:0 */
+  else                     upsample_cells(f,g,kx,ky,fx,fy);
   
-  /* Iterate over all fine resolution blocks corresponding to a coarse
-     resolution pixel and average */
+  /* Iterate over all incomplete fine resolution blocks at the right and
+     bottom image boundary */
   for (k=0;k<nx_coarse;k++)
     for (l=0;l<ny_coarse;l++) {
-      ox = k*factor+1; oy=l*factor+1;
-      for (u=0; u<factor; u++)
-        for (v=0; v<factor; v++) {
+      if (k<kx && l<ky) {
+        l=ky-1; /* skip complete cells */
+        continue;
+      }
+      ox = k*fx+1; oy=l*fy+1;
+      for (u=0; u<fx; u++)
+        for (v=0; v<fy; v++) {
           if (u+ox <= nx && v+oy <=ny) {
-            g[u+ox][v+oy]=/* supplement code here */
+            g[u+ox][v+oy]=f[k+1][l+1];
           }
         }
     }
 }
 
+/*--------------------------------------------------------------------------*/
+long parse_subsampling(const char *arg, long *fx, long *fy) {
+  /* parse subsampling factors given either as a single factor ("2"),
+     as horizontal x vertical factors ("2x1"), or in J:a:b notation
+     ("4:2:2", "4:2:0", "4:1:1", "4:4:0", "4:4:4");
+     returns 1 on success, 0 otherwise */
+  long j,a,b;
+
+  if (sscanf(arg,"%ld:%ld:%ld",&j,&a,&b) == 3) {
+    if (a <= 0 || j % a != 0 || (b != 0 && b != a)) return 0;
+    *fx = j/a;
+    *fy = (b == 0) ? 2 : 1;
+  } else if (sscanf(arg,"%ldx%ld",&a,&b) == 2) {
+    *fx = a;
+    *fy = b;
+  } else if (sscanf(arg,"%ld",&a) == 1) {
+    *fx = *fy = a;
+  } else {
+    return 0;
+  }
+
+  return (*fx >= 1 && *fx <= MAXSUBSAMPLING && *fy >= 1 &&
+          *fy <= MAXSUBSAMPLING);
+}
+
+/*--------------------------------------------------------------------------*/
+void crop_region(long ***f,         /* input: decoded channels */
+                 long ***g,         /* output: region, all channels at full
+                                       resolution */
+                 long nc,           /* number of channels */
+                 long x0, long y0,  /* upper left corner of region (from 0) */
+                 long w, long h,    /* size of region */
+                 long fx,           /* chroma subsampling factors */
+                 long fy) {
+  /* copy a rectangular region out of the decoded channels; subsampled
+     chroma channels are upsampled on the fly by nearest neighbour, which
+     gives the same result as upsample() on the whole image */
+  long x,y,c;
+
+  for (x=1;x<=w;x++)
+    for (y=1;y<=h;y++)
+      g[0][x][y]=f[0][x0+x][y0+y];
+  for (c=1;c<nc;c++)
+    for (x=1;x<=w;x++)
+      for (y=1;y<=h;y++)
+        g[c][x][y]=f[c][(x0+x-1)/fx+1][(y0+y-1)/fy+1];
+}
+
+/*--------------------------------------------------------------------------*/
+long write_decoded_image(long ***u,         /* decoded image */
+                         long nx, long ny,  /* image size */
+                         long nc,           /* number of channels */
+                         long maxval,       /* maximum sample value */
+                         const char* output_file, /* prefix of output file */
+                         FILE* out,         /* output stream, 0: file */
+                         char* comments,    /* comment string */
+                         char* file_name) { /* output: name for messages */
+  /* write the decoded image as pgm or ppm to out, or to the file
+     output_file_dec.pgm resp. .ppm if out is 0; returns the number of
+     bytes written and -1 on failure */
+  FILE* file = out;
+  long bytes;
+
+  if (out == 0) {
+    sprintf(file_name,"%s_dec.%s",output_file,(nc > 1) ? "ppm" : "pgm");
+    file = fopen(file_name,"wb");
+    if (file == NULL) {
+      printf("Could not open file '%s' for writing\n",file_name);
+      return -1;
+    }
+  } else {
+    strcpy(file_name,"standard output");
+  }
+  bytes = write_pnm_stream(u,nx,ny,(nc > 1) ? 3 : 1,maxval,file,comments);
+  if (out == 0) fclose(file);
+  return bytes;
+}
+
+
+/*--------------------------------------------------------------------------*/
+void prepare_channels(ImageData* image, /* image with original in orig_rgb */
+                      long* nx,         /* channel sizes, nx[0] and ny[0] */
+                      long* ny,         /* are the image size, the chroma
+                                           sizes are output */
+                      long sx,          /* chroma subsampling factors */
+                      long sy) {
+  /* convert the original image to YCbCr, subsample the chroma channels and
+     extend all channels to multiples of the block size; rec_quant[0] is
+     used as temporary storage */
+  long i, nc = image->nc;
+  StatsTimer timer;
+
+  /* convert to YCbCr space or copy over grey value image */
+  stats_start(&timer);
+  if (nc > 1) {
+    RGB_to_YCbCr(image->orig_rgb,image->orig_ycbcr,nx[0],ny[0]);
+  } else {
+    copy_matrix_long(image->orig_rgb[0],image->orig_ycbcr[0],nx[0],ny[0]);
+  }
+  stats_stop(STAGE_COLOUR,&timer,nx[0]*ny[0]*nc*sizeof(long),
+             nx[0]*ny[0]*nc*sizeof(long),0,0);
+
+  /* perform chroma subsampling */
+  nx[1]=nx[2]=(nx[0]+sx-1)/sx;
+  ny[1]=ny[2]=(ny[0]+sy-1)/sy;
+  if (nc > 1 && (sx > 1 || sy > 1)) {
+    stats_start(&timer);
+    subsample(image->orig_ycbcr[1],image->rec_quant[0],nx[0],ny[0],sx,sy);
+    copy_matrix_long(image->rec_quant[0],image->orig_ycbcr[1],nx[1],ny[1]);
+    subsample(image->orig_ycbcr[2],image->rec_quant[0],nx[0],ny[0],sx,sy);
+    copy_matrix_long(image->rec_quant[0],image->orig_ycbcr[2],nx[1],ny[1]);
+    stats_stop(STAGE_SUBSAMPLE,&timer,2*nx[0]*ny[0]*sizeof(long),
+               2*nx[1]*ny[1]*sizeof(long),0,0);
+  }
+
+  /* extend image dimensions to multiples of block_size */
+  for (i=0; i<nc; i++) {
+    extend_image(image->orig_ycbcr[i],nx[i],ny[i],image->block_size,
+                 image->orig_ycbcr[i]);
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+void alloc_slice_streams(BITWRITER** streams, /* bitstreams per channel */
+                         long* capacity,      /* allocated slices per
+                                                 channel */
+                         long c,              /* channel */
+                         long n) {            /* number of slices */
+  /* provide empty bitstreams for n slices of channel c; existing streams
+     are reused, so that their buffers do not have to grow again */
+  long j;
+
+  if (n > capacity[c]) {
+    streams[c] = (BITWRITER*)realloc(streams[c],n*WNC_STREAMS*
+                                     sizeof(BITWRITER));
+    if (streams[c] == NULL) {
+      printf("alloc_slice_streams: not enough memory available\n");
+      exit(1);
+    }
+    for (j=capacity[c]*WNC_STREAMS; j<n*WNC_STREAMS; j++)
+      bw_init(&streams[c][j]);
+    capacity[c] = n;
+  }
+  for (j=0; j<n*WNC_STREAMS; j++) bw_reset(&streams[c][j]);
+}
+
+/*--------------------------------------------------------------------------*/
+void free_slice_streams(BITWRITER** streams, long* capacity) {
+  /* free the bitstreams of all channels */
+  long c,j;
+
+  for (c=0; c<MAXCHANNELS; c++) {
+    for (j=0; j<capacity[c]*WNC_STREAMS; j++) bw_free(&streams[c][j]);
+    free(streams[c]);
+    streams[c] = 0;
+    capacity[c] = 0;
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+void transform_channels(ImageData* image, /* prepared channels */
+                        const long* flat) { /* largest range of a flat
+                                               block in luma and chroma */
+  /* apply block DCT to all channels; flat blocks are only given their DC
+     coefficient, see block_DCT */
+  long i,len;
+  StatsTimer timer;
+
+  for (i=0; i<image->nc; i++) {
+    len = image->nx_ext[i]*image->ny_ext[i];
+    stats_start(&timer);
+    block_DCT(image->orig_ycbcr[i],image->nx_ext[i],image->ny_ext[i],
+              image->block_size,flat[i > 0],image->dct[i]);
+    stats_stop(STAGE_DCT,&timer,len*sizeof(long),len*sizeof(double),
+               len/(image->block_size*image->block_size),0);
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+void encode_transformed(ImageData* image,   /* transformed channels */
+                        long* nx, long* ny, /* channel sizes */
+                        long sx, long sy,   /* chroma subsampling factors */
+                        long restart,       /* restart interval in block
+                                               rows, 0: one slice per
+                                               channel */
+                        const QuantTable** qt,/* quantisation tables of
+                                               luma and chroma */
+                        long threads,       /* threads for the slices,
+                                               0: OpenMP default */
+                        FILE* dfile,        /* debug output, 0: none */
+                        long*** quant,      /* output: quantised
+                                               coefficients */
+                        WNCHeader* header,  /* output: container header */
+                        BITWRITER** streams,/* output: bitstreams of all
+                                               slices per channel */
+                        long* capacity) {   /* allocated slices per
+                                               channel */
+  /* quantise the DCT coefficients in image->dct and encode them; every
+     channel is split into slices of restart block rows that are coded
+     independently of each other, so that a decoder can start at any slice
+     boundary. Only quant, header and streams are written, so several
+     encodes with different tables can share one transformed image */
+  long i,j,len,rows,interval;
+  long nc = image->nc;
+  long categories = NDCSYMBOLS; /* categories of all channels */
+  long largest;        /* largest quantised coefficient magnitude */
+  StatsTimer timer;
+
+  /* prepare container header: everything a decoder needs to know */
+  free_wnc_header(header);
+  init_wnc_header(header);
+  header->nx = nx[0]; header->ny = ny[0]; header->nc = nc;
+  header->block_size = image->block_size;
+  header->sx = sx; header->sy = sy;
+  header->maxval = image->maxval;
+  header->M = WNC_M;
+  header->r = WNC_R;
+  header->tables = (nc > 1 && qt[1] != qt[0]) ? 2 : 1;
+  for (i=0;i<64;i++) {
+    header->quant[0][i] = qt[0]->matrix[i];
+    header->quant[1][i] = qt[1]->matrix[i];
+  }
+
+  /* quantise all channels first, since the alphabets of the header have
+     to cover the categories of all of them */
+  for (i=0; i<nc; i++) {
+    len = image->nx_ext[i]*image->ny_ext[i];
+    stats_start(&timer);
+    largest = block_quantise(image->dct[i],image->nx_ext[i],image->ny_ext[i],
+                             qt[i > 0],0,quant[i]);
+    rows = image->ny_ext[i]/image->block_size;
+    interval = (restart > 0 && restart < rows) ? restart : rows;
+    categories = max(categories,
+                     channel_categories(quant[i],image->nx_ext[i],
+                                        image->ny_ext[i],image->block_size,
+                                        interval,largest));
+    stats_stop(STAGE_QUANTISE,&timer,len*sizeof(double),len*sizeof(long),
+               len/(image->block_size*image->block_size),0);
+  }
+  if (categories > WNC_MAXCATEGORIES) {
+    printf("ERROR: Quantised coefficients exceed %d categories, aborting.\n",
+           WNC_MAXCATEGORIES);
+    exit(1);
+  }
+  header->dc_alphabet = categories;
+  header->ac_alphabet = AC_ALPHABET(categories);
+
+  for (i=0; i<nc; i++) {
+    rows = image->ny_ext[i]/image->block_size;
+    interval = (restart > 0 && restart < rows) ? restart : rows;
+    alloc_wnc_slices(header,i,(rows+interval-1)/interval);
+    alloc_slice_streams(streams,capacity,i,header->slices[i]);
+    for (j=0; j<header->slices[i]; j++) {
+      header->slice[i][j].first_row = j*interval;
+      header->slice[i][j].rows = (j*interval+interval <= rows) ?
+                                 interval : rows-j*interval;
+    }
+    #pragma omp parallel for schedule(dynamic) if (dfile == 0) \
+                             num_threads(threads > 0 ? threads : \
+                                         omp_get_max_threads())
+    for (j=0; j<header->slices[i]; j++) {
+      header->slice[i][j].symbols =
+        block_encode(quant[i],image->nx_ext[i],image->ny_ext[i],
+                     image->block_size,header->slice[i][j].first_row,
+                     header->slice[i][j].rows,categories,dfile,
+                     &streams[i][j*WNC_STREAMS]);
+    }
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+void encode_channels(ImageData* image,   /* prepared channels */
+                     long* nx, long* ny, /* channel sizes */
+                     long sx, long sy,   /* chroma subsampling factors */
+                     long restart,       /* restart interval in block rows,
+                                            0: one slice per channel */
+                     const QuantTable** qt,/* quantisation tables of luma
+                                            and chroma */
+                     long threads,       /* threads for the slices,
+                                            0: OpenMP default */
+                     FILE* dfile,        /* debug output, 0: none */
+                     WNCHeader* header,  /* output: container header */
+                     BITWRITER** streams,/* output: bitstreams of all
+                                            slices per channel */
+                     long* capacity) {   /* allocated slices per channel */
+  long flat[2];   /* largest range of a flat block in luma and chroma */
+
+  /* apply block DCT, quantise into image->dct_quant and encode */
+  flat[0] = qt[0]->flat_range;
+  flat[1] = qt[1]->flat_range;
+  transform_channels(image,flat);
+  encode_transformed(image,nx,ny,sx,sy,restart,qt,threads,dfile,
+                     image->dct_quant,header,streams,capacity);
+}
+
+/*--------------------------------------------------------------------------*/
+void encode_lossless(ImageData* image,   /* prepared channels, without
+                                            chroma subsampling */
+                     long* nx, long* ny, /* channel sizes */
+                     long restart,       /* restart interval in rows,
+                                            0: one slice per channel */
+                     long threads,       /* threads for the slices,
+                                            0: OpenMP default */
+                     FILE* dfile,        /* debug output, 0: none */
+                     WNCHeader* header,  /* output: container header */
+                     BITWRITER** streams,/* output: bitstreams of all
+                                            slices per channel */
+                     long* capacity) {   /* allocated slices per channel */
+  /* lossless coding of the channels in image->orig_ycbcr, which hold the
+     reversible colour transform of the original; the container has block
+     size BLOCKSIZE_LOSSLESS, and its slices are ranges of rows */
+  long i,j,rows,interval;
+  long nc = image->nc;
+  long categories = lossless_categories(image->maxval);
+
+  free_wnc_header(header);
+  init_wnc_header(header);
+  header->nx = nx[0]; header->ny = ny[0]; header->nc = nc;
+  header->block_size = BLOCKSIZE_LOSSLESS;
+  header->sx = header->sy = 1;
+  header->maxval = image->maxval;
+  header->M = WNC_M;
+  header->r = WNC_R;
+  header->tables = 1;
+  for (i=0;i<64;i++) header->quant[0][i] = 1;
+  header->dc_alphabet = categories;
+  header->ac_alphabet = AC_ALPHABET(categories);
+
+  for (i=0; i<nc; i++) {
+    rows = ny[i];
+    interval = (restart > 0 && restart < rows) ? restart : rows;
+    alloc_wnc_slices(header,i,(rows+interval-1)/interval);
+    alloc_slice_streams(streams,capacity,i,header->slices[i]);
+    for (j=0; j<header->slices[i]; j++) {
+      header->slice[i][j].first_row = j*interval;
+      header->slice[i][j].rows = (j*interval+interval <= rows) ?
+                                 interval : rows-j*interval;
+      header->slice[i][j].symbols = 0;
+    }
+    #pragma omp parallel for schedule(dynamic) if (dfile == 0) \
+                             num_threads(threads > 0 ? threads : \
+                                         omp_get_max_threads())
+    for (j=0; j<header->slices[i]; j++) {
+      lossless_encode(image->orig_ycbcr[i],nx[i],ny[i],
+                      header->slice[i][j].first_row,header->slice[i][j].rows,
+                      categories,dfile,&streams[i][j*WNC_STREAMS]);
+    }
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+/* encoder state that is kept from one image to the next: image buffers
+   and bitstreams only grow if an image does not fit, so that encoding many
+   small images does not allocate any memory per image */
+typedef struct EncoderContext EncoderContext;
+struct EncoderContext {
+  ImageData  image;               /* image buffers */
+  long       max_nx, max_ny;      /* size the buffers are allocated for */
+  long       sx, sy;              /* chroma subsampling factors */
+  long       block_size;          /* size of quadratic DCT blocks,
+                                     BLOCKSIZE_LOSSLESS: lossless */
+  long       restart;             /* restart interval in block rows */
+  const QuantTable* qt[2];        /* quantisation tables of luma and chroma */
+  long       threads;             /* threads per image, 0: OpenMP default */
+  WNCHeader  header;              /* header of the current image */
+  BITWRITER *streams[MAXCHANNELS];/* bitstreams of all slices */
+  long       capacity[MAXCHANNELS];/* allocated slices per channel */
+};
+
+/*--------------------------------------------------------------------------*/
+void init_encoder(EncoderContext* ctx,    /* encoder, output */
+                  long sx, long sy,       /* chroma subsampling factors */
+                  long N,                 /* block size: 4, 8 or 16, or
+                                             BLOCKSIZE_LOSSLESS */
+                  long restart,           /* restart interval */
+                  const long* weights,    /* luma quantisation matrix */
+                  const long* chroma,     /* chroma quantisation matrix */
+                  long threads) {         /* threads per image */
+  /* set up an encoder without any buffers; lossless coding keeps the
+     chroma channels at full resolution */
+  long c;
+
+  if (N == BLOCKSIZE_LOSSLESS) sx = sy = 1;
+  init_image(&ctx->image);
+  init_wnc_header(&ctx->header);
+  ctx->max_nx = ctx->max_ny = 0;
+  ctx->sx = ctx->image.sx = sx;
+  ctx->sy = ctx->image.sy = sy;
+  ctx->block_size = ctx->image.block_size = N;
+  ctx->restart = restart;
+  ctx->threads = threads;
+  ctx->qt[0] = get_quant_table(weights,N);
+  ctx->qt[1] = get_quant_table(chroma,N);
+  for (c=0; c<MAXCHANNELS; c++) {
+    ctx->streams[c] = 0;
+    ctx->capacity[c] = 0;
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+void destroy_encoder(EncoderContext* ctx) {
+  /* free all buffers of an encoder; destroy_image frees the buffers with
+     the size stored in nx and ny */
+  ctx->image.nx = ctx->max_nx;
+  ctx->image.ny = ctx->max_ny;
+  if (ctx->max_nx > 0) destroy_image(&ctx->image);
+  init_image(&ctx->image);
+  ctx->max_nx = ctx->max_ny = 0;
+  free_wnc_header(&ctx->header);
+  free_slice_streams(ctx->streams,ctx->capacity);
+}
+
+/*--------------------------------------------------------------------------*/
+void reserve_encoder(EncoderContext* ctx, long nx, long ny) {
+  /* make sure that the image buffers of the encoder hold an image of size
+     nx x ny; the buffers are reallocated with the maximum size seen so
+     far, rounded up to full blocks */
+  ImageData* image = &ctx->image;
+  long N = ctx->block_size;
+
+  if (nx <= ctx->max_nx && ny <= ctx->max_ny) return;
+  image->nx = ctx->max_nx;   /* destroy_image frees with this size */
+  image->ny = ctx->max_ny;
+  if (ctx->max_nx > 0) destroy_image(image);
+  init_image(image);
+  image->block_size = N;
+  ctx->max_nx = image->nx = ((max(nx,ctx->max_nx)+N-1)/N)*N;
+  ctx->max_ny = image->ny = ((max(ny,ctx->max_ny)+N-1)/N)*N;
+  image->sx = ctx->sx;
+  image->sy = ctx->sy;
+  alloc_image(image,image->nx,image->ny);
+}
+
+/*--------------------------------------------------------------------------*/
+void prepare_encoder(EncoderContext* ctx,  /* encoder with image loaded */
+                     long nx, long ny,     /* image size */
+                     long nc,              /* number of channels */
+                     long* cnx, long* cny) {/* output: channel sizes */
+  /* colour conversion, subsampling and extension of the image in
+     ctx->image.orig_rgb */
+  ImageData* image = &ctx->image;
+
+  image->nx = cnx[0] = nx;
+  image->ny = cny[0] = ny;
+  image->nc = nc;
+  set_image_dimensions(image);
+  prepare_channels(image,cnx,cny,ctx->sx,ctx->sy);
+}
+
+/*--------------------------------------------------------------------------*/
+void encode_prepared(EncoderContext* ctx,  /* encoder with image loaded */
+                     long nx, long ny,     /* image size */
+                     long nc) {            /* number of channels */
+  /* encode the image in ctx->image.orig_rgb into the header and the
+     bitstreams of the encoder */
+  long cnx[MAXCHANNELS], cny[MAXCHANNELS]; /* channel sizes */
+
+  prepare_encoder(ctx,nx,ny,nc,cnx,cny);
+  if (ctx->block_size == BLOCKSIZE_LOSSLESS) {
+    encode_lossless(&ctx->image,cnx,cny,ctx->restart,ctx->threads,0,
+                    &ctx->header,ctx->streams,ctx->capacity);
+  } else {
+    encode_channels(&ctx->image,cnx,cny,ctx->sx,ctx->sy,ctx->restart,
+                    ctx->qt,ctx->threads,0,&ctx->header,ctx->streams,
+                    ctx->capacity);
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+long load_encoder(EncoderContext* ctx,     /* encoder */
+                  const char* input_file,  /* pgm or ppm image */
+                  long* nx, long* ny) {    /* output: image size */
+  /* read an image into ctx->image.orig_rgb, growing the buffers if it
+     does not fit; returns the number of channels and -1 on failure */
+  long nc;
+  StatsTimer timer;
+
+  stats_start(&timer);
+  nc = read_pnm(input_file,nx,ny,&ctx->image.maxval,ctx->image.orig_rgb,
+                ctx->max_nx,ctx->max_ny);
+  if (nc == 0) {
+    reserve_encoder(ctx,*nx,*ny);
+    nc = read_pnm(input_file,nx,ny,&ctx->image.maxval,ctx->image.orig_rgb,
+                  ctx->max_nx,ctx->max_ny);
+  }
+  if (nc < 0) return -1;
+  stats_stop(STAGE_LOAD,&timer,(*nx)*(*ny)*nc,(*nx)*(*ny)*nc*sizeof(long),
+             0,0);
+  return nc;
+}
+
+/*--------------------------------------------------------------------------*/
+long encode_file(EncoderContext* ctx,      /* encoder */
+                 const char* input_file,   /* pgm or ppm image */
+                 const char* output_file) {/* compressed file */
+  /* encode one image with the buffers of the encoder; returns the size of
+     the compressed file in bytes and -1 on failure. The image size and
+     number of channels are left in ctx->image */
+  long nx, ny, nc;
+  long size;                   /* size of compressed file */
+  StatsTimer timer;
+
+  nc = load_encoder(ctx,input_file,&nx,&ny);
+  if (nc < 0) return -1;
+  encode_prepared(ctx,nx,ny,nc);
+
+  stats_start(&timer);
+  size = write_compressed_file(output_file,&ctx->header,ctx->streams);
+  stats_stop(STAGE_WRITE,&timer,0,max(size,0),0,0);
+  return size;
+}
+
+/*--------------------------------------------------------------------------*/
+void encode_pixels(EncoderContext* ctx,          /* encoder */
+                   const unsigned char* pixels,  /* interleaved 8 bit
+                                                    samples, row by row */
+                   long stride,                  /* bytes per row */
+                   long nx, long ny,             /* image size */
+                   long nc) {                    /* channels, 1 or 3 */
+  /* encode an image from memory into the header and the bitstreams of the
+     encoder */
+  long x,y,c;
+  const unsigned char* row;
+  StatsTimer timer;
+
+  reserve_encoder(ctx,nx,ny);
+  ctx->image.maxval = MAXGREYVALUE;
+  stats_start(&timer);
+  for (y=0; y<ny; y++) {
+    row = pixels+y*stride;
+    for (x=0; x<nx; x++)
+      for (c=0; c<nc; c++)
+        ctx->image.orig_rgb[c][x+1][y+1] = row[x*nc+c];
+  }
+  stats_stop(STAGE_LOAD,&timer,nx*ny*nc,nx*ny*nc*sizeof(long),0,0);
+
+  encode_prepared(ctx,nx,ny,nc);
+}
 
+/*--------------------------------------------------------------------------*/
+static int compare_double(const void* a, const void* b) {
+  /* ascending order for qsort */
+  double d = *(const double*)a - *(const double*)b;
+  return (d > 0) - (d < 0);
+}
+
+/*--------------------------------------------------------------------------*/
+long read_manifest(const char* file_name, /* manifest, "-" for stdin */
+                   char*** inputs,        /* output: input files */
+                   char*** outputs) {     /* output: compressed files */
+  /* read a batch manifest with one image per line, given as "input" or
+     "input output"; without output, the extension of the input file is
+     replaced by .wnc. Empty lines and lines starting with # are skipped.
+     Returns the number of images, -1 if the manifest cannot be read */
+  FILE* file;
+  char line[4096], in[4096], out[4096];
+  long n = 0, capacity = 0, k;
+  char* dot;
+
+  file = strcmp(file_name,"-") ? fopen(file_name,"r") : stdin;
+  if (file == NULL) {
+    printf("could not open manifest '%s' for reading.\n",file_name);
+    return -1;
+  }
+  *inputs = *outputs = 0;
+  while (fgets(line,sizeof(line),file) != NULL) {
+    k = sscanf(line,"%4095s %4095s",in,out);
+    if (k < 1 || in[0] == '#') continue;
+    if (k < 2) {
+      strcpy(out,in);
+      dot = strrchr(out,'.');
+      if (dot != NULL && strchr(dot,'/') == NULL) *dot = 0;
+      strcat(out,".wnc");
+    }
+    if (n == capacity) {
+      capacity = (capacity > 0) ? 2*capacity : 1024;
+      *inputs = (char**)realloc(*inputs,capacity*sizeof(char*));
+      *outputs = (char**)realloc(*outputs,capacity*sizeof(char*));
+      if (*inputs == NULL || *outputs == NULL) {
+        printf("read_manifest: not enough memory available\n");
+        exit(1);
+      }
+    }
+    (*inputs)[n] = strdup(in);
+    (*outputs)[n] = strdup(out);
+    n++;
+  }
+  if (file != stdin) fclose(file);
+  return n;
+}
 
 /*--------------------------------------------------------------------------*/
+long run_batch(const char* manifest, /* manifest, "-" for stdin */
+               long sx, long sy,     /* chroma subsampling factors */
+               long N,               /* block size */
+               long restart,         /* restart interval in block rows */
+               const long* weights,  /* luma quantisation matrix */
+               const long* chroma) { /* chroma quantisation matrix */
+  /* encode all images of a manifest concurrently: every thread of the
+     pool keeps its own encoder and takes the next image as soon as it is
+     done with the previous one. Prints throughput and latency percentiles
+     and returns the number of images that could not be encoded */
+  char **inputs, **outputs;
+  double *latency;             /* encoding time of every image, -1 if it
+                                  failed */
+  double *ok;                  /* latencies of the encoded images */
+  double time_start, total;
+  long n, k, m;
+  long failed = 0;
+  long in_bytes = 0, out_bytes = 0;
+
+  n = read_manifest(manifest,&inputs,&outputs);
+  if (n < 0) return 1;
+  if (n == 0) {
+    printf("No images in manifest %s.\n",manifest);
+    return 0;
+  }
+  alloc_vector(&latency,n);
+  printf("Encoding %ld images with %d threads\n",n,omp_get_max_threads());
+
+  time_start = get_wall_time();
+  #pragma omp parallel reduction(+:failed,in_bytes,out_bytes)
+  {
+    EncoderContext ctx;        /* per-thread encoder, reused for all images */
+    double t;
+    long i, size;
+
+    init_encoder(&ctx,sx,sy,N,restart,weights,chroma,1);
+    #pragma omp for schedule(dynamic)
+    for (i=0; i<n; i++) {
+      t = get_wall_time();
+      size = encode_file(&ctx,inputs[i],outputs[i]);
+      latency[i] = get_wall_time()-t;
+      if (size < 0) {
+        printf("FAILED: %s\n",inputs[i]);
+        latency[i] = -1;
+        failed++;
+        continue;
+      }
+      in_bytes += ctx.image.nx*ctx.image.ny*ctx.image.nc*
+                  ((ctx.image.maxval > MAXGREYVALUE) ? 2 : 1);
+      out_bytes += size;
+    }
+    destroy_encoder(&ctx);
+  }
+  total = get_wall_time()-time_start;
+
+  /* summary of the encoded images; the failed ones are sorted to the
+     front and left out. Input bytes are those of the samples */
+  qsort(latency,n,sizeof(double),compare_double);
+  ok = latency+failed;
+  m = n-failed;
+  printf("Encoded %ld of %ld images in %f s\n",m,n,total);
+  if (m > 0) {
+    printf("Throughput: %.1f images/s, %.2f MB/s in, %.2f MB/s out\n",
+           m/total,in_bytes/total/1e6,out_bytes/total/1e6);
+    printf("Latency per image: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, "
+           "max %.3f ms\n",1e3*ok[(long)(0.50*(m-1)+0.5)],
+           1e3*ok[(long)(0.90*(m-1)+0.5)],
+           1e3*ok[(long)(0.99*(m-1)+0.5)],1e3*ok[m-1]);
+  }
+  if (in_bytes > 0) {
+    printf("Resulting compression ratio: %f:1\n",
+           (double)in_bytes/(double)out_bytes);
+  }
+
+  for (k=0; k<n; k++) {
+    free(inputs[k]);
+    free(outputs[k]);
+  }
+  free(inputs);
+  free(outputs);
+  disalloc_vector(latency,n);
+  return failed;
+}
+
+/*--------------------------------------------------------------------------*/
+long run_ladder(const char* input_file,  /* pgm or ppm image */
+                const char* output_file, /* prefix of compressed files */
+                long sx, long sy,        /* chroma subsampling factors */
+                long N,                  /* block size */
+                long restart,            /* restart interval in block rows */
+                const long* weights,     /* luma base matrix */
+                const long* chroma,      /* chroma base matrix */
+                const long* qualities,   /* quality of every level */
+                long levels) {           /* number of levels */
+  /* encode one image at several qualities: loading, colour conversion,
+     subsampling and DCT are done once, then every level quantises and
+     codes the shared coefficients with its own scaled tables, levels in
+     parallel. Level k is written to <output_file>_q<quality>.wnc and is
+     identical to a single encode with -Q <quality>. Returns the number of
+     levels that could not be written */
+  EncoderContext ctx;
+  ImageData* image = &ctx.image;
+  long cnx[MAXCHANNELS], cny[MAXCHANNELS]; /* channel sizes */
+  long size[MAXLEVELS];        /* compressed size of every level */
+  double time[MAXLEVELS];      /* quantise and code time of every level */
+  double time_start, time_shared;
+  long nx, ny, nc, k;
+  long failed = 0;
+  long scaled[64];             /* matrix of a level */
+  long flat[2] = {LONG_MAX, LONG_MAX}; /* largest range of a block that is
+                                          flat at all levels */
+
+  time_start = get_wall_time();
+  init_encoder(&ctx,sx,sy,N,restart,weights,chroma,0);
+  nc = load_encoder(&ctx,input_file,&nx,&ny);
+  if (nc < 0) {
+    destroy_encoder(&ctx);
+    return levels;
+  }
+  prepare_encoder(&ctx,nx,ny,nc,cnx,cny);
+  for (k=0; k<levels; k++) {
+    scale_weights(weights,qualities[k],scaled);
+    flat[0] = min(flat[0],get_quant_table(scaled,N)->flat_range);
+    scale_weights(chroma,qualities[k],scaled);
+    flat[1] = min(flat[1],get_quant_table(scaled,N)->flat_range);
+  }
+  transform_channels(image,flat);
+  time_shared = get_wall_time()-time_start;
+
+  #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+  for (k=0; k<levels; k++) {
+    long w[2][64];             /* scaled luma and chroma matrices */
+    const QuantTable* qt[2];
+    long ***quant;             /* quantised coefficients of this level */
+    WNCHeader header;
+    BITWRITER *streams[MAXCHANNELS] = {0,0,0};
+    long capacity[MAXCHANNELS] = {0,0,0};
+    char file_name[1000];
+    double start = get_wall_time();
+    StatsTimer timer;
+
+    scale_weights(weights,qualities[k],w[0]);
+    scale_weights(chroma,qualities[k],w[1]);
+    qt[0] = get_quant_table(w[0],N);
+    qt[1] = get_quant_table(w[1],N);
+    alloc_long_cubix(&quant,MAXCHANNELS,image->nx_ext[0]+2,
+                     image->ny_ext[0]+2);
+    init_wnc_header(&header);
+    encode_transformed(image,cnx,cny,sx,sy,restart,qt,1,0,quant,&header,
+                       streams,capacity);
+    sprintf(file_name,"%s_q%ld.wnc",output_file,qualities[k]);
+    stats_start(&timer);
+    size[k] = write_compressed_file(file_name,&header,streams);
+    stats_stop(STAGE_WRITE,&timer,0,max(size[k],0),0,0);
+    if (size[k] < 0) failed++;
+    free_slice_streams(streams,capacity);
+    free_wnc_header(&header);
+    disalloc_long_cubix(quant,MAXCHANNELS,image->nx_ext[0]+2,
+                        image->ny_ext[0]+2);
+    time[k] = get_wall_time()-start;
+  }
+
+  printf("Image %s: %ld x %ld x %ld, load, colour conversion and DCT "
+         "%f s\n",input_file,nx,ny,nc,time_shared);
+  for (k=0; k<levels; k++) {
+    if (size[k] < 0) continue;
+    printf("Quality %3ld: %ld bytes, %.4f bpp, %f s -> %s_q%ld.wnc\n",
+           qualities[k],size[k],8.0*size[k]/(nx*ny),time[k],output_file,
+           qualities[k]);
+  }
+  printf("Encoding time: %f s (%ld levels)\n",get_wall_time()-time_start,
+         levels);
+
+  destroy_encoder(&ctx);
+  return failed;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* the benchmarks include this file and provide their own main */
+#ifndef JPEG_LIGHT_NO_MAIN
 
 int main (int argc, char **args)
 
@@ -1373,8 +3624,9 @@ int main (int argc, char **args)
   char total_file[1000];       /* file name of total compressed output */
   char comments[10000];        /* string for comments */
   char *program_call;          /* call of the compression program */
-  char extension[5];           /* extension of input file */
   long format;                 /* format of input file */
+  FILE *data_out = 0;          /* standard output for the compressed or
+                                  decoded image with -o -, 0: files */
 
   /* image information */
   long nx[3], ny[3], nc;                /* image dimensions */
@@ -1388,12 +3640,59 @@ int main (int argc, char **args)
 
   /* compression/decompression */
   long flag_compress=0;
-  BFILE* binary_file=0;       /* binary file for compressed bitstring */
   char*  debug_file=0;        /* filename for writing debug information */
   FILE*  dfile=0;             /* file for writing debug information */
   long   q=0;                 /* quantisation parameter */
-  long   s=0;                 /* chroma subsampling factor */
+  long   quality=0;           /* quality 1..100, 0: not set */
+  char  *tables_file=0;       /* file with custom quantisation matrices */
+  long   qualities[MAXLEVELS];/* qualities of a ladder */
+  long   levels=0;            /* number of ladder levels, 0: no ladder */
+  long   weights[64];         /* luma quantisation matrix */
+  long   chroma[64];          /* chroma quantisation matrix */
+  const QuantTable *qt[2];    /* tables of luma and chroma with derived
+                                 forms */
+  long   sx=0, sy=0;          /* chroma subsampling factors */
+  long   lossless=0;          /* lossless coding? */
+  long   N;                   /* block size */
+  long   K;                   /* reconstructed block size when decoding */
   long **tmp_img;             /* temporary image */
+  unsigned char *data;        /* compressed file in memory */
+  long   size;                /* size of compressed file */
+  WNCHeader header;           /* header of compressed file */
+  BITWRITER *streams[MAXCHANNELS]={0,0,0}; /* bitstreams of all slices */
+  long   capacity[MAXCHANNELS]={0,0,0};   /* allocated slices per channel */
+  long   scale=8;             /* decoding scale in eighths */
+  long   snx[MAXCHANNELS];    /* channel sizes at decoding scale */
+  long   sny[MAXCHANNELS];
+  long   restart=0;           /* restart interval in block rows, 0: none */
+  long   crop=0;              /* decode region of interest only? */
+  long   roi_x=0,roi_y=0;     /* region of interest: upper left corner */
+  long   roi_w=0,roi_h=0;     /* and size */
+  long   first_col[MAXCHANNELS]; /* blocks overlapping the region */
+  long   last_col[MAXCHANNELS];
+  long   first_row[MAXCHANNELS];
+  long   last_row[MAXCHANNELS];
+  long ***crop_img;           /* decoded region of interest */
+  SliceInfo *slice;           /* current slice */
+  StatsTimer timer;           /* timer for statistics */
+  char  *trace_file=0;        /* file name for timeline trace */
+  char  *batch_file=0;        /* manifest of images for batch encoding */
+  static struct option long_options[] = {
+    {"scale", required_argument, 0, 'S'},
+    {"crop", required_argument, 0, 'C'},
+    {"stats", optional_argument, 0, 'T'},
+    {"trace", required_argument, 0, 'X'},
+    {"batch", required_argument, 0, 'B'},
+    {"quality", required_argument, 0, 'Q'},
+    {"tables", required_argument, 0, 'M'},
+    {"ladder", required_argument, 0, 'L'},
+    {"lossless", no_argument, 0, 'Z'},
+    {0, 0, 0, 0}
+  };
+  long  *slice_c;             /* channel of each slice */
+  long  *slice_i;             /* index of each slice in its channel */
+  long   slices;              /* total number of slices */
+  double time_start;          /* for measuring encoding/decoding time */
   
   printf ("\n");
   printf ("PROGRAMMING EXERCISE FOR IMAGE COMPRESSION\n\n");
@@ -1414,7 +3713,7 @@ int main (int argc, char **args)
     used[i] = 0;
   }
 
-  while ((ch = getopt(argc,args,"i:q:o:D:s:")) != -1) {
+  while ((ch = getopt_long(argc,args,"i:q:Q:o:D:s:R:b:",long_options,0)) != -1) {
     used[(long)ch]++;
     if (used[(long)ch] > 1) {
       printf("Duplicate parameter: %c\n",ch);
@@ -1422,8 +3721,68 @@ int main (int argc, char **args)
     }
     
     switch(ch) {
-    case 's': s=atoi(optarg); image.s=s; break;
+    case 's':
+      if (!parse_subsampling(optarg,&sx,&sy)) {
+        printf("ERROR: Invalid subsampling factors %s, aborting.\n",optarg);
+        print_usage_message();
+        return 0;
+      }
+      image.sx=sx; image.sy=sy;
+      break;
+    case 'S':
+      scale = parse_scale(optarg);
+      if (scale == 0) {
+        printf("ERROR: Invalid decoding scale %s, aborting.\n",optarg);
+        print_usage_message();
+        return 0;
+      }
+      break;
+    case 'C':
+      if (!parse_crop(optarg,&roi_x,&roi_y,&roi_w,&roi_h)) {
+        printf("ERROR: Invalid region %s, aborting.\n",optarg);
+        print_usage_message();
+        return 0;
+      }
+      crop = 1;
+      break;
+    case 'b':
+      image.block_size = atoi(optarg);
+      if (!VALID_BLOCKSIZE(image.block_size)) {
+        printf("ERROR: Invalid block size %s, aborting.\n",optarg);
+        print_usage_message();
+        return 0;
+      }
+      break;
+    case 'R': restart=atoi(optarg);break;
+    case 'X': trace_file = optarg;break;
+    case 'B': batch_file = optarg;break;
+    case 'T':
+      stats_mode = parse_stats_mode(optarg);
+      if (stats_mode < 0) {
+        printf("ERROR: Invalid statistics format %s, aborting.\n",optarg);
+        print_usage_message();
+        return 0;
+      }
+      break;
     case 'q': q=atoi(optarg);break;
+    case 'Q':
+      quality=atoi(optarg);
+      if (quality < 1 || quality > 100) {
+        printf("ERROR: Invalid quality %s, aborting.\n",optarg);
+        print_usage_message();
+        return 0;
+      }
+      break;
+    case 'M': tables_file = optarg;break;
+    case 'Z': lossless = 1;break;
+    case 'L':
+      levels = parse_ladder(optarg,qualities);
+      if (levels == 0) {
+        printf("ERROR: Invalid quality ladder %s, aborting.\n",optarg);
+        print_usage_message();
+        return 0;
+      }
+      break;
     case 'i': input_file = optarg;break;
     case 'o': output_file = optarg;break;
     case 'D': debug_file = optarg;break;
@@ -1434,20 +3793,92 @@ int main (int argc, char **args)
     }
   }
 
-  /* reset quantisation matrix */
-  if (q>0) {
-    for (i=0;i<8;i++)
-      for (j=0;j<8;j++)
-        w[i][j]=q;
+  /* quantisation matrices: uniform with -q; otherwise the default matrix
+     for all channels, or separate luma and chroma matrices from --tables
+     or the default pair, scaled with the quality of -Q */
+  if (q > 0 && (quality > 0 || tables_file != 0 || levels > 0)) {
+    printf("ERROR: -q cannot be combined with -Q, --tables or --ladder, "
+           "aborting.\n");
+    print_usage_message();
+    return 0;
+  }
+  if (quality > 0 && levels > 0) {
+    printf("ERROR: -Q cannot be combined with --ladder, aborting.\n");
+    print_usage_message();
+    return 0;
+  }
+  for (i=0;i<64;i++) {
+    weights[i] = (q>0) ? q : default_weights[i];
+    chroma[i] = weights[i];
+  }
+  if (tables_file != 0) {
+    if (read_weights(tables_file,weights,chroma) == 0) return 1;
+  } else if (quality > 0 || levels > 0) {
+    memcpy(chroma,default_chroma_weights,sizeof(chroma));
+  }
+  if (quality > 0) {
+    scale_weights(weights,quality,weights);
+    scale_weights(chroma,quality,chroma);
+  }
+
+  /* lossless coding: samples are predicted instead of transformed and
+     quantised, chroma is kept at full resolution */
+  if (lossless) {
+    if (q > 0 || quality > 0 || tables_file != 0 || levels > 0 ||
+        used['b'] > 0 || sx > 1 || sy > 1) {
+      printf("ERROR: --lossless cannot be combined with -q, -Q, --tables, "
+             "--ladder, -b or chroma subsampling, aborting.\n");
+      print_usage_message();
+      return 0;
+    }
+    image.block_size = BLOCKSIZE_LOSSLESS;
+    sx = sy = image.sx = image.sy = 1;
+  }
+
+  if (sx==0) sx = image.sx;
+  if (sy==0) sy = image.sy;
+
+  /* batch mode: encode all images of the manifest with a pool of threads */
+  if (batch_file != 0) {
+    if (trace_file != 0) {
+      trace_start();
+    }
+    len = run_batch(batch_file,sx,sy,image.block_size,restart,weights,
+                    chroma);
+    stats_print(stdout);
+    if (trace_file != 0) {
+      trace_write(trace_file);
+      printf("Trace written to %s\n",trace_file);
+    }
+    return (len > 0);
   }
 
-  if (s==0) s = image.s;
-  
   if (output_file == 0 || input_file == 0) {
     printf("ERROR: Missing mandatory parameter, aborting.\n");
     print_usage_message();
     return 0;
   }
+  if (levels > 0 && (!strcmp(input_file,"-") || !strcmp(output_file,"-"))) {
+    printf("ERROR: --ladder needs an input and an output file, aborting.\n");
+    print_usage_message();
+    return 0;
+  }
+
+  /* ladder mode: one transform, one container per quality */
+  if (levels > 0) {
+    if (trace_file != 0) {
+      trace_start();
+    }
+    len = run_ladder(input_file,output_file,sx,sy,image.block_size,restart,
+                     weights,chroma,qualities,levels);
+    stats_print(stdout);
+    if (trace_file != 0) {
+      trace_write(trace_file);
+      printf("Trace written to %s\n",trace_file);
+    }
+    free_quant_tables();
+    return (len > 0);
+  }
 
   /* prepare file names */
   sprintf(total_file,"%s.coded",output_file);
@@ -1464,17 +3895,36 @@ int main (int argc, char **args)
     sprintf(program_call, "%s%s ",program_call,args[i]);
   }
 
+  /* with -o - the compressed or decoded image goes to standard output and
+     all messages to standard error; unless stdout is a terminal the banner
+     is still in its buffer and follows the messages. Errors then exit with
+     status 1, so that the next command of the pipeline sees them */
+  if (!strcmp(output_file,"-")) {
+    data_out = fdopen(dup(STDOUT_FILENO),"wb");
+    if (data_out == NULL || dup2(STDERR_FILENO,STDOUT_FILENO) < 0) {
+      printf("ERROR: Could not redirect messages to standard error, "
+             "aborting.\n");
+      return 1;
+    }
+  }
+
+  if (trace_file != 0) {
+    trace_start();
+  }
+
   /* DETERMINE COMPRESSION/DECOMPRESSION MODE**********************************/
 
-  /* try to identify the file format via the extension */
-  strcpy(extension, input_file+(strlen(input_file)-4));
-  if      (!strcmp(extension, ".pgm")) format = FORMAT_PGM;
-  else if (!strcmp(extension, ".ppm")) format = FORMAT_PPM;
-  else {
-    printf("ERROR: Extension %s not supported for input file, aborting.\n",
-           extension);
+  /* load the input file, or standard input with -i -, in one piece without
+     seeking and identify the file format by its magic bytes */
+  time_start = get_wall_time();
+  stats_start(&timer);
+  data = load_file(input_file,&size);
+  format = sniff_format(data,size);
+  if (format < 0) {
+    printf("ERROR: %s is neither a pgm/ppm image nor a compressed image, "
+           "aborting.\n",input_file);
     print_usage_message();
-    return 0;
+    return (data_out != 0);
   }
 
   /* determine if we are in compression or decompression mode */
@@ -1483,26 +3933,32 @@ int main (int argc, char **args)
   } else {
     flag_compress = 0;
   }
-  
+
   if (flag_compress == 1) {
     /* COMPRESS ***************************************************************/
 
-    /* read input image */
-    if (format==FORMAT_PPM) {
-      read_ppm_and_allocate_memory(input_file,&image.nx,&image.ny,
-                                   &image.orig_rgb);
-      image.nc = 3;
-      printf("Image %s loaded (PPM).\n\n",input_file);
-    } else if (format==FORMAT_PGM) {
-      read_pgm_header(input_file,&image.nx,&image.ny);
+    /* parse input image: header first to allocate the channels */
+    nc = read_pnm_buffer(data,size,&image.nx,&image.ny,&image.maxval,0,0,0);
+    if (nc == 0) {
       alloc_long_cubix(&image.orig_rgb,MAXCHANNELS,image.nx+2,image.ny+2);
-      read_pgm_and_allocate_memory(input_file,&image.nx,&image.ny,
-                                   &image.orig_rgb[0]);
-      image.nc = 1;
-      printf("Image %s loaded (PGM).\n\n",input_file);
+      nc = read_pnm_buffer(data,size,&image.nx,&image.ny,&image.maxval,
+                           image.orig_rgb,image.nx,image.ny);
+    }
+    if (nc < 0) {
+      printf("ERROR: Could not read image %s, aborting.\n",input_file);
+      return (data_out != 0);
+    }
+    free(data);
+    image.nc = nc;
+    printf("Image %s loaded (%s",input_file,(nc > 1) ? "PPM" : "PGM");
+    if (image.maxval > MAXGREYVALUE) {
+      printf(", %ld bit samples",bit_length(image.maxval));
     }
-    nx[0] = image.nx; ny[0] = image.ny; nc = image.nc;
-    image.size_orig=get_size_of_file(input_file);
+    printf(").\n\n");
+    nx[0] = image.nx; ny[0] = image.ny;
+    image.size_orig=size;
+    stats_stop(STAGE_LOAD,&timer,image.size_orig,nx[0]*ny[0]*nc*sizeof(long),
+               0,0);
 
     printf("Image dimensions: %ld x %ld x %ld\n",nx[0],ny[0],nc);
 
@@ -1510,35 +3966,12 @@ int main (int argc, char **args)
     alloc_image(&image,nx[0],ny[0]);
     alloc_long_matrix(&tmp_img,image.nx_ext[0]+2,image.ny_ext[0]+2);
 
-    /* convert to YCbCr space or copy over grey value image */
+    /* colour conversion, chroma subsampling and extension of all channels
+       to multiples of the block size */
+    prepare_channels(&image,nx,ny,sx,sy);
     if (nc > 1) {
-      RGB_to_YCbCr(image.orig_rgb,image.orig_ycbcr,nx[0],ny[0]);
-    } else {
-      copy_matrix_long(image.orig_rgb[0],image.orig_ycbcr[0],nx[0],ny[0]);
-    }
-    
-    /* perform chroma subsampling */
-    if (nc > 1) {
-      nx[1]=nx[2]=nx[0]/s;
-      ny[1]=ny[2]=ny[0]/s;    
-      if ((nx[0] % s) > 0) {nx[1]++;nx[2]++;}
-      if ((ny[0] % s) > 0) {ny[1]++;ny[2]++;}
-      if (s > 1) {
-        subsample(image.orig_ycbcr[1],image.rec_quant[0],nx[0],ny[0],s);
-        copy_matrix_long(image.rec_quant[0],image.orig_ycbcr[1],image.nx_ext[1],
-                         image.ny_ext[1]);
-        subsample(image.orig_ycbcr[2],image.rec_quant[0],nx[0],ny[0],s);
-        copy_matrix_long(image.rec_quant[0],image.orig_ycbcr[2],image.nx_ext[1],
-                         image.ny_ext[1]);
-      }
-      printf("Chroma subsampling by factor %ld (%ld x %ld -> %ld x %ld)\n",
-             s,nx[0],ny[0],nx[1],ny[1]);
-    }
-    
-    /* extend image dimensions to multiples of block_size */
-    for (i=0; i<nc; i++) {
-      extend_image(image.orig_ycbcr[i],nx[i],ny[i],image.block_size,
-                   image.orig_ycbcr[i]);
+      printf("Chroma subsampling by factors %ldx%ld (%ld x %ld -> %ld x %ld)\n",
+             sx,sy,nx[0],ny[0],nx[1],ny[1]);
     }
 
     /* open debug file if debug mode is active */
@@ -1546,75 +3979,101 @@ int main (int argc, char **args)
       dfile = fopen(debug_file,"w");
     }
 
-    /* prepare files for encoding */
-    printf("Computing DCT and quantising coefficients\n");
-    sprintf(tmp_file,"%s.wnc",output_file);
-    binary_file = bfopen(tmp_file,"w");
-
-    /* apply block DCT and encode */
-    for (i=0; i<nc; i++) {
-      block_DCT(image.orig_ycbcr[i],image.nx_ext[i],image.ny_ext[i],
-                image.block_size,image.dct[i]);
-      block_quantise(image.dct[i],image.nx_ext[i],image.ny_ext[i],0,
-                     image.dct_quant[i]);
-      block_encode(image.dct_quant[i],image.nx_ext[i],image.ny_ext[i],
-                   dfile,binary_file);          
+    /* apply block DCT and encode all slices */
+    init_wnc_header(&header);
+    if (lossless) {
+      printf("Predicting and coding samples losslessly\n");
+      encode_lossless(&image,nx,ny,restart,0,dfile,&header,streams,
+                      capacity);
+    } else {
+      printf("Computing DCT and quantising coefficients\n");
+      qt[0] = get_quant_table(weights,image.block_size);
+      qt[1] = get_quant_table(chroma,image.block_size);
+      encode_channels(&image,nx,ny,sx,sy,restart,qt,0,dfile,&header,
+                      streams,capacity);
     }
 
-    /* close binary file */
-    bfclose(binary_file);
+    /* write container */
+    sprintf(tmp_file,"%s.wnc",output_file);
+    stats_start(&timer);
+    if (data_out != 0) {
+      size = write_compressed_stream(data_out,&header,streams);
+    } else {
+      size = write_compressed_file(tmp_file,&header,streams);
+    }
+    if (size < 0) exit(1);
+    stats_stop(STAGE_WRITE,&timer,0,size,0,0);
+    printf("Encoding time: %f s\n",get_wall_time()-time_start);
+    printf("Container header and slice index: %ld bytes (%ld slices)\n",
+           wnc_header_size(&header),header.slices[0]+header.slices[1]+
+           header.slices[2]);
+    free_slice_streams(streams,capacity);
+    free_wnc_header(&header);
 
     /* output image information */
-    printf("Resulting compression ratio: %f:1\n\n", 
-           get_compression_ratio(input_file,tmp_file));
-    
-    /* write image data */
+    printf("Resulting compression ratio: %f:1\n\n",
+           (double)image.size_orig/(double)size);
+
+    /* write image data; with -o - there is no prefix for further files */
     write_comment_string(&image,0,comments);
-    for (i=0; i<nc; i++) {
+    for (i=0; i<nc && !lossless && data_out == 0; i++) {
       sprintf(tmp_file,"%s_dct_channel%ld.pgm",output_file,i);
       abs_img(image.dct_quant[i],nx[i],ny[i],tmp_img);
       normalise_to_8bit(tmp_img,nx[i],ny[i],tmp_img);
-      write_pgm(tmp_img, nx[i], ny[i],tmp_file, comments);
+      write_pgm(tmp_img, nx[i], ny[i], MAXGREYVALUE, tmp_file, comments);
     }
 
-    /* reconstruct */
-    printf("Requantising and compute inverse DCT\n");
-    for (i=0; i<nc; i++) {
-      block_requantise(image.dct_quant[i],image.nx_ext[i],image.ny_ext[i],0,
-                     image.dct_quant[i]);
-      block_IDCT(image.dct_quant[i],image.nx_ext[i],image.ny_ext[i],
-                 image.block_size,image.rec[i]);
-      convert_matrix_int(image.rec[i],image.rec_quant[i],
-                        image.nx_ext[i],image.ny_ext[i]);
-    }
+    /* reconstruct; lossless coding reproduces the original */
+    if (lossless) {
+      for (i=0; i<nc; i++)
+        copy_matrix_long(image.orig_rgb[i],image.rec_quant[i],nx[0],ny[0]);
+    } else {
+      printf("Requantising and compute inverse DCT\n");
+      for (i=0; i<nc; i++) {
+        len = image.nx_ext[i]*image.ny_ext[i];
+        stats_start(&timer);
+        block_requantise(image.dct_quant[i],image.nx_ext[i],image.ny_ext[i],
+                         qt[i > 0],0,image.dct_quant[i]);
+        block_IDCT(image.dct_quant[i],image.nx_ext[i],image.ny_ext[i],
+                   image.block_size,image.rec[i]);
+        convert_matrix_int(image.rec[i],image.rec_quant[i],
+                          image.nx_ext[i],image.ny_ext[i]);
+        stats_stop(STAGE_RECONSTRUCT,&timer,len*sizeof(long),len*sizeof(long),
+                   len/(image.block_size*image.block_size),0);
+      }
 
-    /* perform upsampling if downsampling was applied before */
-    if (s>1 && nc > 1) {
-      upsample(image.rec_quant[1],tmp_img,nx[0],ny[0],s);
-      copy_matrix_long(tmp_img,image.rec_quant[1],nx[0],ny[0]);
-      upsample(image.rec_quant[2],tmp_img,nx[0],ny[0],s);
-      copy_matrix_long(tmp_img,image.rec_quant[2],nx[0],ny[0]);
+      /* perform upsampling if downsampling was applied before */
+      if ((sx>1 || sy>1) && nc > 1) {
+        upsample(image.rec_quant[1],tmp_img,nx[0],ny[0],sx,sy);
+        copy_matrix_long(tmp_img,image.rec_quant[1],nx[0],ny[0]);
+        upsample(image.rec_quant[2],tmp_img,nx[0],ny[0],sx,sy);
+        copy_matrix_long(tmp_img,image.rec_quant[2],nx[0],ny[0]);
 
-      printf("Chroma upsampling by factor %ld (%ld x %ld -> %ld x %ld)\n",
-             s,nx[1],ny[1],nx[0],ny[0]);
-    }
+        printf("Chroma upsampling by factors %ldx%ld "
+               "(%ld x %ld -> %ld x %ld)\n",sx,sy,nx[1],ny[1],nx[0],ny[0]);
+      }
 
-    /* convert back from YCbCr to RGB */
-    if (nc>1) {
-      YCbCr_to_RGB(image.rec_quant,image.rec_quant,image.nx_ext[0],
-                   image.ny_ext[0]);
+      /* convert back from YCbCr to RGB */
+      if (nc>1) {
+        YCbCr_to_RGB(image.rec_quant,image.rec_quant,image.nx_ext[0],
+                     image.ny_ext[0]);
+      }
     }
 
     printf("Resulting MSE: %f\n",mse(image.orig_rgb,image.rec_quant,nx[0],ny[0],
                                      nc));
 
     /* write reconstruction */
-    if (format==FORMAT_PPM) {
+    if (data_out != 0) {
+      printf("Compressed image written to standard output\n");
+    } else if (format==FORMAT_PPM) {
       sprintf(tmp_file,"%s_rec.ppm",output_file);
-      write_ppm(image.rec_quant, nx[0], ny[0], tmp_file, comments);
+      write_ppm(image.rec_quant, nx[0], ny[0], image.maxval, tmp_file,
+                comments);
     } else {
       sprintf(tmp_file,"%s_rec.pgm",output_file);
-      write_pgm(image.rec_quant[0], nx[0], ny[0], tmp_file, comments);
+      write_pgm(image.rec_quant[0], nx[0], ny[0], image.maxval, tmp_file,
+                comments);
     }
     
     if (debug_file !=0) {
@@ -1624,13 +4083,183 @@ int main (int argc, char **args)
   } else {
     /* DECOMPRESS *************************************************************/
 
+    /* read header with slice index of the compressed file */
+    if (read_wnc_header(data,size,&header) != 0) {
+      printf("ERROR: %s is not a valid compressed image, aborting.\n",
+             input_file);
+      return (data_out != 0);
+    }
+    stats_stop(STAGE_LOAD,&timer,size,0,0,0);
+
+    /* read image information */
+    sx = image.sx = header.sx;
+    sy = image.sy = header.sy;
+    N = image.block_size = header.block_size;
+    image.maxval = header.maxval;
+    nx[0] = image.nx = header.nx;
+    ny[0] = image.ny = header.ny;
+    nc = image.nc = header.nc;
+    nx[1]=nx[2]=nx[0]/sx;
+    ny[1]=ny[2]=ny[0]/sy;
+    if ((nx[0] % sx) > 0) {nx[1]++;nx[2]++;}
+    if ((ny[0] % sy) > 0) {ny[1]++;ny[2]++;}
+    printf("Image dimensions: %ld x %ld x %ld\n",nx[0],ny[0],nc);
+
+    /* size of all channels at the decoding scale scale/8 */
+    for (i=0; i<nc; i++) {
+      snx[i] = (nx[i]*scale+7)/8;
+      sny[i] = (ny[i]*scale+7)/8;
+    }
+    if (N == BLOCKSIZE_LOSSLESS && scale < 8) {
+      printf("ERROR: Losslessly coded images cannot be decoded at reduced "
+             "size, aborting.\n");
+      return (data_out != 0);
+    }
+    if (scale < 8) {
+      printf("Decoding at scale %ld/8: %ld x %ld\n",scale,snx[0],sny[0]);
+    }
+    K = scale*N/8;
+    if (K < 1) {
+      printf("ERROR: Decoding scale %ld/8 needs blocks of at least %ld x %ld, "
+             "aborting.\n",scale,8/scale,8/scale);
+      return (data_out != 0);
+    }
+
+    /* blocks of every channel that overlap the region of interest */
+    if (crop) {
+      if (scale < 8) {
+        printf("ERROR: --crop and --scale cannot be combined, aborting.\n");
+        return (data_out != 0);
+      }
+      if (roi_x+roi_w > nx[0] || roi_y+roi_h > ny[0]) {
+        printf("ERROR: Region exceeds image of size %ld x %ld, aborting.\n",
+               nx[0],ny[0]);
+        return (data_out != 0);
+      }
+      printf("Decoding region %ld x %ld at %ld,%ld\n",roi_w,roi_h,roi_x,
+             roi_y);
+    } else {
+      roi_x = roi_y = 0;
+      roi_w = nx[0]; roi_h = ny[0];
+    }
+    for (i=0; i<nc; i++) {
+      first_col[i] = (i == 0) ? roi_x/N : roi_x/sx/N;
+      last_col[i]  = (i == 0) ? (roi_x+roi_w-1)/N : (roi_x+roi_w-1)/sx/N;
+      first_row[i] = (i == 0) ? roi_y/N : roi_y/sy/N;
+      last_row[i]  = (i == 0) ? (roi_y+roi_h-1)/N : (roi_y+roi_h-1)/sy/N;
+    }
+
+    /* only the integer reconstruction is needed for decoding */
+    set_image_dimensions(&image);
+    alloc_long_cubix(&image.rec_quant,MAXCHANNELS,image.nx_ext[0]+2,
+                     image.ny_ext[0]+2);
+    alloc_long_matrix(&tmp_img,image.nx_ext[0]+2,image.ny_ext[0]+2);
+
+    /* decode symbols with adaptive arithmetic coding, then rebuild the
+       coefficients with the category offsets and invert the block DCT;
+       all slices are independent and located by the index, so slices
+       outside of the region of interest are skipped entirely */
+    slices = 0;
+    for (i=0; i<nc; i++) slices += header.slices[i];
+    alloc_long_vector(&slice_c,slices+1);
+    alloc_long_vector(&slice_i,slices+1);
+    len = slices;
+    slices = 0;
+    for (i=0; i<nc; i++)
+      for (j=0; j<header.slices[i]; j++) {
+        slice = &header.slice[i][j];
+        if (slice->first_row > last_row[i] ||
+            slice->first_row+slice->rows <= first_row[i]) continue;
+        slice_c[slices] = i;
+        slice_i[slices] = j;
+        slices++;
+      }
+    if (crop) {
+      printf("Decoding %ld of %ld slices\n",slices,len);
+    }
+    qt[0] = get_quant_table(header.quant[0],N);
+    qt[1] = get_quant_table(header.quant[header.tables-1],N);
+    #pragma omp parallel for schedule(dynamic)
+    for (j=0; j<slices; j++) {
+      decode_slice(data,&header,qt[slice_c[j] > 0],slice_c[j],slice_i[j],
+                   image.nx_ext[slice_c[j]],image.ny_ext[slice_c[j]],
+                   first_col[slice_c[j]],last_col[slice_c[j]],K,
+                   image.rec_quant[slice_c[j]]);
+    }
+    slices = len;
+    disalloc_long_vector(slice_c,slices+1);
+    disalloc_long_vector(slice_i,slices+1);
+    free(data);
+    free_wnc_header(&header);
+
+    write_comment_string(&image,0,comments);
+    if (crop) {
+      /* region of interest: chroma is upsampled on the fly */
+      alloc_long_cubix(&crop_img,MAXCHANNELS,roi_w+2,roi_h+2);
+      stats_start(&timer);
+      crop_region(image.rec_quant,crop_img,nc,roi_x,roi_y,roi_w,roi_h,sx,sy);
+      stats_stop(STAGE_SUBSAMPLE,&timer,0,roi_w*roi_h*nc*sizeof(long),0,0);
+      stats_start(&timer);
+      if (nc>1) {
+        YCbCr_to_RGB(crop_img,crop_img,roi_w,roi_h);
+        stats_stop(STAGE_COLOUR,&timer,roi_w*roi_h*nc*sizeof(long),
+                   roi_w*roi_h*nc*sizeof(long),0,0);
+      }
+      stats_start(&timer);
+      size = write_decoded_image(crop_img,roi_w,roi_h,nc,image.maxval,
+                                 output_file,data_out,comments,tmp_file);
+      if (size < 0) exit(1);
+      stats_stop(STAGE_WRITE,&timer,0,size,0,0);
+      disalloc_long_cubix(crop_img,MAXCHANNELS,roi_w+2,roi_h+2);
+    } else {
+      /* perform upsampling if downsampling was applied before */
+      if ((sx>1 || sy>1) && nc > 1) {
+        stats_start(&timer);
+        upsample(image.rec_quant[1],tmp_img,snx[0],sny[0],sx,sy);
+        copy_matrix_long(tmp_img,image.rec_quant[1],snx[0],sny[0]);
+        upsample(image.rec_quant[2],tmp_img,snx[0],sny[0],sx,sy);
+        copy_matrix_long(tmp_img,image.rec_quant[2],snx[0],sny[0]);
+        stats_stop(STAGE_SUBSAMPLE,&timer,0,2*snx[0]*sny[0]*sizeof(long),
+                   0,0);
+      }
+
+      /* convert back from YCbCr to RGB */
+      if (nc>1) {
+        stats_start(&timer);
+        YCbCr_to_RGB(image.rec_quant,image.rec_quant,snx[0],sny[0]);
+        stats_stop(STAGE_COLOUR,&timer,snx[0]*sny[0]*nc*sizeof(long),
+                   snx[0]*sny[0]*nc*sizeof(long),0,0);
+      }
+
+      /* write decoded image */
+      stats_start(&timer);
+      size = write_decoded_image(image.rec_quant,snx[0],sny[0],nc,
+                                 image.maxval,output_file,data_out,comments,
+                                 tmp_file);
+      if (size < 0) exit(1);
+      stats_stop(STAGE_WRITE,&timer,0,size,0,0);
+    }
+    printf("Decoded image written to %s\n",tmp_file);
+    printf("Decoding time: %f s\n",get_wall_time()-time_start);
   }
   
+  stats_print(stdout);
+  if (trace_file != 0) {
+    trace_write(trace_file);
+    printf("Trace written to %s\n",trace_file);
+  }
+
+  if (data_out != 0) {
+    fclose(data_out);
+  }
+
   /* ---- free memory  ---- */
   disalloc_long_matrix(tmp_img,image.nx_ext[0]+2,image.ny_ext[0]+2);
   destroy_image(&image);
   free(program_call);
+  free_quant_tables();
 
   return(0);
 }
 
+#endif /* JPEG_LIGHT_NO_MAIN */
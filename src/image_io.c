@@ -7,14 +7,226 @@
 
 /*--------------------------------------------------------------------------*/
 
+static long read_maxval
+(const char  *row,         /* header line with the maximum value */
+ const char  *file_name)   /* name of file, for error messages */
+
+/*
+  parses the maximum sample value of a pgm or ppm header; aborts if it is
+  not in 1,...,MAXSAMPLEVALUE
+*/
+
+{
+  long maxval;
+
+  if (sscanf (row, "%ld", &maxval) != 1 || maxval < 1 ||
+      maxval > MAXSAMPLEVALUE)
+    {
+      printf ("invalid maximum value in file '%s', aborting.\n", file_name);
+      exit (1);
+    }
+
+  return maxval;
+
+} /* read_maxval */
+
+/*--------------------------------------------------------------------------*/
+
+static long parse_pnm_number
+(const unsigned char  *data,   /* pgm or ppm file in memory */
+ long                  size,   /* size of data */
+ long                 *pos)    /* current position, updated */
+
+/*
+  skips white space and comments from '#' to the end of the line and
+  parses the next decimal number of a pgm or ppm header; returns -1 if
+  there is none
+*/
+
+{
+  long   value;     /* parsed number */
+
+  while (*pos < size &&
+         (data[*pos] == '#' || strchr (" \t\r\n\v\f", data[*pos]) != NULL))
+    if (data[(*pos)++] == '#')
+      while (*pos < size && data[*pos] != '\n')
+        (*pos)++;
+  if (*pos >= size || data[*pos] < '0' || data[*pos] > '9')
+    return -1;
+  value = 0;
+  while (*pos < size && data[*pos] >= '0' && data[*pos] <= '9' &&
+         value <= MAXSAMPLEVALUE * 1000L)
+    value = 10 * value + (data[(*pos)++] - '0');
+
+  return value;
+
+} /* parse_pnm_number */
+
+/*--------------------------------------------------------------------------*/
+
+static long parse_pnm_header
+(const unsigned char  *data,   /* beginning of a pgm or ppm file */
+ long                  size,   /* size of data */
+ long                 *nx,     /* image size in x direction, output */
+ long                 *ny,     /* image size in y direction, output */
+ long                 *maxval, /* maximum sample value, output */
+ long                 *pos)    /* position of the first sample, output */
+
+/*
+  parses the header of a greyscale (P5) or colour (P6) image, with any
+  white space and comments between its numbers; returns the number of
+  channels, 0 if data ends within the header, -1 if the data is no pgm
+  or ppm file and -2 if the header is invalid
+*/
+
+{
+  long   nc;        /* number of channels */
+
+  if (size < 2)
+    return (size == 1 && data[0] != 'P') ? -1 : 0;
+  if (data[0] != 'P' || (data[1] != '5' && data[1] != '6'))
+    return -1;
+  nc = (data[1] == '6') ? 3 : 1;
+  *pos = 2;
+  *nx = parse_pnm_number (data, size, pos);
+  *ny = parse_pnm_number (data, size, pos);
+  *maxval = parse_pnm_number (data, size, pos);
+  if (*pos >= size)
+    return 0;
+  if (*nx < 1 || *ny < 1 || *maxval < 1 || *maxval > MAXSAMPLEVALUE)
+    return -2;
+  (*pos)++;                          /* single white space before samples */
+
+  return nc;
+
+} /* parse_pnm_header */
+
+/*--------------------------------------------------------------------------*/
+
+static void unpack_row
+(const unsigned char  *buf,     /* nc*nx samples of row j */
+ long                  nx,      /* image size in x direction */
+ long                  j,       /* row */
+ long                  nc,      /* number of channels */
+ long                  maxval,  /* maximum sample value */
+ long               ***u)       /* channels, row j is output */
+
+/*
+  unpacks row j of an image with nc interleaved channels, one byte per
+  sample for maxval < 256 and two bytes (big endian) otherwise, in a loop
+  per sample size; samples above maxval are clipped to maxval, since the
+  coders size their alphabets from it
+*/
+
+{
+  long   i, m;      /* loop variables */
+  long   c;         /* sample */
+
+  if (maxval < 256)
+    for (i=1; i<=nx; i++)
+      for (m=0; m<nc; m++)
+        {
+          c = (long) buf[nc*(i-1)+m];
+          u[m][i][j] = (c > maxval) ? maxval : c;
+        }
+  else
+    for (i=1; i<=nx; i++)
+      for (m=0; m<nc; m++)
+        {
+          c = ((long) buf[2*(nc*(i-1)+m)] << 8) |
+              (long) buf[2*(nc*(i-1)+m)+1];
+          u[m][i][j] = (c > maxval) ? maxval : c;
+        }
+
+  return;
+
+} /* unpack_row */
+
+/*--------------------------------------------------------------------------*/
+
+static void read_row
+(FILE           *inimage,  /* input file */
+ unsigned char  *buf,      /* buffer of 2*nc*nx bytes */
+ long            nx,       /* image size in x direction */
+ long            j,        /* row */
+ long            nc,       /* number of channels */
+ long            maxval,   /* maximum sample value */
+ long         ***u)        /* channels, row j is output */
+
+/*
+  reads row j of an image with nc interleaved channels with one call;
+  samples missing in a truncated file are 0
+*/
+
+{
+  long   bps;       /* bytes per sample */
+  long   k;         /* samples read */
+
+  bps = (maxval > 255) ? 2 : 1;
+  k = (long) fread (buf, bps, nc * nx, inimage);
+  memset (buf + k * bps, 0, (nc * nx - k) * bps);
+  unpack_row (buf, nx, j, nc, maxval, u);
+
+  return;
+
+} /* read_row */
+
+/*--------------------------------------------------------------------------*/
+
+static void write_row
+(FILE           *outimage, /* output file */
+ unsigned char  *buf,      /* buffer of 2*nc*nx bytes */
+ long            nx,       /* image size in x direction */
+ long            j,        /* row */
+ long            nc,       /* number of channels */
+ long            maxval,   /* maximum sample value */
+ long         ***u)        /* channels, unchanged */
+
+/*
+  writes row j of nc channels interleaved, clipped to 0,...,maxval, with
+  one byte per sample for maxval < 256 and two bytes (big endian)
+  otherwise, with one call
+*/
+
+{
+  long   bps;       /* bytes per sample */
+  long   i, m, l;   /* loop variables, index in row */
+  long   c;         /* clipped sample */
+
+  bps = (maxval > 255) ? 2 : 1;
+  for (i=1; i<=nx; i++)
+    for (m=0; m<nc; m++)
+      {
+        c = u[m][i][j];
+        c = (c < 0) ? 0 : (c > maxval) ? maxval : c;
+        l = nc*(i-1)+m;
+        if (bps == 1)
+          buf[l] = (unsigned char) c;
+        else
+          {
+            buf[2*l] = (unsigned char) (c >> 8);
+            buf[2*l+1] = (unsigned char) (c & 255);
+          }
+      }
+  fwrite (buf, bps, nc * nx, outimage);
+
+  return;
+
+} /* write_row */
+
+/*--------------------------------------------------------------------------*/
+
 void read_pgm_and_allocate_memory
 (const char  *file_name,   /* name of pgm file */
  long        *nx,          /* image size in x direction, output */
  long        *ny,          /* image size in y direction, output */
+ long        *maxval,      /* maximum grey value, output */
  long        ***u)         /* image, output */
 
 /*
-  reads a greyscale image that has been encoded in pgm format P5;
+  reads a greyscale image that has been encoded in pgm format P5, with one
+  byte per sample for maxval < 256 and two bytes (big endian) otherwise;
+  samples above maxval are clipped to maxval;
   allocates memory for the image u;
   adds boundary layers of size 1 such that
   - the relevant image pixels in x direction use the indices 1,...,nx
@@ -24,7 +236,8 @@ void read_pgm_and_allocate_memory
 {
   FILE   *inimage;    /* input file */
   char   row[80];     /* for reading data */
-  long   i, j;        /* loop variables */
+  char   *buf;        /* bytes of one image row */
+  long   j;           /* loop variable */
 
   /* open file */
   inimage = fopen (file_name, "rb");
@@ -41,15 +254,17 @@ void read_pgm_and_allocate_memory
     fgets (row, 80, inimage);
   sscanf (row, "%ld %ld", nx, ny);   /* read image size */
   fgets (row, 80, inimage);          /* read maximum grey value */
+  *maxval = read_maxval (row, file_name);
 
   /* allocate memory if necessary */
   if (*u==0)
     alloc_long_matrix (u, (*nx)+2, (*ny)+2);
 
   /* read image data row by row */
+  alloc_string (&buf, 2 * (*nx));
   for (j=1; j<=(*ny); j++)
-    for (i=1; i<=(*nx); i++)
-      (*u)[i][j] = (long) getc(inimage);
+    read_row (inimage, (unsigned char *) buf, *nx, j, 1, *maxval, u);
+  disalloc_string (buf, 2 * (*nx));
 
   /* close file */
   fclose(inimage);
@@ -103,10 +318,13 @@ void read_ppm_and_allocate_memory
 (const char  *file_name,    /* name of pgm file */
  long        *nx,           /* image size in x direction, output */
  long        *ny,           /* image size in y direction, output */
+ long        *maxval,       /* maximum sample value, output */
  long       ****u)          /* image, output */
 
 /*
-  reads a colour image that has been encoded in pgm format P6;
+  reads a colour image that has been encoded in pgm format P6, with one
+  byte per sample for maxval < 256 and two bytes (big endian) otherwise;
+  samples above maxval are clipped to maxval;
   allocates memory for the image u;
   adds boundary layers of size 1 such that
   - the relevant image pixels in x direction use the indices 1,...,nx
@@ -116,7 +334,8 @@ void read_ppm_and_allocate_memory
 {
   FILE   *inimage;    /* input file */
   char   row[80];     /* for reading data */
-  long   i, j, m;     /* loop variables */
+  char   *buf;        /* bytes of one image row */
+  long   j;           /* loop variable */
 
   /* open file */
   inimage = fopen (file_name, "rb");
@@ -133,16 +352,17 @@ void read_ppm_and_allocate_memory
     fgets (row, 80, inimage);
   sscanf (row, "%ld %ld", nx, ny);   /* read image size */
   fgets (row, 80, inimage);          /* read maximum grey value */
+  *maxval = read_maxval (row, file_name);
 
   /* allocate memory */
   if (*u==0)
     alloc_long_cubix (u, 3, (*nx)+2, (*ny)+2);
 
   /* read image data row by row */
+  alloc_string (&buf, 6 * (*nx));
   for (j=1; j<=(*ny); j++)
-    for (i=1; i<=(*nx); i++)
-      for (m=0; m<3; m++)
-        (*u)[m][i][j] = (long) getc(inimage);
+    read_row (inimage, (unsigned char *) buf, *nx, j, 3, *maxval, *u);
+  disalloc_string (buf, 6 * (*nx));
 
   /* close file */
   fclose(inimage);
@@ -153,6 +373,179 @@ void read_ppm_and_allocate_memory
 
 /*--------------------------------------------------------------------------*/
 
+long read_pnm
+
+(const char  *file_name,    /* name of pgm or ppm file */
+ long        *nx,           /* image size in x direction, output */
+ long        *ny,           /* image size in y direction, output */
+ long        *maxval,       /* maximum sample value, output */
+ long        ***u,          /* preallocated channels, output */
+ long         max_nx,       /* allocated size of channels in x direction */
+ long         max_ny)       /* allocated size of channels in y direction */
+
+/*
+  reads a greyscale (P5) or colour (P6) image with 8 or 16 bit samples into
+  the channels u[0] resp. u[0],u[1],u[2] without allocating any memory,
+  with the same boundary layers and clipping to maxval as
+  read_pgm_and_allocate_memory; returns the number of channels, 0 if the
+  image is larger than max_nx x max_ny (nx and ny are set, so that the
+  caller can grow the channels and read again) and -1 if the file cannot
+  be read; in contrast to the other readers, errors do not abort the
+  program, and the header is parsed as by read_pnm_buffer
+*/
+
+{
+  FILE           *inimage;    /* input file */
+  unsigned char  *header;     /* beginning of file with the header */
+  unsigned char   buf[4096];  /* for reading image data in chunks */
+  long            size;       /* bytes of file in header */
+  long            capacity;   /* allocated size of header */
+  long            pos;        /* position of first sample */
+  long            nc;         /* number of channels */
+  long            bps;        /* bytes per sample */
+  long            n, k, l;    /* values in file, in chunk, index in chunk */
+  long            i, j, m;    /* pixel position and channel */
+
+  /* open file */
+  inimage = fopen (file_name, "rb");
+  if (NULL == inimage)
+    {
+      printf ("could not open file '%s' for reading.\n", file_name);
+      return -1;
+    }
+
+  /* read header with the parser of read_pnm_buffer, from a beginning of
+     the file that grows until it contains the whole header */
+  header = NULL;
+  size = capacity = 0;
+  do
+    {
+      capacity = (capacity > 0) ? 2 * capacity : 4096;
+      header = (unsigned char *) realloc (header, capacity);
+      if (header == NULL)
+        {
+          printf ("read_pnm: not enough memory available\n");
+          exit (1);
+        }
+      k = (long) fread (header + size, 1, capacity - size, inimage);
+      size += k;
+      nc = parse_pnm_header (header, size, nx, ny, maxval, &pos);
+    }
+  while (nc == 0 && k > 0);
+  free (header);
+  if (nc == -1)
+    printf ("file '%s' is neither a pgm (P5) nor a ppm (P6) file.\n",
+            file_name);
+  else if (nc <= 0)
+    printf ("invalid header in file '%s'.\n", file_name);
+  if (nc <= 0 || fseek (inimage, pos, SEEK_SET) != 0)
+    {
+      fclose (inimage);
+      return -1;
+    }
+  if (*nx > max_nx || *ny > max_ny)
+    {
+      fclose (inimage);
+      return 0;
+    }
+
+  /* read image data in chunks of whole samples, row by row and channel by
+     channel */
+  bps = (*maxval > 255) ? 2 : 1;
+  n = (*nx) * (*ny) * nc;
+  i = 1; j = 1; m = 0;
+  while (n > 0)
+    {
+      k = (long) fread (buf, bps, n < 4096/bps ? n : 4096/bps, inimage);
+      if (k == 0)
+        {
+          printf ("file '%s' is truncated.\n", file_name);
+          fclose (inimage);
+          return -1;
+        }
+      n -= k;
+      for (l=0; l<k; l++)
+        {
+          if (bps == 1)
+            u[m][i][j] = (long) buf[l];
+          else
+            u[m][i][j] = ((long) buf[2*l] << 8) | (long) buf[2*l+1];
+          if (u[m][i][j] > *maxval)      /* clip to the header maximum */
+            u[m][i][j] = *maxval;
+          if (++m < nc)
+            continue;
+          m = 0;
+          if (++i > *nx)
+            {
+              i = 1;
+              j++;
+            }
+        }
+    }
+
+  /* close file */
+  fclose (inimage);
+
+  return nc;
+
+} /* read_pnm */
+
+/*--------------------------------------------------------------------------*/
+
+long read_pnm_buffer
+
+(const unsigned char  *data,   /* pgm or ppm file in memory */
+ long                  size,   /* size of data */
+ long                 *nx,     /* image size in x direction, output */
+ long                 *ny,     /* image size in y direction, output */
+ long                 *maxval, /* maximum sample value, output */
+ long               ***u,      /* preallocated channels, output */
+ long                  max_nx, /* allocated size of channels in x direction */
+ long                  max_ny) /* allocated size of channels in y direction */
+
+/*
+  reads a greyscale (P5) or colour (P6) image from memory, e.g. a file
+  loaded from a pipe with load_file; same channels and return values as
+  read_pnm
+*/
+
+{
+  long   nc;        /* number of channels */
+  long   pos;       /* position in data */
+  long   row;       /* bytes per image row */
+  long   j;         /* loop variable */
+
+  /* read header */
+  nc = parse_pnm_header (data, size, nx, ny, maxval, &pos);
+  if (nc == -1 || size < 2)
+    {
+      printf ("image data is neither a pgm (P5) nor a ppm (P6) file.\n");
+      return -1;
+    }
+  if (nc <= 0)
+    {
+      printf ("invalid header in image data.\n");
+      return -1;
+    }
+  row = nc * (*nx) * ((*maxval > 255) ? 2 : 1);
+  if (size - pos < row * (*ny))
+    {
+      printf ("image data is truncated.\n");
+      return -1;
+    }
+  if (*nx > max_nx || *ny > max_ny)
+    return 0;
+
+  /* unpack image data row by row */
+  for (j=1; j<=(*ny); j++)
+    unpack_row (data + pos + (j-1) * row, *nx, j, nc, *maxval, u);
+
+  return nc;
+
+} /* read_pnm_buffer */
+
+/*--------------------------------------------------------------------------*/
+
 void comment_line
 
 (char* comment,       /* comment string (output) */
@@ -193,23 +586,63 @@ void comment_line
 
 /*--------------------------------------------------------------------------*/
 
+long write_pnm_stream
+
+(long ***u,           /* channels, unchanged */
+ long   nx,           /* image size in x direction */
+ long   ny,           /* image size in y direction */
+ long   nc,           /* number of channels, 1 (pgm) or 3 (ppm) */
+ long   maxval,       /* maximum sample value, 255 for 8 bit samples */
+ FILE   *outimage,    /* output stream, e.g. stdout */
+ char   *comments)    /* comment string (set 0 for no comments) */
+
+/*
+  writes a greyscale image into a pgm P5 or a colour image into a ppm P6
+  stream; values are clipped to 0,...,maxval and stored with two bytes per
+  sample if maxval > 255; returns the number of bytes, -1 on write errors
+*/
+
+{
+  char           *buf;       /* bytes of one image row */
+  long           bytes;      /* bytes written */
+  long           j;          /* loop variable */
+
+  /* write header */
+  bytes = fprintf (outimage, "P%c\n", (nc == 3) ? '6' : '5'); /* format */
+  if (comments != 0)
+    bytes += fprintf (outimage, comments);    /* comments */
+  bytes += fprintf (outimage, "%ld %ld\n", nx, ny);  /* image size */
+  bytes += fprintf (outimage, "%ld\n", maxval);      /* maximal value */
+
+  /* write image data row by row */
+  alloc_string (&buf, 2 * nc * nx);
+  for (j=1; j<=ny; j++)
+    write_row (outimage, (unsigned char *) buf, nx, j, nc, maxval, u);
+  disalloc_string (buf, 2 * nc * nx);
+  bytes += nc * nx * ny * ((maxval > 255) ? 2 : 1);
+
+  return ferror (outimage) ? -1 : bytes;
+
+} /* write_pnm_stream */
+
+/*--------------------------------------------------------------------------*/
+
 void write_pgm
 
 (long  **u,           /* image, unchanged */
  long   nx,           /* image size in x direction */
  long   ny,           /* image size in y direction */
+ long   maxval,       /* maximum grey value, 255 for 8 bit samples */
  char   *file_name,   /* name of pgm file */
  char   *comments)    /* comment string (set 0 for no comments) */
 
 /*
-  writes a greyscale image into a pgm P5 file;
+  writes a greyscale image into a pgm P5 file; values are clipped to
+  0,...,maxval and stored with two bytes per sample if maxval > 255
 */
 
 {
   FILE           *outimage;  /* output file */
-  long           i, j;       /* loop variables */
-  double          aux;        /* auxiliary variable */
-  unsigned char  byte;       /* for data conversion */
 
   /* open file */
   outimage = fopen (file_name, "wb");
@@ -219,26 +652,8 @@ void write_pgm
       exit(1);
     }
 
-  /* write header */
-  fprintf (outimage, "P5\n");                  /* format */
-  if (comments != 0)
-    fprintf (outimage, comments);             /* comments */
-  fprintf (outimage, "%ld %ld\n", nx, ny);     /* image size */
-  fprintf (outimage, "255\n");                 /* maximal value */
-
-  /* write image data */
-  for (j=1; j<=ny; j++)
-    for (i=1; i<=nx; i++)
-      {
-        aux = (double)u[i][j] + 0.499999;    /* for correct rounding */
-        if (aux < 0.0)
-          byte = (unsigned char)(0.0);
-        else if (aux > 255.0)
-          byte = (unsigned char)(255.0);
-        else
-          byte = (unsigned char)(aux);
-        fwrite (&byte, sizeof(unsigned char), 1, outimage);
-      }
+  /* write header and image data */
+  write_pnm_stream (&u, nx, ny, 1, maxval, outimage, comments);
 
   /* close file */
   fclose (outimage);
@@ -306,18 +721,17 @@ void write_ppm
 (long   ***u,         /* image, unchanged */
  long   nx,           /* image size in x direction */
  long   ny,           /* image size in y direction */
+ long   maxval,       /* maximum sample value, 255 for 8 bit samples */
  char   *file_name,   /* name of pgm file */
  char   *comments)    /* comment string (set 0 for no comments) */
 
 /*
-  writes a greyscale image into a pgm P5 file;
+  writes a colour image into a ppm P6 file; values are clipped to
+  0,...,maxval and stored with two bytes per sample if maxval > 255
 */
 
 {
   FILE           *outimage;  /* output file */
-  long           i, j, m;       /* loop variables */
-  double          aux;        /* auxiliary variable */
-  unsigned char  byte;       /* for data conversion */
 
   /* open file */
   outimage = fopen (file_name, "wb");
@@ -327,27 +741,8 @@ void write_ppm
       exit(1);
     }
 
-  /* write header */
-  fprintf (outimage, "P6\n");                  /* format */
-  if (comments != 0)
-    fprintf (outimage, comments);             /* comments */
-  fprintf (outimage, "%ld %ld\n", nx, ny);     /* image size */
-  fprintf (outimage, "255\n");                 /* maximal value */
-
-  /* write image data */
-  for (j=1; j<=ny; j++)
-    for (i=1; i<=nx; i++)
-      for (m=0; m<3; m++)
-        {
-          aux = (double)u[m][i][j] + 0.499999;    /* for correct rounding */
-          if (aux < 0.0)
-            byte = (unsigned char)(0.0);
-          else if (aux > 255.0)
-            byte = (unsigned char)(255.0);
-          else
-            byte = (unsigned char)(aux);
-          fwrite (&byte, sizeof(unsigned char), 1, outimage);
-        }
+  /* write header and image data */
+  write_pnm_stream (u, nx, ny, 3, maxval, outimage, comments);
 
   /* close file */
   fclose (outimage);
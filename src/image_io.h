@@ -1,6 +1,11 @@
 #ifndef IMAGE_IO_H_
 #define IMAGE_IO_H_
 
+#include <stdio.h>
+
+/* largest maximum value of pgm and ppm files: 16 bit samples */
+#define MAXSAMPLEVALUE 65535
+
 /*--------------------------------------------------------------------------*/
 
 void read_pgm_header
@@ -14,10 +19,13 @@ void read_pgm_and_allocate_memory
 (const char  *file_name,    /* name of pgm file */
  long        *nx,           /* image size in x direction, output */
  long        *ny,           /* image size in y direction, output */
+ long        *maxval,       /* maximum grey value, output */
  long        ***u);         /* image, output */
 
 /*
-  reads a greyscale image that has been encoded in pgm format P5;
+  reads a greyscale image that has been encoded in pgm format P5, with one
+  byte per sample for maxval < 256 and two bytes (big endian) otherwise;
+  samples above maxval are clipped to maxval;
   allocates memory for the image u;
   adds boundary layers of size 1 such that
   - the relevant image pixels in x direction use the indices 1,...,nx
@@ -31,10 +39,13 @@ void read_ppm_and_allocate_memory
 (const char  *file_name,    /* name of pgm file */
  long        *nx,           /* image size in x direction, output */
  long        *ny,           /* image size in y direction, output */
+ long        *maxval,       /* maximum sample value, output */
  long       ****u);         /* image, output */
 
 /*
-  reads a colour image that has been encoded in pgm format P6;
+  reads a colour image that has been encoded in pgm format P6, with one
+  byte per sample for maxval < 256 and two bytes (big endian) otherwise;
+  samples above maxval are clipped to maxval;
   allocates memory for the image u;
   adds boundary layers of size 1 such that
   - the relevant image pixels in x direction use the indices 1,...,nx
@@ -43,6 +54,48 @@ void read_ppm_and_allocate_memory
 
 /*--------------------------------------------------------------------------*/
 
+long read_pnm
+
+(const char  *file_name,    /* name of pgm or ppm file */
+ long        *nx,           /* image size in x direction, output */
+ long        *ny,           /* image size in y direction, output */
+ long        *maxval,       /* maximum sample value, output */
+ long        ***u,          /* preallocated channels, output */
+ long         max_nx,       /* allocated size of channels in x direction */
+ long         max_ny);      /* allocated size of channels in y direction */
+
+/*
+  reads a greyscale (P5) or colour (P6) image with 8 or 16 bit samples into
+  the channels u[0] resp. u[0],u[1],u[2] without allocating any memory,
+  with the same boundary layers and clipping to maxval as
+  read_pgm_and_allocate_memory; returns the number of channels, 0 if the
+  image is larger than max_nx x max_ny (nx and ny are set, so that the
+  caller can grow the channels and read again) and -1 if the file cannot
+  be read; in contrast to the other readers, errors do not abort the
+  program, and the header is parsed as by read_pnm_buffer
+*/
+
+/*--------------------------------------------------------------------------*/
+
+long read_pnm_buffer
+
+(const unsigned char  *data,   /* pgm or ppm file in memory */
+ long                  size,   /* size of data */
+ long                 *nx,     /* image size in x direction, output */
+ long                 *ny,     /* image size in y direction, output */
+ long                 *maxval, /* maximum sample value, output */
+ long               ***u,      /* preallocated channels, output */
+ long                  max_nx, /* allocated size of channels in x direction */
+ long                  max_ny);/* allocated size of channels in y direction */
+
+/*
+  reads a greyscale (P5) or colour (P6) image from memory, e.g. a file
+  loaded from a pipe with load_file; same channels and return values as
+  read_pnm
+*/
+
+/*--------------------------------------------------------------------------*/
+
 void comment_line
 
 (char* comment,       /* comment string (output) */
@@ -59,16 +112,36 @@ void comment_line
 
 /*--------------------------------------------------------------------------*/
 
+long write_pnm_stream
+
+(long ***u,           /* channels, unchanged */
+ long   nx,           /* image size in x direction */
+ long   ny,           /* image size in y direction */
+ long   nc,           /* number of channels, 1 (pgm) or 3 (ppm) */
+ long   maxval,       /* maximum sample value, 255 for 8 bit samples */
+ FILE   *outimage,    /* output stream, e.g. stdout */
+ char   *comments);   /* comment string (set 0 for no comments) */
+
+/*
+  writes a greyscale image into a pgm P5 or a colour image into a ppm P6
+  stream; values are clipped to 0,...,maxval and stored with two bytes per
+  sample if maxval > 255; returns the number of bytes, -1 on write errors
+*/
+
+/*--------------------------------------------------------------------------*/
+
 void write_pgm
 
 (long  **u,           /* image, unchanged */
  long   nx,           /* image size in x direction */
  long   ny,           /* image size in y direction */
+ long   maxval,       /* maximum grey value, 255 for 8 bit samples */
  char   *file_name,   /* name of pgm file */
  char   *comments);   /* comment string (set 0 for no comments) */
 
 /*
-  writes a greyscale image into a pgm P5 file;
+  writes a greyscale image into a pgm P5 file; values are clipped to
+  0,...,maxval and stored with two bytes per sample if maxval > 255
 */
 
 /*--------------------------------------------------------------------------*/
@@ -92,11 +165,13 @@ void write_ppm
 (long ***u,           /* image, unchanged */
  long   nx,           /* image size in x direction */
  long   ny,           /* image size in y direction */
+ long   maxval,       /* maximum sample value, 255 for 8 bit samples */
  char   *file_name,   /* name of pgm file */
  char   *comments);   /* comment string (set 0 for no comments) */
 
 /*
-  writes a greyscale image into a pgm P5 file;
+  writes a colour image into a ppm P6 file; values are clipped to
+  0,...,maxval and stored with two bytes per sample if maxval > 255
 */
 
 
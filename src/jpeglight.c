@@ -0,0 +1,185 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/*  File:       jpeglight.c                                                 */
+/*                                                                          */
+/*  Purpose:    Library interface of the encoder, see jpeglight.h. The      */
+/*              codec is included as a single translation unit without its  */
+/*              main program, like in the benchmarks and tests.             */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#define JPEG_LIGHT_NO_MAIN
+#include "ic19_jpeg_light.c"
+#include "jpeglight.h"
+
+/* encoder of the library: the reusable encoder of the program */
+struct JLEncoder {
+  EncoderContext ctx;
+};
+
+/*--------------------------------------------------------------------------*/
+
+void jl_default_params
+(JLParams *params)    /* parameters, output */
+
+/*
+  sets the default parameters of the command line program: default
+  quantisation matrix, 2x2 chroma subsampling, 8x8 blocks, no restarts,
+  default threads, lossy coding
+*/
+
+{
+  long i;
+
+  for (i = 0; i < 64; i++)
+    params->weights[i] = params->chroma_weights[i] = default_weights[i];
+  params->sx = params->sy = 2;
+  params->block_size = 8;
+  params->restart = 0;
+  params->threads = 0;
+  params->lossless = 0;
+
+  return;
+
+} /* jl_default_params */
+
+/*--------------------------------------------------------------------------*/
+
+long jl_set_quality
+(JLParams *params,    /* parameters, changed */
+ long      quality)   /* quality 1..100 */
+
+/*
+  sets the luma and chroma matrices of the command line option -Q: the
+  default pair of matrices scaled like libjpeg; returns 0, or -1 for an
+  invalid quality
+*/
+
+{
+  if (quality < 1 || quality > 100)
+    return -1;
+  scale_weights (default_weights, quality, params->weights);
+  scale_weights (default_chroma_weights, quality, params->chroma_weights);
+
+  return 0;
+
+} /* jl_set_quality */
+
+/*--------------------------------------------------------------------------*/
+
+JLEncoder *jl_encoder_create
+(const JLParams *params)   /* parameters, copied */
+
+/*
+  creates an encoder; returns NULL if the parameters are invalid
+*/
+
+{
+  JLEncoder *enc;
+  long i;
+
+  if (params->sx < 1 || params->sx > MAXSUBSAMPLING || params->sy < 1 ||
+      params->sy > MAXSUBSAMPLING || !VALID_BLOCKSIZE (params->block_size) ||
+      params->restart < 0 || params->threads < 0)
+    return NULL;
+  for (i = 0; i < 64; i++)
+    if (params->weights[i] < 1 || params->weights[i] > 65535 ||
+        params->chroma_weights[i] < 1 || params->chroma_weights[i] > 65535)
+      return NULL;
+
+  enc = (JLEncoder *) malloc (sizeof(JLEncoder));
+  if (enc == NULL)
+    {
+      printf ("jl_encoder_create: not enough memory available\n");
+      exit (1);
+    }
+  init_encoder (&enc->ctx, params->sx, params->sy,
+                params->lossless ? BLOCKSIZE_LOSSLESS : params->block_size,
+                params->restart, params->weights, params->chroma_weights,
+                params->threads);
+
+  return enc;
+
+} /* jl_encoder_create */
+
+/*--------------------------------------------------------------------------*/
+
+long jl_encode
+(JLEncoder           *enc,       /* encoder */
+ const unsigned char *pixels,    /* interleaved 8 bit samples, row by row */
+ long                 stride,    /* bytes per row */
+ long                 width,     /* image width */
+ long                 height,    /* image height */
+ long                 channels,  /* 1 (grey) or 3 (RGB) */
+ JLBuffer            *out)       /* output buffer */
+
+/*
+  encodes an image into out; returns the compressed size in bytes, -1 for
+  invalid arguments
+*/
+
+{
+  long size;
+
+  if (pixels == NULL || width < 1 || height < 1 ||
+      (channels != 1 && channels != 3) || stride < width * channels)
+    return -1;
+
+  encode_pixels (&enc->ctx, pixels, stride, width, height, channels);
+
+  /* container into the output buffer */
+  size = layout_compressed_file (&enc->ctx.header, enc->ctx.streams);
+  if (size > out->capacity)
+    {
+      out->data = (unsigned char *) realloc (out->data, size);
+      if (out->data == NULL)
+        {
+          printf ("jl_encode: not enough memory available\n");
+          exit (1);
+        }
+      out->capacity = size;
+    }
+  store_compressed_file (&enc->ctx.header, enc->ctx.streams, out->data);
+  out->size = size;
+
+  return size;
+
+} /* jl_encode */
+
+/*--------------------------------------------------------------------------*/
+
+void jl_encoder_destroy
+(JLEncoder *enc)    /* encoder */
+
+/*
+  frees an encoder and all of its buffers
+*/
+
+{
+  if (enc == NULL)
+    return;
+  destroy_encoder (&enc->ctx);
+  free (enc);
+
+  return;
+
+} /* jl_encoder_destroy */
+
+/*--------------------------------------------------------------------------*/
+
+void jl_buffer_free
+(JLBuffer *buf)     /* buffer */
+
+/*
+  frees the data of an output buffer and empties it
+*/
+
+{
+  free (buf->data);
+  buf->data = NULL;
+  buf->size = 0;
+  buf->capacity = 0;
+
+  return;
+
+} /* jl_buffer_free */
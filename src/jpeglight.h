@@ -0,0 +1,119 @@
+#ifndef JPEGLIGHT_H_
+#define JPEGLIGHT_H_
+
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/*  File:       jpeglight.h                                                 */
+/*                                                                          */
+/*  Purpose:    Library interface of the encoder (libjpeglight.a and        */
+/*              libjpeglight.so). An encoder is created once with its       */
+/*              parameters and then encodes any number of images from       */
+/*              memory into a memory buffer. All buffers of the encoder are */
+/*              kept between images and only grow if an image does not      */
+/*              fit. There is no file I/O, and the only global state is a   */
+/*              cache of immutable quantisation tables, so that several     */
+/*              encoders can be used concurrently from different threads.   */
+/*              A single encoder must not be used by two threads at the     */
+/*              same time.                                                  */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#if defined(__GNUC__)
+#define JL_EXPORT __attribute__((visibility("default")))
+#else
+#define JL_EXPORT
+#endif
+
+/* opaque encoder */
+typedef struct JLEncoder JLEncoder;
+
+/* parameters of an encoder */
+typedef struct {
+  long weights[64];   /* luma quantisation matrix, w[u][v] at
+                         weights[8*u+v] */
+  long chroma_weights[64]; /* chroma quantisation matrix, same layout */
+  long sx, sy;        /* chroma subsampling factors, 1 to 8 */
+  long block_size;    /* DCT block size 4, 8 or 16; the 8x8 matrices are
+                         resampled to the block size */
+  long restart;       /* restart interval in block rows, 0: one slice per
+                         channel */
+  long threads;       /* threads per image, 0: OpenMP default */
+  long lossless;      /* 1: lossless coding; matrices, block size and
+                         subsampling are ignored, and the restart interval
+                         counts rows of samples */
+} JLParams;
+
+/* output buffer; grows as needed and is reused between images */
+typedef struct {
+  unsigned char *data;  /* compressed image (.wnc container) */
+  long size;            /* size of compressed image in bytes */
+  long capacity;        /* allocated size of data */
+} JLBuffer;
+
+/*--------------------------------------------------------------------------*/
+
+JL_EXPORT void jl_default_params
+(JLParams *params);   /* parameters, output */
+
+/*
+  sets the default parameters of the command line program: default
+  quantisation matrix, 2x2 chroma subsampling, 8x8 blocks, no restarts,
+  default threads, lossy coding
+*/
+
+/*--------------------------------------------------------------------------*/
+
+JL_EXPORT long jl_set_quality
+(JLParams *params,    /* parameters, changed */
+ long      quality);  /* quality 1..100 */
+
+/*
+  sets the luma and chroma matrices of the command line option -Q: the
+  default pair of matrices scaled like libjpeg; returns 0, or -1 for an
+  invalid quality
+*/
+
+/*--------------------------------------------------------------------------*/
+
+JL_EXPORT JLEncoder *jl_encoder_create
+(const JLParams *params);  /* parameters, copied */
+
+/*
+  creates an encoder; returns NULL if the parameters are invalid
+*/
+
+/*--------------------------------------------------------------------------*/
+
+JL_EXPORT long jl_encode
+(JLEncoder           *enc,       /* encoder */
+ const unsigned char *pixels,    /* interleaved 8 bit samples, row by row */
+ long                 stride,    /* bytes per row */
+ long                 width,     /* image width */
+ long                 height,    /* image height */
+ long                 channels,  /* 1 (grey) or 3 (RGB) */
+ JLBuffer            *out);      /* output buffer */
+
+/*
+  encodes an image into out; returns the compressed size in bytes, -1 for
+  invalid arguments
+*/
+
+/*--------------------------------------------------------------------------*/
+
+JL_EXPORT void jl_encoder_destroy
+(JLEncoder *enc);   /* encoder */
+
+/*
+  frees an encoder and all of its buffers
+*/
+
+/*--------------------------------------------------------------------------*/
+
+JL_EXPORT void jl_buffer_free
+(JLBuffer *buf);    /* buffer */
+
+/*
+  frees the data of an output buffer and empties it
+*/
+
+#endif /* JPEGLIGHT_H_ */
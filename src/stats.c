@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "stats.h"
+
+long stats_mode = STATS_OFF;
+StageStats stats[STAGES];
+
+/* names of all stages, in the order of the STAGE_* constants */
+const char *stats_stage_names[STAGES] = {
+  "load", "colour", "subsample", "dct", "quantise", "symbolise", "wnc",
+  "offsets", "write", "reconstruct"
+};
+
+/*--------------------------------------------------------------------------*/
+
+static double wall_time (void) {
+  struct timeval time;
+  gettimeofday (&time, NULL);
+  return (double)time.tv_sec + (double)time.tv_usec * .000001;
+}
+
+static double cpu_time (void) {
+  struct timespec time;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec * .000000001;
+}
+
+/*--------------------------------------------------------------------------*/
+
+void stats_start_timer
+(StatsTimer *t)     /* timer, output */
+
+/*
+  records wall and thread CPU time at the start of a stage
+*/
+
+{
+  t->wall = wall_time ();
+  t->cpu = cpu_time ();
+
+  return;
+
+} /* stats_start_timer */
+
+/*--------------------------------------------------------------------------*/
+
+void stats_stop_timer
+(long        stage,      /* stage */
+ StatsTimer *t,          /* timer started by stats_start_timer */
+ long        bytes_in,   /* bytes consumed */
+ long        bytes_out,  /* bytes produced */
+ long        blocks,     /* blocks processed */
+ long        symbols)    /* symbols emitted or decoded */
+
+/*
+  adds the elapsed time and the counters to the statistics of stage;
+  safe to be called from several threads
+*/
+
+{
+  double wall = wall_time () - t->wall;
+  double cpu = cpu_time () - t->cpu;
+  StageStats *s = &stats[stage];
+
+  #pragma omp critical (stats_update)
+  {
+    s->calls++;
+    s->wall += wall;
+    s->cpu += cpu;
+    s->bytes_in += bytes_in;
+    s->bytes_out += bytes_out;
+    s->blocks += blocks;
+    s->symbols += symbols;
+  }
+
+  return;
+
+} /* stats_stop_timer */
+
+/*--------------------------------------------------------------------------*/
+
+long parse_stats_mode
+(const char *arg)   /* "table", "json" or 0 */
+
+/*
+  returns the output format for the argument of --stats; no argument
+  selects the table, -1 indicates an invalid argument
+*/
+
+{
+  if (arg == 0 || !strcmp (arg, "table"))
+    return STATS_TABLE;
+  if (!strcmp (arg, "json"))
+    return STATS_JSON;
+  return -1;
+
+} /* parse_stats_mode */
+
+/*--------------------------------------------------------------------------*/
+
+void stats_print
+(FILE *file)        /* output file */
+
+/*
+  writes the statistics of all stages that were timed at least once, as a
+  table or as JSON depending on stats_mode
+*/
+
+{
+  long i, first = 1;
+  const StageStats *s;
+
+  if (stats_mode == STATS_JSON)
+    {
+      fprintf (file, "{\"stages\": [");
+      for (i = 0; i < STAGES; i++)
+        {
+          s = &stats[i];
+          if (s->calls == 0)
+            continue;
+          fprintf (file, "%s\n  {\"stage\": \"%s\", \"calls\": %ld, "
+                   "\"wall_s\": %.6f, \"cpu_s\": %.6f, \"bytes_in\": %ld, "
+                   "\"bytes_out\": %ld, \"blocks\": %ld, \"symbols\": %ld}",
+                   first ? "" : ",", stats_stage_names[i], s->calls, s->wall,
+                   s->cpu, s->bytes_in, s->bytes_out, s->blocks, s->symbols);
+          first = 0;
+        }
+      fprintf (file, "\n]}\n");
+    }
+  else if (stats_mode == STATS_TABLE)
+    {
+      fprintf (file, "%-12s %6s %10s %10s %12s %12s %10s %10s\n", "stage",
+               "calls", "wall [ms]", "cpu [ms]", "bytes in", "bytes out",
+               "blocks", "symbols");
+      for (i = 0; i < STAGES; i++)
+        {
+          s = &stats[i];
+          if (s->calls == 0)
+            continue;
+          fprintf (file, "%-12s %6ld %10.3f %10.3f %12ld %12ld %10ld %10ld\n",
+                   stats_stage_names[i], s->calls, s->wall * 1000.0,
+                   s->cpu * 1000.0, s->bytes_in, s->bytes_out, s->blocks,
+                   s->symbols);
+        }
+    }
+
+  return;
+
+} /* stats_print */
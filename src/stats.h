@@ -0,0 +1,142 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/*  File:       stats.h                                                     */
+/*                                                                          */
+/*  Purpose:    Per-stage instrumentation: wall and CPU time, bytes in and  */
+/*              out, blocks and symbols for every stage of the codec. The   */
+/*              timers are inline and reduce to a single test of a global   */
+/*              flag if statistics are disabled, so they can stay compiled  */
+/*              into production builds. Stages may be timed concurrently    */
+/*              from several threads; the CPU time is then the sum over     */
+/*              all threads, the wall time the sum over all calls.          */
+/*              If tracing is enabled, every timed stage is also recorded   */
+/*              as a span in the trace.                                     */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include "trace.h"
+
+/* stages of encoder and decoder */
+#define STAGE_LOAD        0   /* reading input file */
+#define STAGE_COLOUR      1   /* colour space conversion */
+#define STAGE_SUBSAMPLE   2   /* chroma sub- and upsampling */
+#define STAGE_DCT         3   /* forward block DCT */
+#define STAGE_QUANTISE    4   /* quantisation */
+#define STAGE_SYMBOLISE   5   /* run length and category symbols */
+#define STAGE_WNC         6   /* adaptive arithmetic coding of symbols */
+#define STAGE_OFFSETS     7   /* category offsets */
+#define STAGE_WRITE       8   /* writing output file */
+#define STAGE_RECONSTRUCT 9   /* requantisation and inverse DCT */
+#define STAGES           10
+
+/* output formats of stats_print */
+#define STATS_OFF   0
+#define STATS_TABLE 1
+#define STATS_JSON  2
+
+/* accumulated measurements of one stage */
+typedef struct {
+  long   calls;               /* number of timed calls */
+  double wall;                /* wall clock time in seconds */
+  double cpu;                 /* CPU time in seconds */
+  long   bytes_in;            /* bytes consumed */
+  long   bytes_out;           /* bytes produced */
+  long   blocks;              /* blocks processed */
+  long   symbols;             /* symbols emitted or decoded */
+} StageStats;
+
+/* running measurement of one call */
+typedef struct {
+  double wall;                /* wall clock time at start */
+  double cpu;                 /* thread CPU time at start */
+  double trace;               /* start of trace span */
+} StatsTimer;
+
+extern long stats_mode;              /* STATS_OFF, STATS_TABLE, STATS_JSON */
+extern StageStats stats[STAGES];     /* measurements of all stages */
+extern const char *stats_stage_names[STAGES]; /* names of all stages */
+
+/*--------------------------------------------------------------------------*/
+
+void stats_start_timer
+(StatsTimer *t);    /* timer, output */
+
+/*
+  records wall and thread CPU time at the start of a stage
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void stats_stop_timer
+(long        stage,      /* stage */
+ StatsTimer *t,          /* timer started by stats_start_timer */
+ long        bytes_in,   /* bytes consumed */
+ long        bytes_out,  /* bytes produced */
+ long        blocks,     /* blocks processed */
+ long        symbols);   /* symbols emitted or decoded */
+
+/*
+  adds the elapsed time and the counters to the statistics of stage;
+  safe to be called from several threads
+*/
+
+/*--------------------------------------------------------------------------*/
+
+static inline void stats_start
+(StatsTimer *t)     /* timer, output */
+
+/*
+  starts timing a stage if statistics are enabled
+*/
+
+{
+  if (stats_mode != STATS_OFF)
+    stats_start_timer (t);
+  t->trace = trace_begin ();
+}
+
+/*--------------------------------------------------------------------------*/
+
+static inline void stats_stop
+(long        stage,      /* stage */
+ StatsTimer *t,          /* timer started by stats_start */
+ long        bytes_in,   /* bytes consumed */
+ long        bytes_out,  /* bytes produced */
+ long        blocks,     /* blocks processed */
+ long        symbols)    /* symbols emitted or decoded */
+
+/*
+  stops timing a stage if statistics are enabled
+*/
+
+{
+  if (stats_mode != STATS_OFF)
+    stats_stop_timer (stage, t, bytes_in, bytes_out, blocks, symbols);
+  trace_end (stats_stage_names[stage], t->trace, blocks);
+}
+
+/*--------------------------------------------------------------------------*/
+
+long parse_stats_mode
+(const char *arg);  /* "table", "json" or 0 */
+
+/*
+  returns the output format for the argument of --stats; no argument
+  selects the table, -1 indicates an invalid argument
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void stats_print
+(FILE *file);       /* output file */
+
+/*
+  writes the statistics of all stages that were timed at least once, as a
+  table or as JSON depending on stats_mode
+*/
+
+#endif /* STATS_H_ */
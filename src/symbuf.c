@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "symbuf.h"
+
+/*--------------------------------------------------------------------------*/
+
+static SYMSEGMENT *alloc_segment (void)
+
+/*
+  allocates an empty segment
+*/
+
+{
+  SYMSEGMENT *s;
+
+  s = (SYMSEGMENT *) malloc (sizeof(SYMSEGMENT));
+  if (s == NULL)
+    {
+      printf ("alloc_segment: not enough memory available\n");
+      exit (1);
+    }
+  s->n = 0;
+  s->next = NULL;
+
+  return s;
+
+} /* alloc_segment */
+
+/*--------------------------------------------------------------------------*/
+
+void sb_init
+(SYMBUF *sb)     /* symbol stream */
+
+/*
+  initialises an empty symbol stream with one segment
+*/
+
+{
+  sb->first = sb->last = alloc_segment ();
+  sb->n = 0;
+
+  return;
+
+} /* sb_init */
+
+/*--------------------------------------------------------------------------*/
+
+void sb_grow
+(SYMBUF *sb)     /* symbol stream */
+
+/*
+  continues writing in the next segment, which is allocated if the stream
+  has not used it before
+*/
+
+{
+  if (sb->last->next == NULL)
+    sb->last->next = alloc_segment ();
+  sb->last = sb->last->next;
+
+  return;
+
+} /* sb_grow */
+
+/*--------------------------------------------------------------------------*/
+
+void sb_free
+(SYMBUF *sb)     /* symbol stream */
+
+/*
+  frees all segments of a symbol stream
+*/
+
+{
+  SYMSEGMENT *s;
+
+  while (sb->first != NULL)
+    {
+      s = sb->first->next;
+      free (sb->first);
+      sb->first = s;
+    }
+  sb->last = NULL;
+  sb->n = 0;
+
+  return;
+
+} /* sb_free */
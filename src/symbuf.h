@@ -0,0 +1,91 @@
+#ifndef SYMBUF_H_
+#define SYMBUF_H_
+
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/*  File:       symbuf.h                                                    */
+/*                                                                          */
+/*  Purpose:    Packed symbol streams between symboliser and entropy coder. */
+/*              Every entry is a symbol of two bytes and the category       */
+/*              offset of its coefficient in four bytes (categories up to   */
+/*              32 bits), kept in segments of SB_SEGMENT entries. A stream  */
+/*              grows one segment at a time and is read segment by segment, */
+/*              so that the entropy coder can consume it while it is        */
+/*              produced; sb_reset keeps all segments for reuse.            */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+/* number of entries per segment */
+#define SB_SEGMENT 4096
+
+/* definition of the datatype SYMSEGMENT for one segment of a stream */
+typedef struct SYMSEGMENT SYMSEGMENT;
+struct SYMSEGMENT {
+  unsigned short symbol[SB_SEGMENT];  /* symbols */
+  unsigned int   offset[SB_SEGMENT];  /* category offsets */
+  long           n;                   /* number of entries used */
+  SYMSEGMENT    *next;                /* next segment, NULL if none */
+};
+
+/* definition of the datatype SYMBUF for a packed symbol stream */
+typedef struct {
+  SYMSEGMENT *first;          /* first segment */
+  SYMSEGMENT *last;           /* segment that is written */
+  long n;                     /* number of entries in all segments */
+} SYMBUF;
+
+/*--------------------------------------------------------------------------*/
+
+void sb_init
+(SYMBUF *sb);     /* symbol stream */
+
+/*
+  initialises an empty symbol stream with one segment
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void sb_grow
+(SYMBUF *sb);     /* symbol stream */
+
+/*
+  continues writing in the next segment, which is allocated if the stream
+  has not used it before
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void sb_free
+(SYMBUF *sb);     /* symbol stream */
+
+/*
+  frees all segments of a symbol stream
+*/
+
+/*--------------------------------------------------------------------------*/
+
+static inline void sb_reset(SYMBUF *sb) {
+  /* empty the stream but keep all segments for reuse */
+  SYMSEGMENT *s;
+  for (s = sb->first; s != NULL && s->n > 0; s = s->next)
+    s->n = 0;
+  sb->last = sb->first;
+  sb->n = 0;
+}
+
+/*--------------------------------------------------------------------------*/
+
+static inline void sb_put(SYMBUF *sb, long symbol, long offset) {
+  /* append a symbol with the category offset of its coefficient */
+  SYMSEGMENT *s = sb->last;
+  if (s->n == SB_SEGMENT) {
+    sb_grow(sb);
+    s = sb->last;
+  }
+  s->symbol[s->n] = (unsigned short)symbol;
+  s->offset[s->n] = (unsigned int)offset;
+  s->n++;
+  sb->n++;
+}
+
+#endif /* SYMBUF_H_ */
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <omp.h>
+#include "trace.h"
+
+long trace_enabled = 0;
+
+/* one complete event */
+typedef struct {
+  const char *name;   /* span name */
+  double      start;  /* start in microseconds */
+  double      dur;    /* duration in microseconds */
+  long        arg;    /* argument */
+} TraceEvent;
+
+/* ring buffer of one thread, padded to avoid false sharing */
+typedef struct {
+  TraceEvent *events; /* TRACE_EVENTS events */
+  long        count;  /* number of recorded events, may exceed the size */
+  char        pad[48];
+} TraceBuffer;
+
+static TraceBuffer *buffers = NULL;  /* one buffer per thread */
+static long threads = 0;             /* number of buffers */
+static long used = 0;                /* number of buffers handed out */
+static long generation = 0;          /* number of calls of trace_start */
+static double origin = 0.0;          /* time of trace_start */
+
+/* buffer of the calling thread, assigned on its first event of a trace;
+   omp_get_thread_num() cannot be used, since it is 0 in the inner regions
+   that the workers of the batch mode open */
+static _Thread_local long slot = -1;
+static _Thread_local long slot_generation = 0;
+
+/*--------------------------------------------------------------------------*/
+
+double trace_now
+(void)
+
+/*
+  returns the current time in microseconds
+*/
+
+{
+  struct timespec time;
+
+  clock_gettime (CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec * 1000000.0 + (double)time.tv_nsec * 0.001;
+
+} /* trace_now */
+
+/*--------------------------------------------------------------------------*/
+
+void trace_record
+(const char *name,    /* span name, must be a string constant */
+ double      start,   /* start time from trace_begin */
+ long        arg)     /* argument shown with the span, e.g. block row */
+
+/*
+  stores a span from start to now in the ring buffer of the calling thread
+*/
+
+{
+  TraceBuffer *b;
+  TraceEvent *e;
+
+  if (slot_generation != generation)
+    {
+      #pragma omp atomic capture
+      slot = used++;
+      slot_generation = generation;
+    }
+  if (slot >= threads)
+    return;
+  b = &buffers[slot];
+  e = &b->events[b->count % TRACE_EVENTS];
+  e->name = name;
+  e->start = start;
+  e->dur = trace_now () - start;
+  e->arg = arg;
+  b->count++;
+
+  return;
+
+} /* trace_record */
+
+/*--------------------------------------------------------------------------*/
+
+void trace_start
+(void)
+
+/*
+  allocates one ring buffer per OpenMP thread and enables tracing
+*/
+
+{
+  long t;
+
+  threads = omp_get_max_threads ();
+  buffers = (TraceBuffer *) calloc (threads, sizeof(TraceBuffer));
+  if (buffers == NULL)
+    {
+      printf ("trace_start: not enough memory available\n");
+      exit (1);
+    }
+  for (t = 0; t < threads; t++)
+    {
+      buffers[t].events = (TraceEvent *) malloc (TRACE_EVENTS *
+                                                 sizeof(TraceEvent));
+      if (buffers[t].events == NULL)
+        {
+          printf ("trace_start: not enough memory available\n");
+          exit (1);
+        }
+    }
+  used = 0;
+  generation++;
+  origin = trace_now ();
+  trace_enabled = 1;
+
+  return;
+
+} /* trace_start */
+
+/*--------------------------------------------------------------------------*/
+
+void trace_write
+(const char *file_name)  /* output file */
+
+/*
+  writes all recorded events as Chrome trace JSON, frees the buffers and
+  disables tracing
+*/
+
+{
+  FILE *file;
+  long t, i, first, dropped = 0;
+  TraceBuffer *b;
+  TraceEvent *e;
+
+  if (!trace_enabled)
+    return;
+  trace_enabled = 0;
+
+  file = fopen (file_name, "w");
+  if (file == NULL)
+    {
+      printf ("Could not open file '%s' for writing, aborting\n", file_name);
+      exit (1);
+    }
+
+  fprintf (file, "{\"traceEvents\": [\n");
+  for (t = 0; t < threads && t < used; t++)
+    {
+      fprintf (file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+               "\"pid\": 1, \"tid\": %ld, \"args\": {\"name\": "
+               "\"thread %ld\"}}", t == 0 ? "" : ",\n", t, t);
+    }
+  for (t = 0; t < threads; t++)
+    {
+      b = &buffers[t];
+      first = (b->count > TRACE_EVENTS) ? b->count - TRACE_EVENTS : 0;
+      dropped += first;
+      for (i = first; i < b->count; i++)
+        {
+          e = &b->events[i % TRACE_EVENTS];
+          fprintf (file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                   "\"tid\": %ld, \"ts\": %.3f, \"dur\": %.3f, "
+                   "\"args\": {\"arg\": %ld}}", e->name, t,
+                   e->start - origin, e->dur, e->arg);
+        }
+      free (b->events);
+    }
+  fprintf (file, "\n], \"displayTimeUnit\": \"ms\", \"otherData\": "
+           "{\"dropped_events\": %ld}}\n", dropped);
+  fclose (file);
+
+  free (buffers);
+  buffers = NULL;
+  threads = 0;
+
+  return;
+
+} /* trace_write */
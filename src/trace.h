@@ -0,0 +1,93 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/*  File:       trace.h                                                     */
+/*                                                                          */
+/*  Purpose:    Timeline tracing in the Chrome trace event format (JSON),   */
+/*              viewable with chrome://tracing or Perfetto. Every thread    */
+/*              records complete events (spans) into its own ring buffer    */
+/*              without locking; the buffer is assigned on its first event, */
+/*              so tids are numbered in the order the threads start. If a   */
+/*              buffer overflows, the oldest events of that thread are      */
+/*              overwritten. The file is written once at the end of the    */
+/*              run. If tracing is disabled, the inline functions reduce to */
+/*              a single test of a global flag.                             */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+/* number of events kept per thread */
+#define TRACE_EVENTS 65536
+
+extern long trace_enabled;    /* 1 if tracing is active */
+
+/*--------------------------------------------------------------------------*/
+
+double trace_now
+(void);
+
+/*
+  returns the current time in microseconds
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void trace_record
+(const char *name,    /* span name, must be a string constant */
+ double      start,   /* start time from trace_begin */
+ long        arg);    /* argument shown with the span, e.g. block row */
+
+/*
+  stores a span from start to now in the ring buffer of the calling thread
+*/
+
+/*--------------------------------------------------------------------------*/
+
+static inline double trace_begin
+(void)
+
+/*
+  returns the start time of a span, 0 if tracing is disabled
+*/
+
+{
+  return trace_enabled ? trace_now () : 0.0;
+}
+
+/*--------------------------------------------------------------------------*/
+
+static inline void trace_end
+(const char *name,    /* span name, must be a string constant */
+ double      start,   /* start time from trace_begin */
+ long        arg)     /* argument shown with the span */
+
+/*
+  ends a span if tracing is enabled
+*/
+
+{
+  if (trace_enabled)
+    trace_record (name, start, arg);
+}
+
+/*--------------------------------------------------------------------------*/
+
+void trace_start
+(void);
+
+/*
+  allocates one ring buffer per OpenMP thread and enables tracing
+*/
+
+/*--------------------------------------------------------------------------*/
+
+void trace_write
+(const char *file_name);  /* output file */
+
+/*
+  writes all recorded events as Chrome trace JSON, frees the buffers and
+  disables tracing
+*/
+
+#endif /* TRACE_H_ */
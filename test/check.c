@@ -0,0 +1,929 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/*  File:       check.c                                                     */
+/*                                                                          */
+/*  Purpose:    Conformance checks of the codec kernels. Every kernel that  */
+/*              is compiled into the program is compared against a plain    */
+/*              reference implementation that follows the definition        */
+/*              directly, on a matrix of synthetic images, quantisers,      */
+/*              slice layouts and thread counts. Integer results and        */
+/*              bitstreams have to match bit for bit; results of floating   */
+/*              point kernels have to stay within the tolerances below.     */
+/*              The codec is included as a single translation unit, like    */
+/*              in the benchmarks, so that static helpers can be tested;    */
+/*              the library interface has to produce the same containers    */
+/*              as the program.                                             */
+/*                                                                          */
+/*              usage: ic19_jpeg_light_check [max_threads]                  */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include <unistd.h>
+#include "../src/jpeglight.c"
+
+/* tolerances of floating point kernels against the double precision
+   reference; the kernels use double precision cosine tables as well, so
+   the tolerances hold for the coefficients of 16 bit samples (16*65535)
+   with a wide margin */
+#define TOL_DCT  1e-6
+#define TOL_IDCT 1e-6
+
+static long failures = 0;   /* number of failed checks */
+static long checks = 0;     /* number of checks */
+
+/*--------------------------------------------------------------------------*/
+static void report(long ok, const char *what, const char *image,
+                   const char *detail) {
+  checks++;
+  if (!ok) {
+    failures++;
+    printf("FAIL %-28s %-14s %s\n",what,image,detail);
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+/* reference implementations */
+
+static void ref_dct(long **f, long nx, long ny, long N, double **dct) {
+  /* DCT-II of all NxN blocks by definition, in double precision */
+  long k,l,u,v,x,y;
+  double pi = 4.0*atan(1.0), sum, au, av;
+  for (k=0;k<nx/N;k++)
+    for (l=0;l<ny/N;l++)
+      for (u=0;u<N;u++)
+        for (v=0;v<N;v++) {
+          sum = 0;
+          for (x=0;x<N;x++)
+            for (y=0;y<N;y++)
+              sum += f[k*N+x+1][l*N+y+1]*cos(pi/N*(x+0.5)*u)*
+                     cos(pi/N*(y+0.5)*v);
+          au = u ? sqrt(2.0/N) : sqrt(1.0/N);
+          av = v ? sqrt(2.0/N) : sqrt(1.0/N);
+          dct[k*N+u+1][l*N+v+1] = au*av*sum;
+        }
+}
+
+static void ref_idct(long **c, long nx, long ny, long N, double **f) {
+  /* inverse DCT of all NxN blocks by definition, in double precision */
+  long k,l,u,v,x,y;
+  double pi = 4.0*atan(1.0), sum, au, av;
+  for (k=0;k<nx/N;k++)
+    for (l=0;l<ny/N;l++)
+      for (x=0;x<N;x++)
+        for (y=0;y<N;y++) {
+          sum = 0;
+          for (u=0;u<N;u++)
+            for (v=0;v<N;v++) {
+              au = u ? sqrt(2.0/N) : sqrt(1.0/N);
+              av = v ? sqrt(2.0/N) : sqrt(1.0/N);
+              sum += au*av*c[k*N+u+1][l*N+v+1]*cos(pi/N*(x+0.5)*u)*
+                     cos(pi/N*(y+0.5)*v);
+            }
+          f[k*N+x+1][l*N+y+1] = sum;
+        }
+}
+
+static void ref_quantise(double **dct, long nx, long ny, long N,
+                         const long *w, long **q) {
+  /* quantisation by truncation towards zero with the 8x8 matrix w,
+     resampled at frequency 8u/N */
+  long i,j;
+  for (i=1;i<=nx;i++)
+    for (j=1;j<=ny;j++)
+      q[i][j] = (long)(dct[i][j]/
+                       (double)w[8*((i-1)%N*8/N)+(j-1)%N*8/N]);
+}
+
+/*--------------------------------------------------------------------------*/
+static void synthesise(long **f, long nx, long ny, long kind) {
+  /* deterministic test content: smooth, edges, noise, flat page, and
+     16 bit samples (smooth with noise in the low bits) */
+  long x,y;
+  unsigned long seed = 4711+kind;
+  for (x=1;x<=nx;x++)
+    for (y=1;y<=ny;y++) {
+      seed = seed*6364136223846793005UL+1442695040888963407UL;
+      switch (kind) {
+      case 0:  f[x][y] = (x*3+y*5) % 256; break;
+      case 1:  f[x][y] = ((x/5+y/3) & 1) ? 230 : 15; break;
+      case 3:  f[x][y] = ((x/8+y/8) % 3 == 0) ? (x*y) % 256 :
+                         240+((x/8+y/8) & 1)*(long)(seed >> 63); break;
+      case 4:  f[x][y] = ((x*3+y*5)*257+(long)(seed >> 56)) % 65536; break;
+      default: f[x][y] = (long)(seed >> 56); break;
+      }
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+static double max_diff(double **a, double **b, long nx, long ny) {
+  long i,j;
+  double d, m = 0;
+  for (i=1;i<=nx;i++)
+    for (j=1;j<=ny;j++) {
+      d = fabs(a[i][j]-b[i][j]);
+      if (d > m) m = d;
+    }
+  return m;
+}
+
+static long equal_long(long **a, long **b, long nx, long ny) {
+  long i,j;
+  for (i=1;i<=nx;i++)
+    for (j=1;j<=ny;j++)
+      if (a[i][j] != b[i][j]) return 0;
+  return 1;
+}
+
+/*--------------------------------------------------------------------------*/
+static long encode_slices(long **quant, long nx, long ny, long N,
+                          long interval, long categories, long threads,
+                          BITWRITER **streams, long **symbols,
+                          long *slices) {
+  /* encode a channel in slices of interval block rows with the given
+     number of threads; returns the total number of AC symbols */
+  long rows = ny/N, j, total = 0;
+  *slices = (rows+interval-1)/interval;
+  *streams = (BITWRITER*)malloc(*slices*WNC_STREAMS*sizeof(BITWRITER));
+  *symbols = (long*)malloc(*slices*sizeof(long));
+  for (j=0;j<*slices*WNC_STREAMS;j++) bw_init(&(*streams)[j]);
+  omp_set_num_threads(threads);
+  #pragma omp parallel for schedule(dynamic)
+  for (j=0;j<*slices;j++)
+    (*symbols)[j] = block_encode(quant,nx,ny,N,j*interval,
+                                 min(interval,rows-j*interval),categories,0,
+                                 &(*streams)[j*WNC_STREAMS]);
+  for (j=0;j<*slices;j++) total += (*symbols)[j];
+  return total;
+}
+
+static void decode_slices(BITWRITER *streams, long *symbols, long slices,
+                          long nx, long ny, long interval, long categories,
+                          long threads, const QuantTable *qt, long **rec) {
+  /* decode all slices of a channel with the given number of threads */
+  long j, N = qt->N;
+  omp_set_num_threads(threads);
+  #pragma omp parallel for schedule(dynamic)
+  for (j=0;j<slices;j++) {
+    BITREADER s[WNC_STREAMS];
+    long *dc, *ac, i, blocks = (nx/N)*min(interval,ny/N-j*interval);
+    for (i=0;i<WNC_STREAMS;i++)
+      br_init(&s[i],streams[j*WNC_STREAMS+i].data,
+              bw_bytes(&streams[j*WNC_STREAMS+i]));
+    alloc_long_vector(&dc,blocks);
+    alloc_long_vector(&ac,symbols[j]+1);
+    decode_adaptive_wnc(&s[STREAM_DC_SYMBOLS],blocks,categories,WNC_R,
+                        WNC_M,0,dc);
+    decode_adaptive_wnc(&s[STREAM_AC_SYMBOLS],symbols[j],
+                        AC_ALPHABET(categories),WNC_R,WNC_M,0,ac);
+    block_decode(dc,ac,symbols[j],&s[STREAM_DC_OFFSETS],
+                 &s[STREAM_AC_OFFSETS],nx,ny,j*interval,
+                 min(interval,ny/N-j*interval),0,nx/N-1,categories,N,qt,0,
+                 rec);
+    disalloc_long_vector(dc,blocks);
+    disalloc_long_vector(ac,symbols[j]+1);
+  }
+}
+
+static void free_slices(BITWRITER *streams, long *symbols, long slices) {
+  long j;
+  for (j=0;j<slices*WNC_STREAMS;j++) bw_free(&streams[j]);
+  free(streams);
+  free(symbols);
+}
+
+static long same_streams(BITWRITER *a, BITWRITER *b, long slices) {
+  long j;
+  for (j=0;j<slices*WNC_STREAMS;j++)
+    if (bw_bytes(&a[j]) != bw_bytes(&b[j]) ||
+        memcmp(a[j].data,b[j].data,bw_bytes(&a[j])) != 0) return 0;
+  return 1;
+}
+
+/*--------------------------------------------------------------------------*/
+static void check_image(long nx, long ny, long N, long kind, long q,
+                        long max_threads) {
+  /* run all checks on one extended luma channel with NxN blocks */
+  long **f, **quant, **ref_q, **rec, **dec;
+  double **dct, **ref_c, **fr, **ref_f;
+  BITWRITER *s1, *s2;
+  long *n1, *n2, slices, i, j, t, interval, ok, largest, categories;
+  long intervals[3] = {1000000, 3, 1};
+  char image[64], detail[128];
+  long weights[64];
+  const QuantTable *qt;
+
+  /* set quantisation matrix, 0 keeps the default */
+  for (i=0;i<64;i++) weights[i] = (q > 0) ? q : default_weights[i];
+  qt = get_quant_table(weights,N);
+  sprintf(image,"%ldx%ld/%ld/q%ld",nx,ny,kind,q);
+  if (N != 8) sprintf(image+strlen(image),"/b%ld",N);
+
+  alloc_long_matrix(&f,nx+2,ny+2);
+  alloc_long_matrix(&quant,nx+2,ny+2);
+  alloc_long_matrix(&ref_q,nx+2,ny+2);
+  alloc_long_matrix(&rec,nx+2,ny+2);
+  alloc_long_matrix(&dec,nx+2,ny+2);
+  alloc_double_matrix(&dct,nx+2,ny+2);
+  alloc_double_matrix(&ref_c,nx+2,ny+2);
+  alloc_double_matrix(&fr,nx+2,ny+2);
+  alloc_double_matrix(&ref_f,nx+2,ny+2);
+  synthesise(f,nx,ny,kind);
+
+  /* forward DCT against definition */
+  block_DCT(f,nx,ny,N,-1,dct);
+  ref_dct(f,nx,ny,N,ref_c);
+  sprintf(detail,"max error %g",max_diff(dct,ref_c,nx,ny));
+  report(max_diff(dct,ref_c,nx,ny) <= TOL_DCT,"block_DCT",image,detail);
+
+  /* quantiser: bit exact on identical input */
+  largest = block_quantise(dct,nx,ny,qt,0,quant);
+  ref_quantise(dct,nx,ny,N,weights,ref_q);
+  report(equal_long(quant,ref_q,nx,ny),"block_quantise",image,"");
+
+  /* flat blocks: DC only transform, same quantised coefficients; DC
+     values at multiples of the weights are covered by check_flat_blocks */
+  block_DCT(f,nx,ny,N,qt->flat_range,ref_c);
+  block_quantise(ref_c,nx,ny,qt,0,ref_q);
+  sprintf(detail,"flat range %ld",qt->flat_range);
+  report(equal_long(quant,ref_q,nx,ny),"block_DCT flat blocks",image,
+         detail);
+
+  /* inverse DCT against definition */
+  block_requantise(quant,nx,ny,qt,0,ref_q);
+  block_IDCT(ref_q,nx,ny,N,fr);
+  ref_idct(ref_q,nx,ny,N,ref_f);
+  sprintf(detail,"max error %g",max_diff(fr,ref_f,nx,ny));
+  report(max_diff(fr,ref_f,nx,ny) <= TOL_IDCT,"block_IDCT",image,detail);
+  convert_matrix_int(fr,rec,nx,ny);
+
+  /* coder: bitstreams independent of the number of threads, decoder
+     output identical to the encoder reconstruction */
+  for (i=0;i<3;i++) {
+    interval = min(intervals[i],ny/N);
+    categories = channel_categories(quant,nx,ny,N,interval,largest);
+    encode_slices(quant,nx,ny,N,interval,categories,1,&s1,&n1,&slices);
+    for (t=1;t<=max_threads;t++) {
+      if (t > 1) {
+        encode_slices(quant,nx,ny,N,interval,categories,t,&s2,&n2,
+                      &slices);
+        sprintf(detail,"%ld slices, %ld threads",slices,t);
+        report(same_streams(s1,s2,slices),"block_encode threads",image,
+               detail);
+        free_slices(s2,n2,slices);
+      }
+      for (j=1;j<=nx;j++) memset(dec[j]+1,0,ny*sizeof(long));
+      decode_slices(s1,n1,slices,nx,ny,interval,categories,t,qt,dec);
+      ok = equal_long(rec,dec,nx,ny);
+      sprintf(detail,"%ld slices, %ld threads",slices,t);
+      report(ok,"block_decode == reconstruction",image,detail);
+    }
+    free_slices(s1,n1,slices);
+  }
+
+  disalloc_long_matrix(f,nx+2,ny+2);
+  disalloc_long_matrix(quant,nx+2,ny+2);
+  disalloc_long_matrix(ref_q,nx+2,ny+2);
+  disalloc_long_matrix(rec,nx+2,ny+2);
+  disalloc_long_matrix(dec,nx+2,ny+2);
+  disalloc_double_matrix(dct,nx+2,ny+2);
+  disalloc_double_matrix(ref_c,nx+2,ny+2);
+  disalloc_double_matrix(fr,nx+2,ny+2);
+  disalloc_double_matrix(ref_f,nx+2,ny+2);
+}
+
+/*--------------------------------------------------------------------------*/
+static void check_uniform_dc(void) {
+  /* uniform blocks of every 16 bit value: the DC only transform has to
+     give the DC of the full DCT bit for bit, so that it quantises the same
+     with any weight */
+  long N, k, l, x, y, first, bad;
+  long **f;
+  double **d1, **d2;
+  char detail[64];
+
+  for (N=4;N<=16;N*=2) {
+    alloc_long_matrix(&f,64*N+2,64*N+2);
+    alloc_double_matrix(&d1,64*N+2,64*N+2);
+    alloc_double_matrix(&d2,64*N+2,64*N+2);
+    bad = -1;
+    for (first=0;first<=MAXSAMPLEVALUE && bad < 0;first+=64*64) {
+      for (k=0;k<64;k++)
+        for (l=0;l<64;l++)
+          for (x=1;x<=N;x++)
+            for (y=1;y<=N;y++)
+              f[k*N+x][l*N+y] = first+64*k+l;
+      block_DCT(f,64*N,64*N,N,-1,d1);
+      block_DCT(f,64*N,64*N,N,0,d2);
+      for (k=0;k<64 && bad < 0;k++)
+        for (l=0;l<64 && bad < 0;l++)
+          if (d1[k*N+1][l*N+1] != d2[k*N+1][l*N+1]) bad = first+64*k+l;
+    }
+    sprintf(detail,"block size %ld, first value %ld",N,bad);
+    report(bad < 0,"block_DCT uniform DC","0..65535",detail);
+    disalloc_long_matrix(f,64*N+2,64*N+2);
+    disalloc_double_matrix(d1,64*N+2,64*N+2);
+    disalloc_double_matrix(d2,64*N+2,64*N+2);
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+static void check_flat_blocks(void) {
+  /* the DC only transform of flat blocks has to quantise exactly like the
+     full DCT, also where the DC coefficient is a multiple of its weight:
+     uniform 8 and 16 bit blocks and blocks of range 1..flat_range, for all
+     block sizes, uniform weights 1..200 and the scaled default matrices */
+  long sizes[3] = {4, 8, 16};
+  long qualities[6] = {10, 25, 50, 75, 90, 95};
+  const char *kinds[3] = {"uniform", "uniform16", "near flat"};
+  long nx, ny, N, s, c, w, k, l, x, y, b, r, bad;
+  long **f, **q1, **q2;
+  double **d1, **d2;
+  long weights[64];
+  const QuantTable *qt;
+  unsigned long seed = 11;
+  char detail[64];
+
+  for (s=0;s<3;s++) {
+    N = sizes[s];
+    nx = ny = 16*N;
+    alloc_long_matrix(&f,nx+2,ny+2);
+    alloc_long_matrix(&q1,nx+2,ny+2);
+    alloc_long_matrix(&q2,nx+2,ny+2);
+    alloc_double_matrix(&d1,nx+2,ny+2);
+    alloc_double_matrix(&d2,nx+2,ny+2);
+    for (c=0;c<3;c++) {
+      bad = 0;
+      for (w=1;w<=206;w++) {
+        for (k=0;k<64;k++) weights[k] = w;
+        if (w > 200) scale_weights(default_weights,qualities[w-201],weights);
+        qt = get_quant_table(weights,N);
+        for (k=0;k<16;k++)
+          for (l=0;l<16;l++) {
+            b = (c == 1) ? (16*k+l)*257 : 16*k+l;
+            seed = seed*6364136223846793005UL+1442695040888963407UL;
+            r = (c == 2 && qt->flat_range > 0) ?
+                1+(long)((seed >> 33) % min(qt->flat_range,1000)) : 0;
+            for (x=1;x<=N;x++)
+              for (y=1;y<=N;y++) {
+                seed = seed*6364136223846793005UL+1442695040888963407UL;
+                f[k*N+x][l*N+y] = b+(long)((seed >> 33) % (r+1));
+              }
+            f[k*N+1][l*N+1] = b;
+            f[k*N+N][l*N+N] = b+r;
+          }
+        block_DCT(f,nx,ny,N,-1,d1);
+        block_quantise(d1,nx,ny,qt,0,q1);
+        block_DCT(f,nx,ny,N,qt->flat_range,d2);
+        block_quantise(d2,nx,ny,qt,0,q2);
+        if (bad == 0 && !equal_long(q1,q2,nx,ny)) bad = w;
+      }
+      sprintf(detail,"block size %ld, first weight set %ld",N,bad);
+      report(bad == 0,"block_DCT flat DC",kinds[c],detail);
+    }
+    disalloc_long_matrix(f,nx+2,ny+2);
+    disalloc_long_matrix(q1,nx+2,ny+2);
+    disalloc_long_matrix(q2,nx+2,ny+2);
+    disalloc_double_matrix(d1,nx+2,ny+2);
+    disalloc_double_matrix(d2,nx+2,ny+2);
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+static void check_categories(long max_threads) {
+  /* coefficients beyond the categories of 8 bit images, up to 2^20 in
+     magnitude, need an extended alphabet; the decoder has to reproduce the
+     reconstruction with unit weights */
+  long nx = 64, ny = 48, interval = 2, largest = 0, categories;
+  long **quant, **ref_q, **rec, **dec;
+  double **fr;
+  BITWRITER *streams;
+  long *symbols, slices, i, j, t, weights[64];
+  const QuantTable *qt;
+  char detail[64];
+  unsigned long seed = 7;
+
+  for (i=0;i<64;i++) weights[i] = 1;
+  qt = get_quant_table(weights,8);
+  alloc_long_matrix(&quant,nx+2,ny+2);
+  alloc_long_matrix(&ref_q,nx+2,ny+2);
+  alloc_long_matrix(&rec,nx+2,ny+2);
+  alloc_long_matrix(&dec,nx+2,ny+2);
+  alloc_double_matrix(&fr,nx+2,ny+2);
+
+  /* sparse coefficients of random bit length 0..20 and sign */
+  for (i=1;i<=nx;i++)
+    for (j=1;j<=ny;j++) {
+      seed = seed*6364136223846793005UL+1442695040888963407UL;
+      quant[i][j] = (long)((seed >> 40) & ((1L << ((seed >> 33) % 21))-1));
+      if ((seed >> 61) < 4) quant[i][j] = 0;
+      if ((seed >> 32) & 1) quant[i][j] = -quant[i][j];
+      largest = max(largest,labs(quant[i][j]));
+    }
+  categories = channel_categories(quant,nx,ny,8,interval,largest);
+  sprintf(detail,"%ld categories",categories);
+  report(categories > NDCSYMBOLS,"channel_categories","64x48/wide",detail);
+
+  block_requantise(quant,nx,ny,qt,0,ref_q);
+  block_IDCT(ref_q,nx,ny,8,fr);
+  convert_matrix_int(fr,rec,nx,ny);
+  encode_slices(quant,nx,ny,8,interval,categories,1,&streams,&symbols,
+                &slices);
+  for (t=1;t<=max_threads;t++) {
+    for (j=1;j<=nx;j++) memset(dec[j]+1,0,ny*sizeof(long));
+    decode_slices(streams,symbols,slices,nx,ny,interval,categories,t,qt,dec);
+    sprintf(detail,"%ld slices, %ld threads",slices,t);
+    report(equal_long(rec,dec,nx,ny),"block_decode == reconstruction",
+           "64x48/wide",detail);
+  }
+  free_slices(streams,symbols,slices);
+
+  disalloc_long_matrix(quant,nx+2,ny+2);
+  disalloc_long_matrix(ref_q,nx+2,ny+2);
+  disalloc_long_matrix(rec,nx+2,ny+2);
+  disalloc_long_matrix(dec,nx+2,ny+2);
+  disalloc_double_matrix(fr,nx+2,ny+2);
+}
+
+/*--------------------------------------------------------------------------*/
+static void check_lossless(long max_threads) {
+  /* lossless coding: bitstreams independent of the number of threads, and
+     decoded channels identical to the original, for luma like samples
+     0..255 or 0..65535 and colour differences of the reversible colour
+     transform, which has to invert exactly */
+  long nx = 61, ny = 37, kind, i, j, t, k, slices, interval, categories;
+  long intervals[3] = {1000000, 3, 1};
+  long **f, **dec, ***rgb, ***ycbcr;
+  BITWRITER *s1, *s2;
+  char image[64], detail[64];
+  unsigned long seed = 13;
+
+  alloc_long_matrix(&f,nx+2,ny+2);
+  alloc_long_matrix(&dec,nx+2,ny+2);
+  for (kind=0;kind<10;kind++) {
+    synthesise(f,nx,ny,kind % 5);
+    if (kind >= 5) {
+      /* colour difference: two synthetic channels against each other */
+      synthesise(dec,nx,ny,(kind+2) % 4);
+      for (i=1;i<=nx;i++)
+        for (j=1;j<=ny;j++)
+          f[i][j] = dec[i][j]*(kind == 9 ? 257 : 1)-f[i][j];
+    }
+    categories = lossless_categories(kind % 5 == 4 ? 65535 : 255);
+    sprintf(image,"%ldx%ld/%ld%s",nx,ny,kind % 5,kind >= 5 ? "/diff" : "");
+    for (k=0;k<3;k++) {
+      interval = min(intervals[k],ny);
+      slices = (ny+interval-1)/interval;
+      for (t=1;t<=max_threads;t++) {
+        s2 = (BITWRITER*)malloc(slices*WNC_STREAMS*sizeof(BITWRITER));
+        for (j=0;j<slices*WNC_STREAMS;j++) bw_init(&s2[j]);
+        omp_set_num_threads(t);
+        #pragma omp parallel for schedule(dynamic)
+        for (j=0;j<slices;j++)
+          lossless_encode(f,nx,ny,j*interval,interval,categories,0,
+                          &s2[j*WNC_STREAMS]);
+        sprintf(detail,"%ld slices, %ld threads",slices,t);
+        if (t == 1) {
+          s1 = s2;
+        } else {
+          report(same_streams(s1,s2,slices),"lossless_encode threads",image,
+                 detail);
+          for (j=0;j<slices*WNC_STREAMS;j++) bw_free(&s2[j]);
+          free(s2);
+        }
+        for (i=1;i<=nx;i++) memset(dec[i]+1,0,ny*sizeof(long));
+        #pragma omp parallel for schedule(dynamic)
+        for (j=0;j<slices;j++) {
+          BITREADER sym, off;
+          br_init(&sym,s1[j*WNC_STREAMS+STREAM_DC_SYMBOLS].data,
+                  bw_bytes(&s1[j*WNC_STREAMS+STREAM_DC_SYMBOLS]));
+          br_init(&off,s1[j*WNC_STREAMS+STREAM_DC_OFFSETS].data,
+                  bw_bytes(&s1[j*WNC_STREAMS+STREAM_DC_OFFSETS]));
+          lossless_decode(&sym,&off,nx,ny,j*interval,interval,categories,
+                          WNC_R,WNC_M,dec);
+        }
+        report(equal_long(f,dec,nx,ny),"lossless_decode == original",image,
+               detail);
+      }
+      for (j=0;j<slices*WNC_STREAMS;j++) bw_free(&s1[j]);
+      free(s1);
+    }
+  }
+  disalloc_long_matrix(f,nx+2,ny+2);
+  disalloc_long_matrix(dec,nx+2,ny+2);
+
+  /* reversible colour transform on random colours, in place like the
+     program */
+  alloc_long_cubix(&rgb,3,nx+2,ny+2);
+  alloc_long_cubix(&ycbcr,3,nx+2,ny+2);
+  for (k=0;k<3;k++)
+    for (i=1;i<=nx;i++)
+      for (j=1;j<=ny;j++) {
+        seed = seed*6364136223846793005UL+1442695040888963407UL;
+        rgb[k][i][j] = ycbcr[k][i][j] = (long)(seed >> 56);
+      }
+  RGB_to_YCbCr(ycbcr,ycbcr,nx,ny);
+  YCbCr_to_RGB(ycbcr,ycbcr,nx,ny);
+  k = equal_long(rgb[0],ycbcr[0],nx,ny) && equal_long(rgb[1],ycbcr[1],nx,ny)
+      && equal_long(rgb[2],ycbcr[2],nx,ny);
+  report(k,"YCbCr_to_RGB inverts exactly","-","random colours");
+  disalloc_long_cubix(rgb,3,nx+2,ny+2);
+  disalloc_long_cubix(ycbcr,3,nx+2,ny+2);
+}
+
+/*--------------------------------------------------------------------------*/
+static void check_image_io(void) {
+  /* pgm and ppm files with 8 and 16 bit samples: the readers have to return
+     the samples and maximum value written by write_pgm and write_ppm, and
+     the reader from memory those of write_pnm_stream with comments */
+  long maxvals[3] = {255, 4095, 65535};
+  long nx = 23, ny = 11, mx, my, maxval, i, j, k, m, nc, ok, bytes, size;
+  long ***u, ***v, **w;
+  char file[] = "/tmp/jl_checkXXXXXX", detail[64];
+  unsigned char *data;
+  unsigned long seed = 5;
+  FILE *f;
+
+  close(mkstemp(file));
+  alloc_long_cubix(&u,3,nx+2,ny+2);
+  alloc_long_cubix(&v,3,nx+2,ny+2);
+  for (k=0;k<3;k++) {
+    for (m=0;m<3;m++)
+      for (i=1;i<=nx;i++)
+        for (j=1;j<=ny;j++) {
+          seed = seed*6364136223846793005UL+1442695040888963407UL;
+          u[m][i][j] = (long)((seed >> 33) % (maxvals[k]+1));
+        }
+    sprintf(detail,"maxval %ld",maxvals[k]);
+
+    write_ppm(u,nx,ny,maxvals[k],file,0);
+    nc = read_pnm(file,&mx,&my,&maxval,v,nx,ny);
+    ok = nc == 3 && mx == nx && my == ny && maxval == maxvals[k];
+    for (m=0;m<3 && ok;m++) ok = equal_long(u[m],v[m],nx,ny);
+    report(ok,"read_pnm == write_ppm","-",detail);
+    read_ppm_and_allocate_memory(file,&mx,&my,&maxval,&v);
+    ok = maxval == maxvals[k];
+    for (m=0;m<3 && ok;m++) ok = equal_long(u[m],v[m],nx,ny);
+    report(ok,"read_ppm == write_ppm","-",detail);
+
+    write_pgm(u[1],nx,ny,maxvals[k],file,0);
+    nc = read_pnm(file,&mx,&my,&maxval,v,nx,ny);
+    report(nc == 1 && maxval == maxvals[k] && equal_long(u[1],v[0],nx,ny),
+           "read_pnm == write_pgm","-",detail);
+    w = 0;
+    read_pgm_and_allocate_memory(file,&mx,&my,&maxval,&w);
+    report(maxval == maxvals[k] && equal_long(u[1],w,nx,ny),
+           "read_pgm == write_pgm","-",detail);
+    disalloc_long_matrix(w,nx+2,ny+2);
+
+    for (nc=1;nc<=3;nc+=2) {
+      f = fopen(file,"wb");
+      bytes = write_pnm_stream(u,nx,ny,nc,maxvals[k],f,"# comment\n");
+      fclose(f);
+      data = load_file(file,&size);
+      ok = bytes == size &&
+           read_pnm_buffer(data,size,&mx,&my,&maxval,v,nx,ny) == nc &&
+           mx == nx && my == ny && maxval == maxvals[k];
+      for (m=0;m<nc && ok;m++) ok = equal_long(u[m],v[m],nx,ny);
+      report(ok,"read_pnm_buffer == write_pnm_stream",nc == 3 ? "ppm" :
+             "pgm",detail);
+      report(read_pnm_buffer(data,size,&mx,&my,&maxval,v,nx-1,ny) == 0 &&
+             read_pnm_buffer(data,size-1,&mx,&my,&maxval,v,nx,ny) == -1,
+             "read_pnm_buffer too large, truncated",nc == 3 ? "ppm" : "pgm",
+             detail);
+      ok = read_pnm(file,&mx,&my,&maxval,v,nx,ny) == nc;
+      for (m=0;m<nc && ok;m++) ok = equal_long(u[m],v[m],nx,ny);
+      report(ok,"read_pnm == write_pnm_stream",nc == 3 ? "ppm" : "pgm",
+             detail);
+
+      /* both readers share the header parser: a comment after the magic
+         number that is longer than the first chunk read_pnm reads */
+      bytes = nc*nx*ny*(maxvals[k] > 255 ? 2 : 1);
+      f = fopen(file,"wb");
+      fprintf(f,"P%c #",nc == 3 ? '6' : '5');
+      for (i=0;i<5000;i++) fputc('x',f);
+      fprintf(f,"\n%ld %ld %ld\n",nx,ny,maxvals[k]);
+      fwrite(data+size-bytes,1,bytes,f);
+      fclose(f);
+      free(data);
+      data = load_file(file,&size);
+      ok = read_pnm_buffer(data,size,&mx,&my,&maxval,v,nx,ny) == nc &&
+           read_pnm(file,&mx,&my,&maxval,v,nx,ny) == nc &&
+           mx == nx && my == ny && maxval == maxvals[k];
+      for (m=0;m<nc && ok;m++) ok = equal_long(u[m],v[m],nx,ny);
+      report(ok,"read_pnm, read_pnm_buffer long comment",nc == 3 ? "ppm" :
+             "pgm",detail);
+      free(data);
+    }
+  }
+  disalloc_long_cubix(u,3,nx+2,ny+2);
+  disalloc_long_cubix(v,3,nx+2,ny+2);
+  remove(file);
+}
+
+/*--------------------------------------------------------------------------*/
+static void check_wnc(void) {
+  /* adaptive arithmetic coder: round trip of extreme symbol sequences */
+  long n = 5000, i, ok, *src, *dst;
+  long alphabets[4] = {2, NDCSYMBOLS, NSYMBOLS,
+                       AC_ALPHABET(WNC_MAXCATEGORIES)};
+  long a;
+  BITWRITER out;
+  BITREADER in;
+  char detail[64];
+  unsigned long seed = 1;
+
+  alloc_long_vector(&src,n);
+  alloc_long_vector(&dst,n);
+  for (a=0;a<4;a++) {
+    for (i=0;i<n;i++) {
+      seed = seed*6364136223846793005UL+1442695040888963407UL;
+      src[i] = (i < n/2) ? 0 : (long)((seed >> 33) % alphabets[a]);
+    }
+    bw_init(&out);
+    encode_adaptive_wnc(src,n,alphabets[a],WNC_R,WNC_M,0,&out);
+    br_init(&in,out.data,bw_bytes(&out));
+    decode_adaptive_wnc(&in,n,alphabets[a],WNC_R,WNC_M,0,dst);
+    ok = 1;
+    for (i=0;i<n;i++) if (src[i] != dst[i]) ok = 0;
+    sprintf(detail,"alphabet %ld",alphabets[a]);
+    report(ok,"adaptive_wnc round trip","-",detail);
+    bw_free(&out);
+  }
+  disalloc_long_vector(src,n);
+  disalloc_long_vector(dst,n);
+}
+
+/*--------------------------------------------------------------------------*/
+static void check_idct_support(void) {
+  /* the kernels for small supports leave out zero coefficients only and
+     have to give the full transform bit for bit */
+  long coef[64], N, S, i, t, ok;
+  double ab[64], out[64], full[64];
+  char detail[64];
+  unsigned long seed = 7;
+
+  for (N=2;N<=8;N*=2) {
+    init_idct_basis(N,ab);
+    for (S=1;S<=N;S++) {
+      ok = 1;
+      for (t=0;t<100;t++) {
+        for (i=0;i<N*N;i++) {
+          seed = seed*6364136223846793005UL+1442695040888963407UL;
+          coef[i] = (i/N < S && i%N < S) ? (long)((seed >> 33) % 4001)-2000
+                                         : 0;
+        }
+        idct_block(coef,N,S,ab,out);
+        idct_block(coef,N,N,ab,full);
+        if (memcmp(out,full,N*N*sizeof(double)) != 0) ok = 0;
+      }
+      sprintf(detail,"block size %ld, support %ld",N,S);
+      report(ok,"idct_block support","-",detail);
+    }
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+static void check_block_tables(void) {
+  /* the shared tables have to match the tables built on their own, for
+     every block size, and stay at the same aligned address */
+  long zx[256], zy[256], N, u, x, ok;
+  double ab[256];
+  const BlockTables *bt;
+
+  ok = 1;
+  for (N=1;N<=MAXBLOCKSIZE;N++) {
+    bt = get_block_tables(N);
+    if (bt != get_block_tables(N) || (uintptr_t)bt->basis % 64 != 0) ok = 0;
+    init_idct_basis(N,ab);
+    init_zigzag_table(N,zx,zy);
+    if (memcmp(bt->basis,ab,N*N*sizeof(double)) != 0) ok = 0;
+    for (u=0;u<N;u++)
+      for (x=0;x<N;x++)
+        if (bt->basis_t[x*N+u] != ab[u*N+x]) ok = 0;
+    if (memcmp(bt->zigzag_x,zx,N*N*sizeof(long)) != 0 ||
+        memcmp(bt->zigzag_y,zy,N*N*sizeof(long)) != 0) ok = 0;
+  }
+  report(ok,"block tables","-","");
+}
+
+/*--------------------------------------------------------------------------*/
+static void check_quant_table(void) {
+  /* derived forms of a quantisation table and the cache */
+  long weights[64], zx[256], zy[256], seen[256], i, ok, N;
+  const QuantTable *a, *b;
+  char detail[64];
+
+  for (i=0;i<64;i++) weights[i] = 1+i*3;
+  a = get_quant_table(weights,8);
+  b = get_quant_table(default_weights,8);
+  report(a == get_quant_table(weights,8) && a != b &&
+         a != get_quant_table(weights,16),"quant table cache","-","");
+  init_zigzag_table(8,zx,zy);
+  ok = 1;
+  for (i=0;i<64;i++) {
+    if (a->zigzag[i] != weights[8*zx[i]+zy[i]]) ok = 0;
+    if (fabs(a->reciprocal[i]*weights[i]-1.0) > 1e-15) ok = 0;
+    if (fabs(a->scaled[i]*weights[i]-(i/8 ? 0.5 : sqrt(0.125))*
+             (i%8 ? 0.5 : sqrt(0.125))) > 1e-15) ok = 0;
+  }
+  report(ok,"quant table derived forms","-","");
+
+  /* other block sizes: the matrix at frequencies 8u/N, and a zig-zag
+     order that visits every coefficient once */
+  for (N=4;N<=16;N*=4) {
+    a = get_quant_table(weights,N);
+    init_zigzag_table(N,zx,zy);
+    memset(seen,0,sizeof(seen));
+    ok = (a->N == N);
+    for (i=0;i<N*N;i++) {
+      if (a->weights[i] != weights[8*(i/N*8/N)+i%N*8/N]) ok = 0;
+      if (a->zigzag[i] != a->weights[N*zx[i]+zy[i]]) ok = 0;
+      if (i > 0 && labs(zx[i]-zx[i-1]) > 1) ok = 0;
+      seen[N*zx[i]+zy[i]]++;
+    }
+    for (i=0;i<N*N;i++) if (seen[i] != 1) ok = 0;
+    sprintf(detail,"block size %ld, flat range %ld",N,a->flat_range);
+    report(ok,"quant table resampled","-",detail);
+  }
+
+  /* quality scaling like libjpeg */
+  scale_weights(default_weights,50,weights);
+  ok = !memcmp(weights,default_weights,sizeof(weights));
+  scale_weights(default_chroma_weights,100,weights);
+  for (i=0;i<64;i++) if (weights[i] != 1) ok = 0;
+  scale_weights(default_weights,1,weights);
+  for (i=0;i<64;i++) if (weights[i] != default_weights[i]*50) ok = 0;
+  scale_weights(default_weights,75,weights);
+  for (i=0;i<64;i++)
+    if (weights[i] != (default_weights[i]*50+50)/100) ok = 0;
+  report(ok,"quality scaling","-","");
+}
+
+/*--------------------------------------------------------------------------*/
+static long encode_via_file(const unsigned char *pixels, long stride,
+                            long nx, long ny, long nc, const JLParams *params,
+                            unsigned char **data) {
+  /* reference for the library: encode a pnm file like the program does;
+     returns the size of the container loaded into data */
+  char in[] = "/tmp/jl_checkXXXXXX", out[64];
+  EncoderContext ctx;
+  FILE *file;
+  long x, y, size;
+
+  close(mkstemp(in));
+  sprintf(out,"%s.wnc",in);
+  file = fopen(in,"wb");
+  fprintf(file,"%s\n%ld %ld\n255\n",nc == 3 ? "P6" : "P5",nx,ny);
+  for (y=0;y<ny;y++)
+    for (x=0;x<nx*nc;x++) fputc(pixels[y*stride+x],file);
+  fclose(file);
+  init_encoder(&ctx,params->sx,params->sy,
+               params->lossless ? BLOCKSIZE_LOSSLESS : params->block_size,
+               params->restart,params->weights,params->chroma_weights,1);
+  encode_file(&ctx,in,out);
+  destroy_encoder(&ctx);
+  *data = load_file(out,&size);
+  remove(in);
+  remove(out);
+  return size;
+}
+
+static void check_library(void) {
+  /* jl_encode: same containers as the program, reuse of buffers across
+     image sizes, concurrent encoders with different matrices (default, and
+     separate luma and chroma matrices of quality 30 on 16x16 blocks) */
+  long sizes[3][3] = {{75,49,3},{40,24,1},{136,72,3}};
+  long stride[3], i, k, x, y, size, ok;
+  unsigned char *pixels[3], *ref[2][3];
+  long ref_size[2][3];
+  unsigned long seed = 99;
+  JLParams params[2];
+  JLEncoder *enc[2];
+  JLBuffer out[2] = {{0,0,0},{0,0,0}};
+  char image[64];
+
+  jl_default_params(&params[0]);
+  params[0].restart = 2;
+  params[1] = params[0];
+  params[1].block_size = 16;
+  jl_set_quality(&params[1],30);
+  for (i=0;i<3;i++) {
+    stride[i] = sizes[i][0]*sizes[i][2]+5;
+    pixels[i] = (unsigned char*)malloc(stride[i]*sizes[i][1]);
+    for (y=0;y<sizes[i][1];y++)
+      for (x=0;x<stride[i];x++) {
+        seed = seed*6364136223846793005UL+1442695040888963407UL;
+        pixels[i][y*stride[i]+x] = (unsigned char)
+          (((x/3+y)*7+(long)(seed >> 60)) & 255);
+      }
+    for (k=0;k<2;k++)
+      ref_size[k][i] = encode_via_file(pixels[i],stride[i],sizes[i][0],
+                                       sizes[i][1],sizes[i][2],
+                                       &params[k],&ref[k][i]);
+  }
+
+  /* one encoder for all images, growing and shrinking, twice */
+  enc[0] = jl_encoder_create(&params[0]);
+  for (k=0;k<6;k++) {
+    i = k % 3;
+    size = jl_encode(enc[0],pixels[i],stride[i],sizes[i][0],sizes[i][1],
+                     sizes[i][2],&out[0]);
+    sprintf(image,"%ldx%ldx%ld",sizes[i][0],sizes[i][1],sizes[i][2]);
+    report(size == ref_size[0][i] && !memcmp(out[0].data,ref[0][i],size),
+           "jl_encode == program",image,k < 3 ? "" : "reused encoder");
+  }
+  jl_encoder_destroy(enc[0]);
+
+  /* two encoders with different matrices at the same time */
+  enc[0] = jl_encoder_create(&params[0]);
+  enc[1] = jl_encoder_create(&params[1]);
+  ok = 1;
+  #pragma omp parallel for num_threads(2) reduction(&&:ok)
+  for (k=0;k<2;k++) {
+    long j, n;
+    for (j=0;j<30;j++) {
+      n = jl_encode(enc[k],pixels[j%3],stride[j%3],sizes[j%3][0],
+                    sizes[j%3][1],sizes[j%3][2],&out[k]);
+      ok = ok && n == ref_size[k][j%3] &&
+           !memcmp(out[k].data,ref[k][j%3],n);
+    }
+  }
+  report(ok,"jl_encode concurrent","-","2 encoders, 2 matrices");
+  jl_encoder_destroy(enc[0]);
+  jl_encoder_destroy(enc[1]);
+
+  /* lossless coding: same containers as the program with --lossless */
+  params[1] = params[0];
+  params[1].lossless = 1;
+  enc[1] = jl_encoder_create(&params[1]);
+  for (i=0;i<3;i++) {
+    free(ref[1][i]);
+    ref_size[1][i] = encode_via_file(pixels[i],stride[i],sizes[i][0],
+                                     sizes[i][1],sizes[i][2],&params[1],
+                                     &ref[1][i]);
+    size = jl_encode(enc[1],pixels[i],stride[i],sizes[i][0],sizes[i][1],
+                     sizes[i][2],&out[1]);
+    sprintf(image,"%ldx%ldx%ld",sizes[i][0],sizes[i][1],sizes[i][2]);
+    report(size == ref_size[1][i] && !memcmp(out[1].data,ref[1][i],size),
+           "jl_encode == program",image,"lossless");
+  }
+  jl_encoder_destroy(enc[1]);
+
+  params[1] = params[0];
+  params[1].block_size = 12;
+  report(jl_encoder_create(&params[1]) == NULL,"jl_encoder_create invalid",
+         "-","block size 12");
+  params[1].block_size = 8;
+  params[1].weights[0] = 0;
+  report(jl_encoder_create(&params[1]) == NULL,"jl_encoder_create invalid",
+         "-","zero weight");
+  report(jl_set_quality(&params[1],0) == -1 &&
+         jl_set_quality(&params[1],101) == -1,"jl_set_quality invalid","-",
+         "");
+  report(jl_encode(enc[0] = jl_encoder_create(&params[0]),pixels[0],1,
+                   sizes[0][0],sizes[0][1],3,&out[0]) == -1,
+         "jl_encode invalid","-","stride");
+  jl_encoder_destroy(enc[0]);
+
+  for (i=0;i<3;i++) {
+    free(pixels[i]);
+    free(ref[0][i]);
+    free(ref[1][i]);
+  }
+  jl_buffer_free(&out[0]);
+  jl_buffer_free(&out[1]);
+}
+
+/*--------------------------------------------------------------------------*/
+int main(int argc, char **args) {
+  long sizes[4][2] = {{8,8},{40,24},{64,64},{136,72}};
+  long quantisers[3] = {0,1,30};
+  long max_threads = 4, i, k, q, N;
+  double start = get_wall_time();
+
+  if (argc > 1) max_threads = atol(args[1]);
+  if (max_threads < 1) max_threads = 1;
+
+  check_wnc();
+  check_image_io();
+  check_block_tables();
+  check_quant_table();
+  check_idct_support();
+  check_uniform_dc();
+  check_flat_blocks();
+  check_library();
+  check_categories(max_threads);
+  check_lossless(max_threads);
+  for (N=4;N<=16;N*=2)
+    for (i=0;i<4;i++) {
+      if (sizes[i][0] % N != 0 || sizes[i][1] % N != 0) continue;
+      for (k=0;k<5;k++)
+        for (q=0;q<3;q++)
+          check_image(sizes[i][0],sizes[i][1],N,k,quantisers[q],
+                      max_threads);
+    }
+
+  printf("%ld of %ld conformance checks passed (threads 1..%ld, %.2f s)\n",
+         checks-failures,checks,max_threads,get_wall_time()-start);
+  return failures > 0;
+}
@@ -0,0 +1,346 @@
+#!/bin/sh
+#----------------------------------------------------------------------------#
+#                                                                            #
+#  File:       check.sh                                                      #
+#                                                                            #
+#  Purpose:    Bit-exact conformance of the complete program: for a matrix   #
+#              of images, quantisers, subsampling factors, restart           #
+#              intervals and thread counts, the compressed files have to be  #
+#              identical to the single threaded ones, and the decoder has    #
+#              to reproduce the reconstruction of the encoder exactly.       #
+#              Kernel level checks with all thread counts 1..N are done by   #
+#              ic19_jpeg_light_check, this script covers the whole program.  #
+#                                                                            #
+#  usage:      test/check.sh [max_threads]                                   #
+#                                                                            #
+#----------------------------------------------------------------------------#
+
+CODEC=./ic19_jpeg_light
+SYNTH=./ic19_jpeg_light_synth
+THREADS=${1:-4}
+
+# thread counts to compare: single threaded and maximum
+TLIST=1
+[ $THREADS -gt 1 ] && TLIST="1 $THREADS"
+
+WORK=$(mktemp -d)
+trap 'rm -rf $WORK' EXIT
+
+$SYNTH photo 75 49 $WORK/photo.ppm || exit 2
+$SYNTH document 64 40 $WORK/doc.ppm || exit 2
+$SYNTH grey 53 35 $WORK/grey.pgm || exit 2
+
+checks=0
+failures=0
+fail() {
+  failures=$((failures+1))
+  echo "FAIL $*"
+}
+
+for image in $WORK/photo.ppm $WORK/doc.ppm $WORK/grey.pgm; do
+  ext=${image##*.}
+  for qarg in "" "-q 1" "-q 12" "-Q 25"; do
+    for s in 1 2 3x2 4:1:1; do
+      for r in 0 2; do
+        args="-i $image $qarg -s $s -R $r"
+        OMP_NUM_THREADS=1 $CODEC $args -o $WORK/ref > /dev/null
+        for t in $TLIST; do
+          checks=$((checks+2))
+          OMP_NUM_THREADS=$t $CODEC $args -o $WORK/out > /dev/null
+          cmp -s $WORK/ref.wnc $WORK/out.wnc ||
+            fail "$args: compressed file differs with $t threads"
+          OMP_NUM_THREADS=$t $CODEC -i $WORK/out.wnc -o $WORK/out > /dev/null
+          cmp -s $WORK/ref_rec.$ext $WORK/out_dec.$ext ||
+            fail "$args: decoded image differs from reconstruction" \
+                 "with $t threads"
+        done
+      done
+    done
+  done
+done
+
+# saturated blue next to yellow: with unit weights the chroma DC prediction
+# error exceeds 2047 and needs the extended alphabet
+{
+  printf 'P6\n16 8\n255\n'
+  for y in 1 2 3 4 5 6 7 8; do
+    for x in 1 2 3 4 5 6 7 8; do printf '\000\000\377'; done
+    for x in 1 2 3 4 5 6 7 8; do printf '\377\377\000'; done
+  done
+} > $WORK/blue.ppm
+for t in $TLIST; do
+  checks=$((checks+1))
+  OMP_NUM_THREADS=$t $CODEC -i $WORK/blue.ppm -q 1 -s 1 -o $WORK/ref > /dev/null
+  OMP_NUM_THREADS=$t $CODEC -i $WORK/ref.wnc -o $WORK/out > /dev/null
+  cmp -s $WORK/ref_rec.ppm $WORK/out_dec.ppm ||
+    fail "-q 1: extended alphabet not decoded with $t threads"
+done
+
+# other block sizes: same conformance as 8x8 blocks, and reduced size
+# decoding down to blocks of 2x2
+for image in $WORK/photo.ppm $WORK/grey.pgm; do
+  ext=${image##*.}
+  for b in 4 16; do
+    args="-i $image -b $b -Q 40 -s 2 -R 1"
+    OMP_NUM_THREADS=1 $CODEC $args -o $WORK/ref > /dev/null
+    for t in $TLIST; do
+      checks=$((checks+2))
+      OMP_NUM_THREADS=$t $CODEC $args -o $WORK/out > /dev/null
+      cmp -s $WORK/ref.wnc $WORK/out.wnc ||
+        fail "$args: compressed file differs with $t threads"
+      OMP_NUM_THREADS=$t $CODEC -i $WORK/out.wnc -o $WORK/out > /dev/null
+      cmp -s $WORK/ref_rec.$ext $WORK/out_dec.$ext ||
+        fail "$args: decoded image differs from reconstruction" \
+             "with $t threads"
+    done
+    checks=$((checks+1))
+    scale=1/4; [ $b = 16 ] && scale=1/8
+    rm -f $WORK/out_dec.$ext
+    $CODEC -i $WORK/ref.wnc --scale $scale -o $WORK/out > /dev/null
+    [ -s $WORK/out_dec.$ext ] ||
+      fail "$args: no decoded image at scale $scale"
+  done
+done
+
+# lossless coding: the payload of the decoded image has to be the input
+for image in $WORK/photo.ppm $WORK/doc.ppm $WORK/grey.pgm; do
+  ext=${image##*.}
+  size=$(sed -n 2p $image)
+  ch=3; [ $ext = pgm ] && ch=1
+  bytes=$(( ${size% *} * ${size#* } * ch ))
+  for r in 0 3; do
+    args="-i $image --lossless -R $r"
+    OMP_NUM_THREADS=1 $CODEC $args -o $WORK/ref > /dev/null
+    for t in $TLIST; do
+      checks=$((checks+3))
+      OMP_NUM_THREADS=$t $CODEC $args -o $WORK/out > /dev/null
+      cmp -s $WORK/ref.wnc $WORK/out.wnc ||
+        fail "$args: compressed file differs with $t threads"
+      OMP_NUM_THREADS=$t $CODEC -i $WORK/out.wnc -o $WORK/out > /dev/null
+      cmp -s $WORK/ref_rec.$ext $WORK/out_dec.$ext ||
+        fail "$args: decoded image differs from reconstruction" \
+             "with $t threads"
+      tail -c $bytes $image > $WORK/payload
+      tail -c $bytes $WORK/out_dec.$ext | cmp -s - $WORK/payload ||
+        fail "$args: decoded image differs from input with $t threads"
+    done
+  done
+  checks=$((checks+2))
+  rm -f $WORK/out.wnc $WORK/out_dec.$ext
+  $CODEC -i $image --lossless -Q 50 -o $WORK/out > /dev/null
+  [ -f $WORK/out.wnc ] && fail "--lossless: -Q 50 accepted"
+  $CODEC -i $WORK/ref.wnc --scale 1/2 -o $WORK/out > /dev/null
+  [ -f $WORK/out_dec.$ext ] &&
+    fail "--lossless: decoding at scale 1/2 accepted"
+done
+
+# 16 and 12 bit samples: conformance of lossy coding with fine quantisers
+# and block sizes up to 16x16, whose coefficients need more categories, and
+# exact payload of lossless coding
+$SYNTH photo 75 49 $WORK/photo16.ppm 65535 || exit 2
+$SYNTH grey 53 35 $WORK/grey12.pgm 4095 || exit 2
+for image in $WORK/photo16.ppm $WORK/grey12.pgm; do
+  ext=${image##*.}
+  size=$(sed -n 2p $image)
+  ch=3; [ $ext = pgm ] && ch=1
+  bytes=$(( ${size% *} * ${size#* } * ch * 2 ))
+  for args in "-q 1 -s 1 -R 2" "-b 16 -q 3 -s 2" "-Q 50" "--lossless -R 3"; do
+    args="-i $image $args"
+    OMP_NUM_THREADS=1 $CODEC $args -o $WORK/ref > /dev/null
+    for t in $TLIST; do
+      checks=$((checks+2))
+      OMP_NUM_THREADS=$t $CODEC $args -o $WORK/out > /dev/null
+      cmp -s $WORK/ref.wnc $WORK/out.wnc ||
+        fail "$args: compressed file differs with $t threads"
+      OMP_NUM_THREADS=$t $CODEC -i $WORK/out.wnc -o $WORK/out > /dev/null
+      cmp -s $WORK/ref_rec.$ext $WORK/out_dec.$ext ||
+        fail "$args: decoded image differs from reconstruction" \
+             "with $t threads"
+    done
+  done
+  checks=$((checks+1))
+  tail -c $bytes $image > $WORK/payload
+  tail -c $bytes $WORK/out_dec.$ext | cmp -s - $WORK/payload ||
+    fail "--lossless: decoded $image differs from input"
+done
+
+# samples above the maximum value of the header are clipped to it: a 16 bit
+# image with maximum 300 and samples 65535 is coded like one with 300
+{
+  printf 'P5\n16 8\n300\n'
+  for i in $(seq 64); do printf '\000\020\377\377'; done
+} > $WORK/over.pgm
+for i in $(seq 64); do printf '\000\020\001\054'; done > $WORK/payload
+checks=$((checks+1))
+rm -f $WORK/out_dec.pgm
+$CODEC -i $WORK/over.pgm --lossless -o $WORK/out > /dev/null &&
+  $CODEC -i $WORK/out.wnc -o $WORK/out > /dev/null
+tail -c 256 $WORK/out_dec.pgm 2> /dev/null | cmp -s - $WORK/payload ||
+  fail "--lossless: samples above maxval not clipped"
+
+# corrupt headers: subsampling factors beyond 8, a slice beyond the block
+# rows of the image and more AC symbols than coefficients have to be
+# rejected by the header check, before any decoding
+patch() {
+  cp $WORK/ref.wnc $WORK/bad.wnc
+  printf "$2" | dd of=$WORK/bad.wnc bs=1 seek=$1 conv=notrunc 2> /dev/null
+}
+$CODEC -i $WORK/photo.ppm -s 2 -R 2 -o $WORK/ref > /dev/null
+index=$(( 30 + $(od -An -tu1 -j9 -N1 $WORK/ref.wnc) * 128 + 2 ))
+for corruption in "7 \050\050" "$((index+4)) \000\001\000\000" \
+                  "$((index+8)) \177\377\377\377"; do
+  checks=$((checks+1))
+  patch $corruption
+  rm -f $WORK/out_dec.ppm
+  $CODEC -i $WORK/bad.wnc -o $WORK/out | grep -q "ERROR: Invalid" &&
+    [ ! -f $WORK/out_dec.ppm ] ||
+    fail "corrupt header ${corruption%% *}: not rejected"
+done
+
+# custom matrices: the default pair from a file is scaled like -Q, a
+# single uniform matrix is used for all channels like -q
+cat > $WORK/tables.txt <<EOF
+# luma
+10 15 25 37 51 66 82 100    15 19 28 39 52 67 83 101
+25 28 35 45 58 72 88 105    37 39 45 54 66 79 94 111
+51 52 58 66 76 89 103 119   66 67 72 79 89 101 114 130
+82 83 88 94 104 114 127 142 100 101 105 111 119 130 142 156
+# chroma (JPEG Annex K)
+17 18 24 47 99 99 99 99     18 21 26 66 99 99 99 99
+24 26 56 99 99 99 99 99     47 66 99 99 99 99 99 99
+EOF
+for i in 1 2; do
+  echo "99 99 99 99 99 99 99 99 99 99 99 99 99 99 99 99" >> $WORK/tables.txt
+done
+for i in 1 2 3 4 5 6 7 8; do
+  echo "12 12 12 12 12 12 12 12"
+done > $WORK/uniform.txt
+for image in $WORK/photo.ppm $WORK/grey.pgm; do
+  checks=$((checks+3))
+  $CODEC -i $image -Q 70 -o $WORK/ref > /dev/null
+  $CODEC -i $image -Q 70 --tables $WORK/tables.txt -o $WORK/out > /dev/null
+  cmp -s $WORK/ref.wnc $WORK/out.wnc ||
+    fail "--tables: $image differs from -Q 70"
+  $CODEC -i $image -q 12 -o $WORK/ref > /dev/null
+  $CODEC -i $image --tables $WORK/uniform.txt -o $WORK/out > /dev/null
+  cmp -s $WORK/ref.wnc $WORK/out.wnc ||
+    fail "--tables: $image differs from -q 12"
+  cp $WORK/uniform.txt $WORK/invalid.txt
+  echo 12 >> $WORK/invalid.txt
+  $CODEC -i $image --tables $WORK/invalid.txt -o $WORK/out > /dev/null &&
+    fail "--tables: 65 weights accepted"
+done
+
+# every level of a ladder has to be identical to a single encode
+for t in $TLIST; do
+  for image in $WORK/photo.ppm $WORK/grey.pgm; do
+    OMP_NUM_THREADS=$t $CODEC -i $image -s 2 -R 2 --ladder 20,50,90 \
+      -o $WORK/ladder > /dev/null
+    for q in 20 50 90; do
+      checks=$((checks+1))
+      $CODEC -i $image -s 2 -R 2 -Q $q -o $WORK/ref > /dev/null
+      cmp -s $WORK/ref.wnc $WORK/ladder_q$q.wnc ||
+        fail "--ladder: $image quality $q differs from -Q with $t threads"
+    done
+  done
+done
+
+# near flat content: blocks of range 1 are flat at quality 80 but not at
+# 95, so the ladder transforms them fully where -Q 80 computes the DC only;
+# both have to give the same DC, also at exact multiples of the weight
+{
+  printf 'P5\n512 512\n255\n'
+  LC_ALL=C awk 'BEGIN { for (y=0;y<512;y++) for (x=0;x<512;x++) {
+    b = (int(x/8)*7+int(y/8)*13) % 250; p = ((int(x/8)*5+int(y/8)*3) % 9)/8
+    printf "%c", b + (((x*31+y*17+int(x/8)) % 8) < p*8) } }'
+} > $WORK/flat.pgm
+$CODEC -i $WORK/flat.pgm --ladder 80,95 -o $WORK/ladder > /dev/null
+for q in 80 95; do
+  checks=$((checks+1))
+  $CODEC -i $WORK/flat.pgm -Q $q -o $WORK/ref > /dev/null
+  cmp -s $WORK/ref.wnc $WORK/ladder_q$q.wnc ||
+    fail "--ladder: near flat image quality $q differs from -Q"
+done
+
+# batch mode has to produce the same files as single encodes
+for t in $TLIST; do
+  for image in $WORK/photo.ppm $WORK/doc.ppm $WORK/grey.pgm; do
+    echo "$image ${image%.*}_batch.wnc"
+  done | OMP_NUM_THREADS=$t $CODEC --batch - -s 2 -R 2 > /dev/null
+  for image in $WORK/photo.ppm $WORK/doc.ppm $WORK/grey.pgm; do
+    checks=$((checks+1))
+    $CODEC -i $image -s 2 -R 2 -o $WORK/ref > /dev/null
+    cmp -s $WORK/ref.wnc ${image%.*}_batch.wnc ||
+      fail "--batch: $image differs from single encode with $t threads"
+  done
+done
+
+# batch summary: failed images are left out, 16 bit samples count two
+# bytes of input
+checks=$((checks+2))
+printf '%s\n' "$WORK/grey12.pgm $WORK/grey12_batch.wnc" "$WORK/missing.pgm" |
+  $CODEC --batch - > $WORK/batch.txt && fail "--batch: status 0 with failure"
+bytes=$(wc -c < $WORK/grey12_batch.wnc)
+grep -q "^Encoded 1 of 2 images" $WORK/batch.txt &&
+  grep -q "ratio: $(awk "BEGIN { printf \"%f\", 53*35*2/$bytes }"):1" \
+    $WORK/batch.txt ||
+  fail "--batch: summary of 16 bit image with failure"
+
+# batch workers with tracing: the slices of an image have to be recorded
+# by the worker that encodes it, not by thread 0 of its inner region
+checks=$((checks+1))
+for i in 1 2; do
+  for image in $WORK/photo.ppm $WORK/doc.ppm $WORK/grey.pgm; do
+    echo "$image ${image%.*}_batch$i.wnc"
+  done
+done | OMP_NUM_THREADS=4 $CODEC --batch - -s 2 -R 2 \
+  --trace $WORK/batch.json > /dev/null
+tids() {
+  echo $(grep "\"$1\"" $WORK/batch.json |
+         sed 's/.*"tid": \([0-9]*\).*/\1/' | sort -u)
+}
+[ "$(tids dct)" = "$(tids block_encode)" ] ||
+  fail "--batch --trace: slices recorded by threads $(tids block_encode)" \
+       "instead of $(tids dct)"
+
+# pipelines: standard input and output have to give the same container and
+# decoded image as files, the format is recognised by the content
+for image in $WORK/photo.ppm $WORK/grey12.pgm; do
+  ext=${image##*.}
+  for args in "-s 2 -R 2" "--lossless"; do
+    checks=$((checks+3))
+    $CODEC -i $image $args -o $WORK/ref > /dev/null
+    $CODEC -i $WORK/ref.wnc -o $WORK/ref > /dev/null
+    $CODEC -i - $args -o - < $image > $WORK/pipe.wnc 2> /dev/null
+    cmp -s $WORK/ref.wnc $WORK/pipe.wnc ||
+      fail "$args: container on stdout differs for $image"
+    $CODEC -i - -o - < $WORK/ref.wnc 2> /dev/null |
+      cmp -s - $WORK/ref_dec.$ext ||
+      fail "$args: decoded image on stdout differs for $image"
+    cp $WORK/ref.wnc $WORK/container.bin
+    $CODEC -i $WORK/container.bin -o $WORK/out > /dev/null
+    cmp -s $WORK/ref_dec.$ext $WORK/out_dec.$ext ||
+      fail "$args: container not recognised without extension"
+  done
+done
+
+# a header on one line is read by the batch mode as by -i, and failures
+# in a pipeline exit with a nonzero status
+checks=$((checks+3))
+{
+  printf 'P6 75 49 255\n'
+  tail -c $((75*49*3)) $WORK/photo.ppm
+} > $WORK/line.ppm
+$CODEC -i $WORK/line.ppm -s 2 -R 2 -o $WORK/ref > /dev/null
+echo "$WORK/line.ppm $WORK/line_batch.wnc" |
+  $CODEC --batch - -s 2 -R 2 > /dev/null &&
+  cmp -s $WORK/ref.wnc $WORK/line_batch.wnc ||
+  fail "--batch: header on one line not read as with -i"
+printf garbage | $CODEC -i - -o - > /dev/null 2>&1 &&
+  fail "-i - -o -: exit status 0 for unknown input"
+head -c 100 $WORK/ref.wnc | $CODEC -i - -o - > /dev/null 2>&1 &&
+  fail "-i - -o -: exit status 0 for truncated container"
+
+echo "$((checks-failures)) of $checks program conformance checks passed" \
+     "(threads $TLIST)"
+[ $failures -eq 0 ]